@@ -27,6 +27,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <math.h>
 #include <time.h>
 #include <pty.h>
@@ -44,6 +45,13 @@ static char *option_font = "mono";
 static int option_font_size = 14;
 static char *option_term = "xterm";
 static char *option_shell;
+static int option_benchmark;
+
+/* The pty is read in chunks of TERMINAL_READ_SIZE until it is empty,
+ * but no more than TERMINAL_READ_MAX per wakeup so that a flood of
+ * output cannot starve the frame callbacks. */
+#define TERMINAL_READ_SIZE	(64 * 1024)
+#define TERMINAL_READ_MAX	(16 * TERMINAL_READ_SIZE)
 
 static struct wl_list terminal_list;
 
@@ -366,6 +374,11 @@ enum escape_state {
 #define ESC_FLAG_DQUOTE	0x20
 #define ESC_FLAG_SPACE	0x40
 
+union decoded_attr {
+	struct attr attr;
+	uint32_t key;
+};
+
 enum {
 	SELECT_NONE,
 	SELECT_CHAR,
@@ -408,8 +421,22 @@ struct terminal {
 	struct terminal_color color_table[256];
 	cairo_font_extents_t extents;
 	cairo_scaled_font_t *font_normal, *font_bold;
+	struct glyph_cache *glyph_cache;
 	uint32_t hide_cursor_serial;
 
+	/* The rendered cells, kept between frames so that only the rows
+	 * marked dirty have to be drawn again. */
+	cairo_surface_t *cells;
+	int32_t cells_scale;
+	char *dirty;
+	int dirty_all;
+	union decoded_attr *row_attr;
+	int cursor_row, cursor_column, cursor_state;
+	/* rows scroll_top to scroll_bottom have moved up by scroll_count
+	 * since the cells were drawn; the pixels are moved along */
+	int scroll_top, scroll_bottom, scroll_count;
+	int scrolled;
+
 	struct wl_data_source *selection;
 	uint32_t button_time;
 	int dragging, click_count;
@@ -510,10 +537,75 @@ terminal_get_attr_row(struct terminal *terminal, int row)
 	return &terminal->data_attr[index * terminal->width];
 }
 
-union decoded_attr {
-	struct attr attr;
-	uint32_t key;
-};
+static void
+terminal_damage_rows(struct terminal *terminal, int first, int last)
+{
+	int i;
+
+	if (first < 0)
+		first = 0;
+	for (i = first; i <= last && i < terminal->height; i++)
+		terminal->dirty[i] = 1;
+}
+
+static void
+terminal_damage_row(struct terminal *terminal, int row)
+{
+	terminal_damage_rows(terminal, row, row);
+}
+
+static void
+terminal_damage_all(struct terminal *terminal)
+{
+	terminal->dirty_all = 1;
+}
+
+/* Records that rows first to last moved up by d rows, or down for a
+ * negative d, so that the next redraw can move the rendered rows along
+ * and only draw the rows that scrolled in. */
+static void
+terminal_scroll_cells(struct terminal *terminal, int first, int last, int d)
+{
+	int n = last - first + 1;
+
+	if (d == 0 || n <= 0)
+		return;
+
+	/* only one region can be pending, draw the other one again */
+	if (terminal->scroll_count != 0 &&
+	    (terminal->scroll_top != first || terminal->scroll_bottom != last)) {
+		terminal_damage_rows(terminal, terminal->scroll_top,
+				     terminal->scroll_bottom);
+		terminal->scroll_count = 0;
+	}
+
+	terminal->scroll_top = first;
+	terminal->scroll_bottom = last;
+	terminal->scroll_count += d;
+	if (abs(terminal->scroll_count) >= n || abs(d) >= n) {
+		terminal_damage_rows(terminal, first, last);
+		terminal->scroll_count = 0;
+		return;
+	}
+
+	/* the dirty flags and the drawn cursor move with the rows */
+	if (d > 0) {
+		memmove(&terminal->dirty[first], &terminal->dirty[first + d],
+			n - d);
+		memset(&terminal->dirty[last - d + 1], 1, d);
+	} else {
+		memmove(&terminal->dirty[first - d], &terminal->dirty[first],
+			n + d);
+		memset(&terminal->dirty[first], 1, -d);
+	}
+
+	if (terminal->cursor_row >= first && terminal->cursor_row <= last) {
+		terminal->cursor_row -= d;
+		if (terminal->cursor_row < first ||
+		    terminal->cursor_row > last)
+			terminal->cursor_row = -1;
+	}
+}
 
 static void
 terminal_decode_attr(struct terminal *terminal, int row, int col,
@@ -571,6 +663,7 @@ terminal_scroll_buffer(struct terminal *terminal, int d)
 	int i;
 
 	d = d % (terminal->height + 1);
+	terminal_scroll_cells(terminal, 0, terminal->height - 1, d);
 	terminal->start = (terminal->start + d) % terminal->height;
 	if (terminal->start < 0) terminal->start = terminal->height + terminal->start;
 	if(d < 0) {
@@ -598,10 +691,25 @@ terminal_scroll_window(struct terminal *terminal, int d)
 	int i;
 	int window_height;
 	int from_row, to_row;
+	int selection;
 	
 	// scrolling range is inclusive
 	window_height = terminal->margin_bottom - terminal->margin_top + 1;
 	d = d % (window_height + 1);
+	/* The selection stays where it is while the text moves.  Damage
+	 * its rows before the scroll too, those flags move along with the
+	 * highlighted pixels and get them redrawn where they land. */
+	selection =
+		terminal->selection_start_row != terminal->selection_end_row ||
+		terminal->selection_start_col != terminal->selection_end_col;
+	if (selection)
+		terminal_damage_rows(terminal, terminal->selection_start_row,
+				     terminal->selection_end_row);
+	terminal_scroll_cells(terminal,
+			      terminal->margin_top, terminal->margin_bottom, d);
+	if (selection)
+		terminal_damage_rows(terminal, terminal->selection_start_row,
+				     terminal->selection_end_row);
 	if(d < 0) {
 		d = 0 - d;
 		to_row = terminal->margin_bottom;
@@ -657,6 +765,7 @@ terminal_shift_line(struct terminal *terminal, int d)
 	
 	row = terminal_get_row(terminal, terminal->row);
 	attr_row = terminal_get_attr_row(terminal, terminal->row);
+	terminal_damage_row(terminal, terminal->row);
 
 	if ((terminal->width + d) <= terminal->column)
 		d = terminal->column + 1 - terminal->width;
@@ -688,7 +797,8 @@ terminal_resize_cells(struct terminal *terminal, int width, int height)
 	size_t size;
 	union utf8_char *data;
 	struct attr *data_attr;
-	char *tab_ruler;
+	char *tab_ruler, *dirty;
+	union decoded_attr *row_attr;
 	int data_pitch, attr_pitch;
 	int i, l, total_rows;
 	struct rectangle allocation;
@@ -703,6 +813,8 @@ terminal_resize_cells(struct terminal *terminal, int width, int height)
 	attr_pitch = width * sizeof(struct attr);
 	data_attr = malloc(attr_pitch * height);
 	tab_ruler = malloc(width);
+	dirty = malloc(height);
+	row_attr = malloc(width * sizeof *row_attr);
 	memset(data, 0, size);
 	memset(tab_ruler, 0, width);
 	attr_init(data_attr, terminal->curr_attr, width * height);
@@ -730,6 +842,8 @@ terminal_resize_cells(struct terminal *terminal, int width, int height)
 		free(terminal->data);
 		free(terminal->data_attr);
 		free(terminal->tab_ruler);
+		free(terminal->dirty);
+		free(terminal->row_attr);
 	}
 
 	terminal->data_pitch = data_pitch;
@@ -741,7 +855,10 @@ terminal_resize_cells(struct terminal *terminal, int width, int height)
 	terminal->data = data;
 	terminal->data_attr = data_attr;
 	terminal->tab_ruler = tab_ruler;
+	terminal->dirty = dirty;
+	terminal->row_attr = row_attr;
 	terminal_init_tabs(terminal);
+	terminal_damage_all(terminal);
 
 	/* Update the window size */
 	ws.ws_row = terminal->height;
@@ -880,12 +997,13 @@ glyph_run_flush(struct glyph_run *run, union decoded_attr attr)
 			font = run->terminal->font_bold;
 		else
 			font = run->terminal->font_normal;
-		cairo_set_scaled_font(run->cr, font);
 		terminal_set_color(run->terminal, run->cr,
 				   run->attr.attr.fg);
 
 		if (!(run->attr.attr.a & ATTRMASK_CONCEALED))
-			cairo_show_glyphs (run->cr, run->glyphs, run->count);
+			glyph_cache_show_glyphs(run->terminal->glyph_cache,
+						run->cr, font,
+						run->glyphs, run->count);
 		run->g = run->glyphs;
 		run->count = 0;
 	}
@@ -915,98 +1033,114 @@ glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 }
 
 
+/* The cursor is drawn inverted while the window has focus and as an
+ * outline otherwise. */
+enum {
+	CURSOR_HIDDEN,
+	CURSOR_BLOCK,
+	CURSOR_OUTLINE
+};
+
 static void
-redraw_handler(struct widget *widget, void *data)
+terminal_update_cursor(struct terminal *terminal)
 {
-	struct terminal *terminal = data;
-	struct rectangle allocation;
-	cairo_t *cr;
-	int top_margin, side_margin;
-	int row, col, cursor_x, cursor_y;
+	int state;
+
+	if (!(terminal->mode & MODE_SHOW_CURSOR))
+		state = CURSOR_HIDDEN;
+	else if (window_has_focus(terminal->window))
+		state = CURSOR_BLOCK;
+	else
+		state = CURSOR_OUTLINE;
+
+	if (state == terminal->cursor_state &&
+	    terminal->row == terminal->cursor_row &&
+	    terminal->column == terminal->cursor_column)
+		return;
+
+	terminal_damage_row(terminal, terminal->cursor_row);
+	terminal_damage_row(terminal, terminal->row);
+	terminal->cursor_state = state;
+	terminal->cursor_row = terminal->row;
+	terminal->cursor_column = terminal->column;
+}
+
+static void
+terminal_draw_row(struct terminal *terminal, cairo_t *cr, int row)
+{
+	union decoded_attr *attr = terminal->row_attr;
 	union utf8_char *p_row;
-	union decoded_attr attr;
-	int text_x, text_y;
-	cairo_surface_t *surface;
-	double d;
 	struct glyph_run run;
 	cairo_font_extents_t extents;
+	int col, end, bg, text_x, text_y;
+	double top, d;
 
-	surface = window_get_surface(terminal->window);
-	widget_get_allocation(terminal->widget, &allocation);
-	cr = widget_cairo_create(terminal->widget);
-	cairo_rectangle(cr, allocation.x, allocation.y,
-			allocation.width, allocation.height);
+	extents = terminal->extents;
+	top = row * extents.height;
+
+	/* decode every cell once, for both passes below */
+	for (col = 0; col < terminal->width; col++)
+		terminal_decode_attr(terminal, row, col, &attr[col]);
+
+	cairo_save(cr);
+	cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+	cairo_rectangle(cr, 0, top,
+			terminal->width * extents.max_x_advance,
+			extents.height);
 	cairo_clip(cr);
-	cairo_push_group(cr);
 
+	/* paint the background, one rectangle per run of equal color */
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	terminal_set_color(terminal, cr, terminal->color_scheme->border);
 	cairo_paint(cr);
+	for (col = 0; col < terminal->width; col = end) {
+		bg = attr[col].attr.bg;
+		for (end = col + 1; end < terminal->width; end++)
+			if (attr[end].attr.bg != bg)
+				break;
 
-	cairo_set_scaled_font(cr, terminal->font_normal);
-
-	extents = terminal->extents;
-	side_margin = (allocation.width - terminal->width * extents.max_x_advance) / 2;
-	top_margin = (allocation.height - terminal->height * extents.height) / 2;
-
-	cairo_set_line_width(cr, 1.0);
-	cairo_translate(cr, allocation.x + side_margin,
-			allocation.y + top_margin);
-	/* paint the background */
-	for (row = 0; row < terminal->height; row++) {
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
-
-			if (attr.attr.bg == terminal->color_scheme->border)
-				continue;
+		if (bg == terminal->color_scheme->border)
+			continue;
 
-			terminal_set_color(terminal, cr, attr.attr.bg);
-			cairo_move_to(cr, col * extents.max_x_advance,
-				      row * extents.height);
-			cairo_rel_line_to(cr, extents.max_x_advance, 0);
-			cairo_rel_line_to(cr, 0, extents.height);
-			cairo_rel_line_to(cr, -extents.max_x_advance, 0);
-			cairo_close_path(cr);
-			cairo_fill(cr);
-		}
+		terminal_set_color(terminal, cr, bg);
+		cairo_rectangle(cr, col * extents.max_x_advance, top,
+				(end - col) * extents.max_x_advance,
+				extents.height);
+		cairo_fill(cr);
 	}
 
+	cairo_set_antialias(cr, CAIRO_ANTIALIAS_DEFAULT);
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
 	/* paint the foreground */
 	glyph_run_init(&run, terminal, cr);
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
-
-			glyph_run_flush(&run, attr);
-
-			text_x = col * extents.max_x_advance;
-			text_y = extents.ascent + row * extents.height;
-			if (attr.attr.a & ATTRMASK_UNDERLINE) {
-				terminal_set_color(terminal, cr, attr.attr.fg);
-				cairo_move_to(cr, text_x, (double)text_y + 1.5);
-				cairo_line_to(cr, text_x + extents.max_x_advance, (double) text_y + 1.5);
-				cairo_stroke(cr);
-			}
-
-			glyph_run_add(&run, text_x, text_y, &p_row[col]);
+	p_row = terminal_get_row(terminal, row);
+	for (col = 0; col < terminal->width; col++) {
+		glyph_run_flush(&run, attr[col]);
+
+		text_x = col * extents.max_x_advance;
+		text_y = extents.ascent + row * extents.height;
+		if (attr[col].attr.a & ATTRMASK_UNDERLINE) {
+			terminal_set_color(terminal, cr, attr[col].attr.fg);
+			cairo_move_to(cr, text_x, (double)text_y + 1.5);
+			cairo_line_to(cr, text_x + extents.max_x_advance, (double) text_y + 1.5);
+			cairo_stroke(cr);
 		}
+
+		glyph_run_add(&run, text_x, text_y, &p_row[col]);
 	}
 
-	attr.key = ~0;
-	glyph_run_flush(&run, attr);
+	attr[0].key = ~0;
+	glyph_run_flush(&run, attr[0]);
 
-	if ((terminal->mode & MODE_SHOW_CURSOR) &&
-	    !window_has_focus(terminal->window)) {
+	if (terminal->cursor_state == CURSOR_OUTLINE &&
+	    terminal->cursor_row == row) {
 		d = 0.5;
 
-		cairo_set_line_width(cr, 1);
+		terminal_set_color(terminal, cr,
+				   terminal->color_scheme->default_attr.fg);
 		cairo_move_to(cr, terminal->column * extents.max_x_advance + d,
-			      terminal->row * extents.height + d);
+			      top + d);
 		cairo_rel_line_to(cr, extents.max_x_advance - 2 * d, 0);
 		cairo_rel_line_to(cr, 0, extents.height - 2 * d);
 		cairo_rel_line_to(cr, -extents.max_x_advance + 2 * d, 0);
@@ -1015,10 +1149,189 @@ redraw_handler(struct widget *widget, void *data)
 		cairo_stroke(cr);
 	}
 
-	cairo_pop_group_to_source(cr);
-	cairo_paint(cr);
+	cairo_restore(cr);
+}
+
+static void
+terminal_blit_cells(struct terminal *terminal)
+{
+	unsigned char *top;
+	int row_size, n, d;
+
+	cairo_surface_flush(terminal->cells);
+	row_size = cairo_image_surface_get_stride(terminal->cells) *
+		terminal->extents.height * terminal->cells_scale;
+	top = cairo_image_surface_get_data(terminal->cells) +
+		terminal->scroll_top * row_size;
+	n = terminal->scroll_bottom - terminal->scroll_top + 1;
+	d = terminal->scroll_count;
+
+	if (d > 0)
+		memmove(top, top + d * row_size, (n - d) * row_size);
+	else
+		memmove(top - d * row_size, top, (n + d) * row_size);
+	cairo_surface_mark_dirty(terminal->cells);
+
+	terminal->scroll_count = 0;
+	terminal->scrolled = 1;
+}
+
+/* Brings the cell image up to date and returns it; the rows that were
+ * drawn again are left marked in terminal->dirty. */
+static cairo_surface_t *
+terminal_draw_cells(struct terminal *terminal, int32_t scale)
+{
+	int32_t width, height;
+	cairo_t *cr;
+	int row;
+
+	width = ceil(terminal->width * terminal->extents.max_x_advance);
+	height = ceil(terminal->height * terminal->extents.height);
+
+	if (terminal->cells &&
+	    (terminal->cells_scale != scale ||
+	     cairo_image_surface_get_width(terminal->cells) != width * scale ||
+	     cairo_image_surface_get_height(terminal->cells) != height * scale)) {
+		cairo_surface_destroy(terminal->cells);
+		terminal->cells = NULL;
+	}
+
+	if (!terminal->cells) {
+		terminal->cells =
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+						   width * scale,
+						   height * scale);
+		terminal->cells_scale = scale;
+		terminal->dirty_all = 1;
+	}
+
+	if (terminal->dirty_all) {
+		memset(terminal->dirty, 1, terminal->height);
+		terminal->scroll_count = 0;
+	} else if (terminal->scroll_count != 0) {
+		terminal_blit_cells(terminal);
+	}
+
+	cr = cairo_create(terminal->cells);
+	cairo_scale(cr, scale, scale);
+	cairo_set_line_width(cr, 1.0);
+	for (row = 0; row < terminal->height; row++)
+		if (terminal->dirty[row])
+			terminal_draw_row(terminal, cr, row);
+	cairo_destroy(cr);
+
+	return terminal->cells;
+}
+
+/* Damage a rectangle and add it to the path painting is clipped to. */
+static void
+terminal_damage_region(struct terminal *terminal, cairo_t *cr,
+		       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	widget_damage(terminal->widget, x, y, width, height);
+	cairo_rectangle(cr, x, y, width, height);
+}
+
+static void
+redraw_handler(struct widget *widget, void *data)
+{
+	struct terminal *terminal = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+	int top_margin, side_margin;
+	int row, first, cursor_x, cursor_y, i, count;
+	int32_t scale, width, height;
+	const struct rectangle *stale;
+	cairo_surface_t *cells;
+	cairo_matrix_t matrix;
+	cairo_font_extents_t extents;
+
+	widget_get_allocation(terminal->widget, &allocation);
+	extents = terminal->extents;
+	side_margin = (allocation.width - terminal->width * extents.max_x_advance) / 2;
+	top_margin = (allocation.height - terminal->height * extents.height) / 2;
+
+	terminal_update_cursor(terminal);
+	scale = window_get_buffer_scale(terminal->window);
+	cells = terminal_draw_cells(terminal, scale);
+	width = cairo_image_surface_get_width(cells) / scale;
+	height = cairo_image_surface_get_height(cells) / scale;
+
+	/* Only the rows that changed are damaged. Painting is clipped
+	 * to those and to what the toolkit repaints around us, which
+	 * includes what a reused buffer missed since it was drawn. */
+	cr = widget_cairo_create(terminal->widget);
+	cairo_rectangle(cr, allocation.x, allocation.y,
+			allocation.width, allocation.height);
+	cairo_clip(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+	if (terminal->dirty_all) {
+		terminal_damage_region(terminal, cr, allocation.x, allocation.y,
+				       allocation.width, allocation.height);
+	} else {
+		if (terminal->scrolled)
+			terminal_damage_region(terminal, cr,
+					       allocation.x + side_margin,
+					       allocation.y + top_margin +
+					       terminal->scroll_top *
+					       extents.height,
+					       width,
+					       (terminal->scroll_bottom -
+						terminal->scroll_top + 1) *
+					       extents.height);
+
+		row = 0;
+		while (row < terminal->height) {
+			if (!terminal->dirty[row]) {
+				row++;
+				continue;
+			}
+
+			/* one rectangle for each run of dirty rows */
+			first = row;
+			while (row < terminal->height && terminal->dirty[row])
+				row++;
+			terminal_damage_region(terminal, cr,
+					       allocation.x + side_margin,
+					       allocation.y + top_margin +
+					       floor(first * extents.height),
+					       width,
+					       ceil(row * extents.height) -
+					       floor(first * extents.height));
+		}
+	}
+
+	count = widget_get_buffer_damage(widget, &stale);
+	if (terminal->dirty_all || count < 0) {
+		cairo_new_path(cr);
+	} else {
+		for (i = 0; i < count; i++)
+			cairo_rectangle(cr, stale[i].x, stale[i].y,
+					stale[i].width, stale[i].height);
+		cairo_clip(cr);
+	}
+
+	cairo_translate(cr, allocation.x + side_margin,
+			allocation.y + top_margin);
+	cairo_set_source_surface(cr, cells, 0, 0);
+	cairo_matrix_init_scale(&matrix, scale, scale);
+	cairo_pattern_set_matrix(cairo_get_source(cr), &matrix);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+	cairo_rectangle(cr, 0, 0, width, height);
+	cairo_fill(cr);
+
+	terminal_set_color(terminal, cr, terminal->color_scheme->border);
+	cairo_set_fill_rule(cr, CAIRO_FILL_RULE_EVEN_ODD);
+	cairo_rectangle(cr, -side_margin, -top_margin,
+			allocation.width, allocation.height);
+	cairo_rectangle(cr, 0, 0, width, height);
+	cairo_fill(cr);
 	cairo_destroy(cr);
-	cairo_surface_destroy(surface);
+
+	memset(terminal->dirty, 0, terminal->height);
+	terminal->dirty_all = 0;
+	terminal->scrolled = 0;
 
 	if (terminal->send_cursor_position) {
 		cursor_x = side_margin + allocation.x +
@@ -1079,10 +1392,12 @@ handle_term_parameter(struct terminal *terminal, int code, int sr)
 				attr_init(terminal_get_attr_row(terminal, i),
 				    terminal->curr_attr, terminal->width);
 			}
+			terminal_damage_all(terminal);
 			break;
 		case 5:  /* DECSCNM */
 			if (sr)	terminal->mode |=  MODE_INVERSE;
 			else	terminal->mode &= ~MODE_INVERSE;
+			terminal_damage_all(terminal);
 			break;
 		case 6:  /* DECOM */
 			terminal->origin_mode = sr;
@@ -1290,6 +1605,13 @@ handle_escape(struct terminal *terminal)
 	case 'J':    /* ED */
 		row = terminal_get_row(terminal, terminal->row);
 		attr_row = terminal_get_attr_row(terminal, terminal->row);
+		if (!set[0] || args[0] == 0 || args[0] > 2)
+			terminal_damage_rows(terminal, terminal->row,
+					     terminal->height - 1);
+		else if (args[0] == 1)
+			terminal_damage_rows(terminal, 0, terminal->row);
+		else
+			terminal_damage_all(terminal);
 		if (!set[0] || args[0] == 0 || args[0] > 2) {
 			memset(&row[terminal->column],
 			       0, (terminal->width - terminal->column) * sizeof(union utf8_char));
@@ -1322,6 +1644,7 @@ handle_escape(struct terminal *terminal)
 	case 'K':    /* EL */
 		row = terminal_get_row(terminal, terminal->row);
 		attr_row = terminal_get_attr_row(terminal, terminal->row);
+		terminal_damage_row(terminal, terminal->row);
 		if (!set[0] || args[0] == 0 || args[0] > 2) {
 			memset(&row[terminal->column], 0,
 			    (terminal->width - terminal->column) * sizeof(union utf8_char));
@@ -1350,6 +1673,7 @@ handle_escape(struct terminal *terminal)
 			       0, terminal->data_pitch);
 			attr_init(terminal_get_attr_row(terminal, terminal->row),
 				terminal->curr_attr, terminal->width);
+			terminal_damage_row(terminal, terminal->row);
 		}
 		break;
 	case 'M':    /* DL */
@@ -1365,6 +1689,7 @@ handle_escape(struct terminal *terminal)
 		} else if (terminal->row == terminal->margin_bottom) {
 			memset(terminal_get_row(terminal, terminal->row),
 			       0, terminal->data_pitch);
+			terminal_damage_row(terminal, terminal->row);
 		}
 		break;
 	case 'P':    /* DCH */
@@ -1387,6 +1712,7 @@ handle_escape(struct terminal *terminal)
 		attr_row = terminal_get_attr_row(terminal, terminal->row);
 		memset(&row[terminal->column], 0, count * sizeof(union utf8_char));
 		attr_init(&attr_row[terminal->column], terminal->curr_attr, count);
+		terminal_damage_row(terminal, terminal->row);
 		break;
 	case 'Z':    /* CBT */
 		count = set[0] ? args[0] : 1;
@@ -1579,6 +1905,7 @@ handle_non_csi_escape(struct terminal *terminal, char code)
 		break;
 	case 'c':    /* RIS */
 		terminal_init(terminal);
+		terminal_damage_all(terminal);
 		break;
 	case 'H':    /* HTS */
 		terminal->tab_ruler[terminal->column] = 1;
@@ -1627,6 +1954,7 @@ handle_special_escape(struct terminal *terminal, char special, char code)
 			for(i = 0; i < numChars; i++) {
 				terminal->data[i].byte[0] = 'E';
 			}
+			terminal_damage_all(terminal);
 			break;
 		default:
 			fprintf(stderr, "Unknown HASH escape #%c\n", code);
@@ -1770,6 +2098,7 @@ handle_special_char(struct terminal *terminal, char c)
 				row[terminal->column].byte[0] = ' ';
 				row[terminal->column].byte[1] = '\0';
 				attr_row[terminal->column] = terminal->curr_attr;
+				terminal_damage_row(terminal, terminal->row);
 			}
 
 			terminal->column++;
@@ -1857,6 +2186,7 @@ handle_char(struct terminal *terminal, union utf8_char utf8)
 		terminal_shift_line(terminal, +1);
 	row[terminal->column] = utf8;
 	attr_row[terminal->column++] = terminal->curr_attr;
+	terminal_damage_row(terminal, terminal->row);
 
 	if (utf8.ch != terminal->last_char.ch)
 		terminal->last_char = utf8;
@@ -2028,8 +2358,6 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 			handle_char(terminal, utf8);
 		} /* if */
 	} /* for */
-
-	window_schedule_redraw(terminal->window);
 }
 
 static void
@@ -2346,6 +2674,8 @@ keyboard_focus_handler(struct window *window,
 {
 	struct terminal *terminal = data;
 
+	/* the cursor is drawn differently without focus */
+	terminal_damage_row(terminal, terminal->cursor_row);
 	window_schedule_redraw(terminal->window);
 }
 
@@ -2453,6 +2783,8 @@ recompute_selection(struct terminal *terminal)
 			terminal->selection_start_col = eol;
 	}
 
+	terminal_damage_all(terminal);
+
 	return 1;
 }
 
@@ -2552,6 +2884,7 @@ terminal_create(struct display *display)
 	init_color_table(terminal);
 
 	terminal->display = display;
+	terminal->glyph_cache = display_get_glyph_cache(display);
 	terminal->margin = 5;
 
 	window_set_user_data(terminal->window, terminal);
@@ -2584,6 +2917,8 @@ terminal_create(struct display *display)
 	cairo_scaled_font_reference(terminal->font_normal);
 
 	cairo_font_extents(cr, &terminal->extents);
+	/* whole pixel rows, so scrolling can move the rendered rows */
+	terminal->extents.height = ceil(terminal->extents.height);
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
 
@@ -2599,6 +2934,8 @@ static void
 terminal_destroy(struct terminal *terminal)
 {
 	display_unwatch_fd(terminal->display, terminal->master);
+	if (terminal->cells)
+		cairo_surface_destroy(terminal->cells);
 	window_destroy(terminal->window);
 	close(terminal->master);
 	wl_list_remove(&terminal->link);
@@ -2614,19 +2951,28 @@ io_handler(struct task *task, uint32_t events)
 {
 	struct terminal *terminal =
 		container_of(task, struct terminal, io_task);
-	char buffer[256];
-	int len;
+	static char buffer[TERMINAL_READ_SIZE];
+	ssize_t len, total = 0;
 
-	if (events & EPOLLHUP) {
-		terminal_destroy(terminal);
-		return;
-	}
+	while (total < TERMINAL_READ_MAX) {
+		len = read(terminal->master, buffer, sizeof buffer);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (len <= 0) {
+			terminal_destroy(terminal);
+			return;
+		}
 
-	len = read(terminal->master, buffer, sizeof buffer);
-	if (len < 0)
-		terminal_destroy(terminal);
-	else
 		terminal_data(terminal, buffer, len);
+		total += len;
+		if (len < (ssize_t) sizeof buffer)
+			break;
+	}
+
+	/* The redraw waits for the frame callback of the previous one, so
+	 * however much was read, the terminal draws at most once a frame. */
+	if (total > 0)
+		widget_schedule_partial_redraw(terminal->widget);
 }
 
 static int
@@ -2661,6 +3007,85 @@ terminal_run(struct terminal *terminal, const char *path)
 	return 0;
 }
 
+static double
+benchmark_time(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static void
+benchmark_run(struct terminal *terminal, const char *name,
+	      const char *pattern, int megabytes)
+{
+	char *buffer;
+	size_t length, size, total;
+	double start, elapsed;
+
+	/* fill a pty sized buffer with the pattern, repeated */
+	size = TERMINAL_READ_SIZE;
+	buffer = malloc(size);
+	if (buffer == NULL)
+		return;
+	length = strlen(pattern);
+	for (total = 0; total + length <= size; total += length)
+		memcpy(buffer + total, pattern, length);
+	size = total;
+
+	start = benchmark_time();
+	for (total = 0; total < (size_t) megabytes << 20; total += size)
+		terminal_data(terminal, buffer, size);
+	elapsed = benchmark_time() - start;
+
+	printf("%-8s %6.1f MB/s", name, total / elapsed / 1e6);
+
+	/* and how fast the resulting screen is drawn from scratch */
+	start = benchmark_time();
+	for (total = 0; total < 100; total++) {
+		terminal_damage_all(terminal);
+		terminal_draw_cells(terminal, 1);
+		memset(terminal->dirty, 0, terminal->height);
+		terminal->dirty_all = 0;
+	}
+	elapsed = benchmark_time() - start;
+
+	printf(", %6.0f full redraws/s\n", total / elapsed);
+	free(buffer);
+}
+
+/* Measures how fast terminal_data() takes in a few kinds of output. */
+static void
+terminal_benchmark(struct terminal *terminal, int megabytes)
+{
+	uint32_t hits, misses;
+
+	/* no pty behind it; the window has not been sized yet either */
+	terminal->master = -1;
+	terminal_resize_cells(terminal, 80, 24);
+
+	printf("feeding %d MiB of each through terminal_data()\n",
+	       megabytes);
+
+	benchmark_run(terminal, "yes", "y\n", megabytes);
+	benchmark_run(terminal, "text",
+		      "the quick brown fox jumps over the lazy dog, "
+		      "the quick brown fox jumps over the lazy dog\r\n",
+		      megabytes);
+	benchmark_run(terminal, "color",
+		      "\033[1;31merror:\033[0m file.c:42: \033[32mnote\033[0m "
+		      "\033[7mhighlighted\033[27m text\r\n", megabytes);
+	benchmark_run(terminal, "utf-8",
+		      "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5 "
+		      "\xe2\x94\x80\xe2\x94\x82\xe2\x94\x8c\xe2\x94\x90 "
+		      "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\r\n",
+		      megabytes);
+
+	glyph_cache_get_stats(terminal->glyph_cache, &hits, &misses);
+	printf("glyph cache: %u hits, %u misses\n", hits, misses);
+}
+
 static const struct config_key terminal_config_keys[] = {
 	{ "font", CONFIG_KEY_STRING, &option_font },
 	{ "font-size", CONFIG_KEY_INTEGER, &option_font_size },
@@ -2676,6 +3101,7 @@ static const struct weston_option terminal_options[] = {
 	{ WESTON_OPTION_BOOLEAN, "fullscreen", 'f', &option_fullscreen },
 	{ WESTON_OPTION_STRING, "font", 0, &option_font },
 	{ WESTON_OPTION_STRING, "shell", 0, &option_shell },
+	{ WESTON_OPTION_INTEGER, "benchmark", 0, &option_benchmark },
 };
 
 int main(int argc, char *argv[])
@@ -2705,6 +3131,12 @@ int main(int argc, char *argv[])
 
 	wl_list_init(&terminal_list);
 	terminal = terminal_create(d);
+
+	if (option_benchmark > 0) {
+		terminal_benchmark(terminal, option_benchmark);
+		return 0;
+	}
+
 	if (terminal_run(terminal, option_shell))
 		exit(EXIT_FAILURE);
 
@@ -130,6 +130,12 @@ struct display {
 	/* A hack to get text extents for tooltips */
 	cairo_surface_t *dummy_surface;
 	void *dummy_surface_data;
+
+	struct glyph_cache *glyph_cache;
+
+	/* idle pools kept for reuse by shm surfaces, most recent first */
+	struct wl_list shm_pool_cache;
+	int shm_pool_cache_count;
 };
 
 enum {
@@ -165,11 +171,24 @@ struct toysurface {
 	 * Post the surface to the server, returning the server allocation
 	 * rectangle. The Cairo surface from prepare() must be destroyed
 	 * after calling this.
+	 * damage lists the rectangles, in surface coordinates, that
+	 * changed since the previous swap; NULL damages the whole
+	 * surface.
 	 */
 	void (*swap)(struct toysurface *base,
 		     enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		     const struct rectangle *damage, int damage_count,
 		     struct rectangle *server_allocation);
 
+	/*
+	 * Report the damage posted since the buffer returned by the
+	 * last prepare() was drawn. Stores the rectangles, in surface
+	 * coordinates, in *rects and returns their number, or returns
+	 * -1 if the buffer contents are undefined.
+	 */
+	int (*buffer_damage)(struct toysurface *base,
+			     const struct rectangle **rects);
+
 	/*
 	 * Make the toysurface current with the given EGL context.
 	 * Returns 0 on success, and negative of failure.
@@ -189,6 +208,9 @@ struct toysurface {
 	void (*destroy)(struct toysurface *base);
 };
 
+#define SURFACE_MAX_DAMAGE 16
+#define SURFACE_MAX_REPAINT (2 * SURFACE_MAX_DAMAGE)
+
 struct surface {
 	struct window *window;
 
@@ -202,6 +224,18 @@ struct surface {
 	struct wl_callback *frame_cb;
 	uint32_t last_time;
 
+	/* partial damage reported by the widgets, unless damage_full */
+	struct rectangle damage[SURFACE_MAX_DAMAGE];
+	int damage_count;
+	int damage_full;
+
+	/* what the redraw in progress repaints, the widgets scheduled
+	 * for a redraw and what the buffer missed, or -1 for all of it;
+	 * repaint_clip clips the widget being redrawn to it */
+	struct rectangle repaint[SURFACE_MAX_REPAINT];
+	int repaint_count;
+	int repaint_clip;
+
 	struct rectangle allocation;
 	struct rectangle server_allocation;
 
@@ -209,6 +243,7 @@ struct surface {
 	struct wl_region *opaque_region;
 
 	enum window_buffer_type buffer_type;
+	int buffer_count;
 	enum wl_output_transform buffer_transform;
 	int32_t buffer_scale;
 
@@ -277,6 +312,12 @@ struct widget {
 	int opaque;
 	int tooltip_count;
 	int default_cursor;
+	int redraw_needed;
+};
+
+enum {
+	WIDGET_REDRAW_PARTIAL = 1,
+	WIDGET_REDRAW_FULL
 };
 
 struct input {
@@ -399,6 +440,7 @@ struct shm_pool {
 	size_t size;
 	size_t used;
 	void *data;
+	struct wl_list link;
 };
 
 enum {
@@ -546,6 +588,7 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 static void
 egl_window_surface_swap(struct toysurface *base,
 			enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			const struct rectangle *damage, int damage_count,
 			struct rectangle *server_allocation)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
@@ -560,6 +603,13 @@ egl_window_surface_swap(struct toysurface *base,
 				&server_allocation->height);
 }
 
+static int
+egl_window_surface_buffer_damage(struct toysurface *base,
+				 const struct rectangle **rects)
+{
+	return -1;
+}
+
 static int
 egl_window_surface_acquire(struct toysurface *base, EGLContext ctx)
 {
@@ -634,6 +684,7 @@ egl_window_surface_create(struct display *display,
 
 	surface->base.prepare = egl_window_surface_prepare;
 	surface->base.swap = egl_window_surface_swap;
+	surface->base.buffer_damage = egl_window_surface_buffer_damage;
 	surface->base.acquire = egl_window_surface_acquire;
 	surface->base.release = egl_window_surface_release;
 	surface->base.destroy = egl_window_surface_destroy;
@@ -778,6 +829,106 @@ shm_pool_reset(struct shm_pool *pool)
 	pool->used = 0;
 }
 
+#define SHM_POOL_MIN_SIZE (64 * 1024)
+#define SHM_POOL_CACHE_SIZE 4
+
+/* Pools are allocated in size classes, a power of two or a quarter
+ * step towards the next one, so a pool keeps fitting a buffer that
+ * changes size by a few pixels. */
+static size_t
+shm_pool_size_class(size_t size)
+{
+	size_t base = SHM_POOL_MIN_SIZE;
+	size_t step;
+
+	while (base * 2 <= size)
+		base *= 2;
+	if (size <= base)
+		return base;
+
+	step = base / 4;
+	return (size + step - 1) / step * step;
+}
+
+static size_t
+shm_pool_wanted_size(size_t length, int resize_hint)
+{
+#ifdef USE_RESIZE_POOL
+	/* Leave headroom while the user is continuously resizing, so
+	 * growing the window does not map a new pool every frame. */
+	if (resize_hint)
+		return length + length / 2;
+#endif
+	return length;
+}
+
+static int
+shm_pool_fits(struct shm_pool *pool, size_t length, int resize_hint)
+{
+	if (pool->size < length)
+		return 0;
+
+	/* don't hold on to an oversized pool once resizing is done */
+	return resize_hint ||
+		pool->size <= 2 * shm_pool_size_class(length);
+}
+
+/* Take a pool for a buffer of length bytes from the cache, or create
+ * a new one if none of the cached pools fits. */
+static struct shm_pool *
+shm_pool_cache_get(struct display *display, size_t length, int resize_hint)
+{
+	struct shm_pool *pool, *best = NULL;
+
+	wl_list_for_each(pool, &display->shm_pool_cache, link) {
+		if (!shm_pool_fits(pool, length, resize_hint))
+			continue;
+		if (!best || pool->size < best->size)
+			best = pool;
+	}
+
+	if (best) {
+		wl_list_remove(&best->link);
+		display->shm_pool_cache_count--;
+		shm_pool_reset(best);
+		return best;
+	}
+
+	return shm_pool_create(display,
+		shm_pool_size_class(shm_pool_wanted_size(length, resize_hint)));
+}
+
+/* Return an idle pool to the cache, evicting the least recently used
+ * one if the cache is full. */
+static void
+shm_pool_cache_put(struct display *display, struct shm_pool *pool)
+{
+	struct shm_pool *last;
+
+	wl_list_insert(&display->shm_pool_cache, &pool->link);
+	display->shm_pool_cache_count++;
+
+	if (display->shm_pool_cache_count > SHM_POOL_CACHE_SIZE) {
+		last = container_of(display->shm_pool_cache.prev,
+				    struct shm_pool, link);
+		wl_list_remove(&last->link);
+		display->shm_pool_cache_count--;
+		shm_pool_destroy(last);
+	}
+}
+
+static void
+shm_pool_cache_destroy(struct display *display)
+{
+	struct shm_pool *pool, *tmp;
+
+	wl_list_for_each_safe(pool, tmp, &display->shm_pool_cache, link)
+		shm_pool_destroy(pool);
+
+	wl_list_init(&display->shm_pool_cache);
+	display->shm_pool_cache_count = 0;
+}
+
 static int
 data_length_for_shm_surface(struct rectangle *rect)
 {
@@ -838,27 +989,12 @@ display_create_shm_surface_from_pool(struct display *display,
 
 static cairo_surface_t *
 display_create_shm_surface(struct display *display,
-			   struct rectangle *rectangle, uint32_t flags,
-			   struct shm_pool *alternate_pool,
-			   struct shm_surface_data **data_ret)
+			   struct rectangle *rectangle, uint32_t flags)
 {
 	struct shm_surface_data *data;
 	struct shm_pool *pool;
 	cairo_surface_t *surface;
 
-	if (alternate_pool) {
-		shm_pool_reset(alternate_pool);
-		surface = display_create_shm_surface_from_pool(display,
-							       rectangle,
-							       flags,
-							       alternate_pool);
-		if (surface) {
-			data = cairo_surface_get_user_data(surface,
-							   &shm_surface_data_key);
-			goto out;
-		}
-	}
-
 	pool = shm_pool_create(display,
 			       data_length_for_shm_surface(rectangle));
 	if (!pool)
@@ -877,10 +1013,6 @@ display_create_shm_surface(struct display *display,
 	data = cairo_surface_get_user_data(surface, &shm_surface_data_key);
 	data->pool = pool;
 
-out:
-	if (data_ret)
-		*data_ret = data;
-
 	return surface;
 }
 
@@ -905,8 +1037,7 @@ display_create_surface(struct display *display,
 		return NULL;
 
 	assert(flags & SURFACE_SHM);
-	return display_create_shm_surface(display, rectangle, flags,
-					  NULL, NULL);
+	return display_create_shm_surface(display, rectangle, flags);
 }
 
 struct shm_surface_leaf {
@@ -914,36 +1045,55 @@ struct shm_surface_leaf {
 	/* 'data' is automatically destroyed, when 'cairo_surface' is */
 	struct shm_surface_data *data;
 
-	struct shm_pool *resize_pool;
+	/* backing storage, kept across resizes while the buffer fits */
+	struct shm_pool *pool;
+	/* the swap this buffer was last posted at, 0 if never */
+	uint32_t frame;
 	int busy;
 };
 
-static void
-shm_surface_leaf_release(struct shm_surface_leaf *leaf)
-{
-	if (leaf->cairo_surface)
-		cairo_surface_destroy(leaf->cairo_surface);
-	/* leaf->data already destroyed via cairo private */
-
-	if (leaf->resize_pool)
-		shm_pool_destroy(leaf->resize_pool);
-
-	memset(leaf, 0, sizeof *leaf);
-}
-
 #define MAX_LEAVES 3
 
+struct shm_surface_damage {
+	struct rectangle rects[SURFACE_MAX_DAMAGE];
+	int count;	/* -1 for the whole surface */
+};
+
 struct shm_surface {
 	struct toysurface base;
 	struct display *display;
 	struct wl_surface *surface;
 	uint32_t flags;
 	int dx, dy;
+	int buffer_count;
 
 	struct shm_surface_leaf leaf[MAX_LEAVES];
 	struct shm_surface_leaf *current;
+
+	/* damage posted by the last MAX_LEAVES swaps, indexed by
+	 * swap number, and what it adds up to for 'current' */
+	uint32_t frame;
+	struct shm_surface_damage history[MAX_LEAVES];
+	struct shm_surface_damage buffer_damage;
 };
 
+static void
+shm_surface_leaf_release(struct shm_surface *surface,
+			 struct shm_surface_leaf *leaf)
+{
+	if (leaf->cairo_surface)
+		cairo_surface_destroy(leaf->cairo_surface);
+	/* leaf->data already destroyed via cairo private */
+
+	/* a buffer the server still holds must not be drawn over */
+	if (leaf->pool && leaf->busy)
+		shm_pool_destroy(leaf->pool);
+	else if (leaf->pool)
+		shm_pool_cache_put(surface->display, leaf->pool);
+
+	memset(leaf, 0, sizeof *leaf);
+}
+
 static struct shm_surface *
 to_shm_surface(struct toysurface *base)
 {
@@ -978,9 +1128,9 @@ static void
 shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 {
 	struct shm_surface *surface = data;
-	struct shm_surface_leaf *leaf;
+	struct shm_surface_leaf *leaf, *oldest;
 	int i;
-	int free_found;
+	int free_count;
 
 	shm_surface_buffer_state_debug(surface, "buffer_release before");
 
@@ -993,18 +1143,26 @@ shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 	}
 	assert(i < MAX_LEAVES && "unknown buffer released");
 
-	/* Leave one free leaf with storage, release others */
-	free_found = 0;
-	for (i = 0; i < MAX_LEAVES; i++) {
-		leaf = &surface->leaf[i];
+	/* Keep buffer_count - 1 free leaves with storage, releasing the
+	 * ones drawn longest ago */
+	for (;;) {
+		free_count = 0;
+		oldest = NULL;
+		for (i = 0; i < MAX_LEAVES; i++) {
+			leaf = &surface->leaf[i];
 
-		if (!leaf->cairo_surface || leaf->busy)
-			continue;
+			if (!leaf->cairo_surface || leaf->busy)
+				continue;
 
-		if (!free_found)
-			free_found = 1;
-		else
-			shm_surface_leaf_release(leaf);
+			free_count++;
+			if (!oldest || leaf->frame < oldest->frame)
+				oldest = leaf;
+		}
+
+		if (free_count < surface->buffer_count)
+			break;
+
+		shm_surface_leaf_release(surface, oldest);
 	}
 
 	shm_surface_buffer_state_debug(surface, "buffer_release  after");
@@ -1014,6 +1172,49 @@ static const struct wl_buffer_listener shm_surface_buffer_listener = {
 	shm_surface_buffer_release
 };
 
+static int
+shm_surface_leaf_rank(struct shm_surface_leaf *leaf,
+		      int32_t width, int32_t height)
+{
+	if (!leaf->cairo_surface)
+		return 0;
+
+	if (cairo_image_surface_get_width(leaf->cairo_surface) != width ||
+	    cairo_image_surface_get_height(leaf->cairo_surface) != height)
+		return 1;
+
+	return 2;
+}
+
+/* Collect the damage posted since the current leaf was drawn, so the
+ * client can bring it up to date instead of repainting all of it. */
+static void
+shm_surface_update_buffer_damage(struct shm_surface *surface)
+{
+	struct shm_surface_leaf *leaf = surface->current;
+	struct shm_surface_damage *damage = &surface->buffer_damage;
+	struct shm_surface_damage *h;
+	uint32_t f;
+
+	damage->count = -1;
+	if (leaf->frame == 0 || surface->frame - leaf->frame > MAX_LEAVES)
+		return;
+
+	damage->count = 0;
+	for (f = leaf->frame + 1; f <= surface->frame; f++) {
+		h = &surface->history[f % MAX_LEAVES];
+		if (h->count < 0 ||
+		    damage->count + h->count > SURFACE_MAX_DAMAGE) {
+			damage->count = -1;
+			return;
+		}
+
+		memcpy(&damage->rects[damage->count], h->rects,
+		       h->count * sizeof h->rects[0]);
+		damage->count += h->count;
+	}
+}
+
 static cairo_surface_t *
 shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		    int32_t width, int32_t height, uint32_t flags,
@@ -1023,18 +1224,26 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	struct shm_surface *surface = to_shm_surface(base);
 	struct rectangle rect = { 0};
 	struct shm_surface_leaf *leaf = NULL;
-	int i;
+	size_t length;
+	int i, rank, best = -1;
 
 	surface->dx = dx;
 	surface->dy = dy;
 
-	/* pick a free buffer, preferrably one that already has storage */
+	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
+
+	/* pick a free buffer, preferrably the most recently drawn one of
+	 * the right size, then one that has storage to reuse */
 	for (i = 0; i < MAX_LEAVES; i++) {
 		if (surface->leaf[i].busy)
 			continue;
 
-		if (!leaf || surface->leaf[i].cairo_surface)
+		rank = shm_surface_leaf_rank(&surface->leaf[i], width, height);
+		if (rank > best ||
+		    (rank == best && surface->leaf[i].frame > leaf->frame)) {
 			leaf = &surface->leaf[i];
+			best = rank;
+		}
 	}
 	DBG_OBJ(surface->surface, "pick leaf %d\n",
 		(int)(leaf - &surface->leaf[0]));
@@ -1046,49 +1255,47 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		return NULL;
 	}
 
-	if (!resize_hint && leaf->resize_pool) {
-		cairo_surface_destroy(leaf->cairo_surface);
-		leaf->cairo_surface = NULL;
-		shm_pool_destroy(leaf->resize_pool);
-		leaf->resize_pool = NULL;
-	}
-
-	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
-
-	if (leaf->cairo_surface &&
-	    cairo_image_surface_get_width(leaf->cairo_surface) == width &&
-	    cairo_image_surface_get_height(leaf->cairo_surface) == height)
+	if (best == 2)
 		goto out;
 
-	if (leaf->cairo_surface)
+	if (leaf->cairo_surface) {
 		cairo_surface_destroy(leaf->cairo_surface);
+		leaf->cairo_surface = NULL;
+	}
+	leaf->frame = 0;
 
-#ifdef USE_RESIZE_POOL
-	if (resize_hint && !leaf->resize_pool) {
-		/* Create a big pool to allocate from, while continuously
-		 * resizing. Mmapping a new pool in the server
-		 * is relatively expensive, so reusing a pool performs
-		 * better, but may temporarily reserve unneeded memory.
-		 */
-		/* We should probably base this number on the output size. */
-		leaf->resize_pool = shm_pool_create(surface->display,
-						    6 * 1024 * 1024);
+	length = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width) *
+		height;
+	if (leaf->pool && !shm_pool_fits(leaf->pool, length, resize_hint)) {
+		shm_pool_cache_put(surface->display, leaf->pool);
+		leaf->pool = NULL;
 	}
-#endif
+
+	if (!leaf->pool)
+		leaf->pool = shm_pool_cache_get(surface->display,
+						length, resize_hint);
+	if (!leaf->pool)
+		return NULL;
 
 	rect.width = width;
 	rect.height = height;
 
+	shm_pool_reset(leaf->pool);
 	leaf->cairo_surface =
-		display_create_shm_surface(surface->display, &rect,
-					   surface->flags,
-					   leaf->resize_pool,
-					   &leaf->data);
+		display_create_shm_surface_from_pool(surface->display, &rect,
+						     surface->flags,
+						     leaf->pool);
+	if (!leaf->cairo_surface)
+		return NULL;
+
+	leaf->data = cairo_surface_get_user_data(leaf->cairo_surface,
+						 &shm_surface_data_key);
 	wl_buffer_add_listener(leaf->data->buffer,
 			       &shm_surface_buffer_listener, surface);
 
 out:
 	surface->current = leaf;
+	shm_surface_update_buffer_damage(surface);
 
 	return cairo_surface_reference(leaf->cairo_surface);
 }
@@ -1096,10 +1303,13 @@ out:
 static void
 shm_surface_swap(struct toysurface *base,
 		 enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		 const struct rectangle *damage, int damage_count,
 		 struct rectangle *server_allocation)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	struct shm_surface_damage *h;
+	int i;
 
 	server_allocation->width =
 		cairo_image_surface_get_width(leaf->cairo_surface);
@@ -1110,19 +1320,48 @@ shm_surface_swap(struct toysurface *base,
 				&server_allocation->width,
 				&server_allocation->height);
 
+	surface->frame++;
+	h = &surface->history[surface->frame % MAX_LEAVES];
+
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+	if (damage == NULL || surface->dx != 0 || surface->dy != 0) {
+		wl_surface_damage(surface->surface, 0, 0,
+				  server_allocation->width,
+				  server_allocation->height);
+		damage_count = 0;
+		h->count = -1;
+	} else {
+		memcpy(h->rects, damage, damage_count * sizeof *damage);
+		h->count = damage_count;
+	}
+	for (i = 0; i < damage_count; i++)
+		wl_surface_damage(surface->surface,
+				  damage[i].x, damage[i].y,
+				  damage[i].width, damage[i].height);
 	wl_surface_commit(surface->surface);
 
 	DBG_OBJ(surface->surface, "leaf %d busy\n",
 		(int)(leaf - &surface->leaf[0]));
 
 	leaf->busy = 1;
+	leaf->frame = surface->frame;
 	surface->current = NULL;
 }
 
+static int
+shm_surface_buffer_damage(struct toysurface *base,
+			  const struct rectangle **rects)
+{
+	struct shm_surface *surface = to_shm_surface(base);
+
+	if (!surface->current)
+		return -1;
+
+	*rects = surface->buffer_damage.rects;
+	return surface->buffer_damage.count;
+}
+
 static int
 shm_surface_acquire(struct toysurface *base, EGLContext ctx)
 {
@@ -1141,14 +1380,14 @@ shm_surface_destroy(struct toysurface *base)
 	int i;
 
 	for (i = 0; i < MAX_LEAVES; i++)
-		shm_surface_leaf_release(&surface->leaf[i]);
+		shm_surface_leaf_release(surface, &surface->leaf[i]);
 
 	free(surface);
 }
 
 static struct toysurface *
 shm_surface_create(struct display *display, struct wl_surface *wl_surface,
-		   uint32_t flags, struct rectangle *rectangle)
+		   uint32_t flags, int buffer_count)
 {
 	struct shm_surface *surface;
 	DBG_OBJ(wl_surface, "\n");
@@ -1159,6 +1398,7 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 
 	surface->base.prepare = shm_surface_prepare;
 	surface->base.swap = shm_surface_swap;
+	surface->base.buffer_damage = shm_surface_buffer_damage;
 	surface->base.acquire = shm_surface_acquire;
 	surface->base.release = shm_surface_release;
 	surface->base.destroy = shm_surface_destroy;
@@ -1166,6 +1406,7 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 	surface->display = display;
 	surface->surface = wl_surface;
 	surface->flags = flags;
+	surface->buffer_count = buffer_count;
 
 	return &surface->base;
 }
@@ -1351,10 +1592,14 @@ surface_flush(struct surface *surface)
 
 	surface->toysurface->swap(surface->toysurface,
 				  surface->buffer_transform, surface->buffer_scale,
+				  surface->damage_full ? NULL : surface->damage,
+				  surface->damage_count,
 				  &surface->server_allocation);
 
 	cairo_surface_destroy(surface->cairo_surface);
 	surface->cairo_surface = NULL;
+	surface->damage_count = 0;
+	surface->damage_full = 0;
 }
 
 int
@@ -1408,7 +1653,8 @@ surface_create_surface(struct surface *surface, int dx, int dy, uint32_t flags)
 	if (!surface->toysurface)
 		surface->toysurface = shm_surface_create(display,
 							 surface->surface,
-							 flags, &allocation);
+							 flags,
+							 surface->buffer_count);
 
 	surface->cairo_surface = surface->toysurface->prepare(
 		surface->toysurface, dx, dy,
@@ -1667,9 +1913,26 @@ widget_get_allocation(struct widget *widget, struct rectangle *allocation)
 	*allocation = widget->allocation;
 }
 
+static void
+widget_allocation_changed(struct widget *widget)
+{
+	struct surface *surface = widget->surface;
+
+	/* what was under the old allocation is only known to the
+	 * widgets around it, so repaint the whole surface */
+	if (surface->widget) {
+		surface->widget->redraw_needed = WIDGET_REDRAW_FULL;
+		surface->redraw_needed = 1;
+	}
+}
+
 void
 widget_set_size(struct widget *widget, int32_t width, int32_t height)
 {
+	if (widget->allocation.width != width ||
+	    widget->allocation.height != height)
+		widget_allocation_changed(widget);
+
 	widget->allocation.width = width;
 	widget->allocation.height = height;
 }
@@ -1678,6 +1941,9 @@ void
 widget_set_allocation(struct widget *widget,
 		      int32_t x, int32_t y, int32_t width, int32_t height)
 {
+	if (widget->allocation.x != x || widget->allocation.y != y)
+		widget_allocation_changed(widget);
+
 	widget->allocation.x = x;
 	widget->allocation.y = y;
 	widget_set_size(widget, width, height);
@@ -1796,6 +2062,7 @@ widget_cairo_create(struct widget *widget)
 	struct surface *surface = widget->surface;
 	cairo_surface_t *cairo_surface;
 	cairo_t *cr;
+	int i;
 
 	cairo_surface = widget_get_cairo_surface(widget);
 	cr = cairo_create(cairo_surface);
@@ -1804,6 +2071,16 @@ widget_cairo_create(struct widget *widget)
 
 	cairo_translate(cr, -surface->allocation.x, -surface->allocation.y);
 
+	if (surface->repaint_count >= 0 && surface->repaint_clip) {
+		for (i = 0; i < surface->repaint_count; i++)
+			cairo_rectangle(cr,
+					surface->repaint[i].x,
+					surface->repaint[i].y,
+					surface->repaint[i].width,
+					surface->repaint[i].height);
+		cairo_clip(cr);
+	}
+
 	return cr;
 }
 
@@ -1888,10 +2165,53 @@ void
 widget_schedule_redraw(struct widget *widget)
 {
 	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
+	widget->redraw_needed = WIDGET_REDRAW_FULL;
+	widget->surface->redraw_needed = 1;
+	window_schedule_redraw_task(widget->window);
+}
+
+void
+widget_schedule_partial_redraw(struct widget *widget)
+{
+	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
+	if (!widget->redraw_needed)
+		widget->redraw_needed = WIDGET_REDRAW_PARTIAL;
 	widget->surface->redraw_needed = 1;
 	window_schedule_redraw_task(widget->window);
 }
 
+void
+widget_damage(struct widget *widget,
+	      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct surface *surface = widget->surface;
+	struct rectangle *r;
+
+	if (surface->damage_full)
+		return;
+
+	if (surface->damage_count == SURFACE_MAX_DAMAGE) {
+		surface->damage_full = 1;
+		return;
+	}
+
+	r = &surface->damage[surface->damage_count++];
+	r->x = x;
+	r->y = y;
+	r->width = width;
+	r->height = height;
+}
+
+int
+widget_get_buffer_damage(struct widget *widget,
+			 const struct rectangle **rects)
+{
+	struct surface *surface = widget->surface;
+
+	*rects = surface->repaint;
+	return surface->repaint_count;
+}
+
 cairo_surface_t *
 window_get_surface(struct window *window)
 {
@@ -3768,17 +4088,84 @@ window_get_allocation(struct window *window,
 	*allocation = window->main_surface->allocation;
 }
 
+static int
+rectangle_intersects(const struct rectangle *a, const struct rectangle *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+		a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
 static void
 widget_redraw(struct widget *widget)
 {
+	struct surface *surface = widget->surface;
 	struct widget *child;
+	int i, needed;
+
+	needed = widget->redraw_needed || surface->repaint_count < 0;
+	for (i = 0; !needed && i < surface->repaint_count; i++)
+		needed = rectangle_intersects(&widget->allocation,
+					      &surface->repaint[i]);
 
-	if (widget->redraw_handler)
+	/* a partial redraw damages and repaints by itself */
+	surface->repaint_clip =
+		widget->redraw_needed != WIDGET_REDRAW_PARTIAL;
+	widget->redraw_needed = 0;
+
+	if (needed && widget->redraw_handler)
 		widget->redraw_handler(widget, widget->user_data);
 	wl_list_for_each(child, &widget->child_list, link)
 		widget_redraw(child);
 }
 
+/* Damage the widgets scheduled for a redraw and add them to what the
+ * redraw repaints. */
+static void
+widget_collect_repaint(struct widget *widget)
+{
+	struct surface *surface = widget->surface;
+	struct widget *child;
+
+	if (widget->redraw_needed == WIDGET_REDRAW_FULL) {
+		widget_damage(widget,
+			      widget->allocation.x, widget->allocation.y,
+			      widget->allocation.width,
+			      widget->allocation.height);
+
+		if (surface->repaint_count == SURFACE_MAX_REPAINT)
+			surface->repaint_count = -1;
+		else if (surface->repaint_count >= 0)
+			surface->repaint[surface->repaint_count++] =
+				widget->allocation;
+	}
+
+	wl_list_for_each(child, &widget->child_list, link)
+		widget_collect_repaint(child);
+}
+
+/* Work out what needs to be repainted: everything if the whole surface
+ * is damaged or it has not been drawn yet, otherwise the scheduled
+ * widgets plus whatever the buffer about to be drawn missed since it
+ * was last drawn. */
+static void
+surface_collect_repaint(struct surface *surface)
+{
+	const struct rectangle *stale;
+	int count = -1;
+
+	if (surface->toysurface && !surface->damage_full) {
+		widget_get_cairo_surface(surface->widget);
+		count = surface->toysurface->buffer_damage(surface->toysurface,
+							   &stale);
+	}
+
+	surface->repaint_count = count;
+	if (count > 0)
+		memcpy(surface->repaint, stale, count * sizeof *stale);
+
+	widget_collect_repaint(surface->widget);
+}
+
 static void
 frame_callback(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -3825,8 +4212,12 @@ surface_redraw(struct surface *surface)
 	DBG_OBJ(surface->frame_cb, "new\n");
 
 	surface->redraw_needed = 0;
+	if (surface->window->redraw_needed)
+		surface->damage_full = 1;
+	surface_collect_repaint(surface);
 	DBG_OBJ(surface->surface, "-> widget_redraw\n");
 	widget_redraw(surface->widget);
+	surface->repaint_count = -1;
 	DBG_OBJ(surface->surface, "done\n");
 }
 
@@ -3880,8 +4271,10 @@ window_schedule_redraw(struct window *window)
 
 	DBG_OBJ(window->main_surface->surface, "window %p\n", window);
 
-	wl_list_for_each(surface, &window->subsurface_list, link)
+	wl_list_for_each(surface, &window->subsurface_list, link) {
 		surface->redraw_needed = 1;
+		surface->damage_full = 1;
+	}
 
 	window_schedule_redraw_task(window);
 }
@@ -4165,6 +4558,9 @@ surface_create(struct window *window)
 	surface->window = window;
 	surface->surface = wl_compositor_create_surface(display->compositor);
 	surface->buffer_scale = 1;
+	surface->buffer_count = 2;
+	surface->damage_full = 1;
+	surface->repaint_count = -1;
 	wl_surface_add_listener(surface->surface, &surface_listener, window);
 
 	wl_list_insert(&window->subsurface_list, &surface->link);
@@ -4437,6 +4833,17 @@ window_set_buffer_type(struct window *window, enum window_buffer_type type)
 	window->main_surface->buffer_type = type;
 }
 
+void
+window_set_buffer_count(struct window *window, int count)
+{
+	if (count < 2)
+		count = 2;
+	if (count > MAX_LEAVES)
+		count = MAX_LEAVES;
+
+	window->main_surface->buffer_count = count;
+}
+
 struct widget *
 window_add_subsurface(struct window *window, void *data,
 		      enum subsurface_mode default_mode)
@@ -4898,6 +5305,263 @@ fini_egl(struct display *display)
 }
 #endif
 
+/*
+ * The glyph cache keeps rasterized glyphs as alpha masks packed into
+ * one atlas surface, so that text drawn again and again, like the
+ * contents of a terminal, is composited from the masks instead of
+ * going through cairo's text path every time.  Glyphs are keyed by
+ * scaled font, glyph index and device scale, and are placed on whole
+ * device pixels.  When the atlas is full it is emptied and refilled.
+ */
+#define GLYPH_ATLAS_SIZE	1024
+#define GLYPH_CACHE_BUCKETS	1024
+
+struct glyph_cache_entry {
+	cairo_scaled_font_t *font;
+	unsigned long index;
+	double scale;
+	int x, y;	/* offset of the mask from the glyph origin */
+	cairo_surface_t *mask;	/* NULL if the glyph draws nothing */
+	struct glyph_cache_entry *next;
+};
+
+struct glyph_cache {
+	cairo_surface_t *atlas;
+	int shelf_x, shelf_y, shelf_height;
+	struct glyph_cache_entry *table[GLYPH_CACHE_BUCKETS];
+	uint32_t hits, misses;
+};
+
+static void
+glyph_cache_clear(struct glyph_cache *cache)
+{
+	struct glyph_cache_entry *entry, *next;
+	cairo_t *cr;
+	int i;
+
+	for (i = 0; i < GLYPH_CACHE_BUCKETS; i++) {
+		for (entry = cache->table[i]; entry; entry = next) {
+			next = entry->next;
+			if (entry->mask)
+				cairo_surface_destroy(entry->mask);
+			cairo_scaled_font_destroy(entry->font);
+			free(entry);
+		}
+		cache->table[i] = NULL;
+	}
+
+	cr = cairo_create(cache->atlas);
+	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+
+	cache->shelf_x = 0;
+	cache->shelf_y = 0;
+	cache->shelf_height = 0;
+}
+
+static struct glyph_cache *
+glyph_cache_create(void)
+{
+	struct glyph_cache *cache;
+
+	cache = calloc(1, sizeof *cache);
+	if (cache == NULL)
+		return NULL;
+
+	cache->atlas = cairo_image_surface_create(CAIRO_FORMAT_A8,
+						  GLYPH_ATLAS_SIZE,
+						  GLYPH_ATLAS_SIZE);
+	if (cairo_surface_status(cache->atlas) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(cache->atlas);
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+static void
+glyph_cache_destroy(struct glyph_cache *cache)
+{
+	glyph_cache_clear(cache);
+	cairo_surface_destroy(cache->atlas);
+	free(cache);
+}
+
+/* Finds room for a width x height mask, filling the atlas shelf by
+ * shelf.  Returns -1 when the atlas is full. */
+static int
+glyph_cache_allocate(struct glyph_cache *cache, int width, int height,
+		     int *x, int *y)
+{
+	if (cache->shelf_x + width > GLYPH_ATLAS_SIZE) {
+		cache->shelf_x = 0;
+		cache->shelf_y += cache->shelf_height;
+		cache->shelf_height = 0;
+	}
+
+	if (cache->shelf_y + height > GLYPH_ATLAS_SIZE)
+		return -1;
+
+	*x = cache->shelf_x;
+	*y = cache->shelf_y;
+	cache->shelf_x += width;
+	if (height > cache->shelf_height)
+		cache->shelf_height = height;
+
+	return 0;
+}
+
+static struct glyph_cache_entry *
+glyph_cache_rasterize(struct glyph_cache *cache, cairo_scaled_font_t *font,
+		      unsigned long index, double scale)
+{
+	struct glyph_cache_entry *entry;
+	cairo_text_extents_t extents;
+	cairo_glyph_t glyph = { index, 0, 0 };
+	int x0, y0, x1, y1, x, y;
+	cairo_t *cr;
+
+	cairo_scaled_font_glyph_extents(font, &glyph, 1, &extents);
+
+	/* one pixel of slack for antialiasing on every side */
+	x0 = floor(extents.x_bearing * scale) - 1;
+	y0 = floor(extents.y_bearing * scale) - 1;
+	x1 = ceil((extents.x_bearing + extents.width) * scale) + 1;
+	y1 = ceil((extents.y_bearing + extents.height) * scale) + 1;
+	if (x1 - x0 > GLYPH_ATLAS_SIZE || y1 - y0 > GLYPH_ATLAS_SIZE)
+		return NULL;
+
+	entry = calloc(1, sizeof *entry);
+	if (entry == NULL)
+		return NULL;
+	entry->font = cairo_scaled_font_reference(font);
+	entry->index = index;
+	entry->scale = scale;
+	entry->x = x0;
+	entry->y = y0;
+
+	if (extents.width == 0 || extents.height == 0)
+		return entry;
+
+	if (glyph_cache_allocate(cache, x1 - x0, y1 - y0, &x, &y) < 0) {
+		glyph_cache_clear(cache);
+		glyph_cache_allocate(cache, x1 - x0, y1 - y0, &x, &y);
+	}
+
+	cr = cairo_create(cache->atlas);
+	cairo_rectangle(cr, x, y, x1 - x0, y1 - y0);
+	cairo_clip(cr);
+	cairo_translate(cr, x - x0, y - y0);
+	cairo_scale(cr, scale, scale);
+	cairo_set_scaled_font(cr, font);
+	cairo_set_source_rgba(cr, 0, 0, 0, 1);
+	cairo_show_glyphs(cr, &glyph, 1);
+	cairo_destroy(cr);
+
+	entry->mask = cairo_surface_create_for_rectangle(cache->atlas,
+							 x, y,
+							 x1 - x0, y1 - y0);
+
+	return entry;
+}
+
+static struct glyph_cache_entry *
+glyph_cache_lookup(struct glyph_cache *cache, cairo_scaled_font_t *font,
+		   unsigned long index, double scale)
+{
+	struct glyph_cache_entry *entry;
+	uint32_t hash;
+
+	hash = (index * 2654435761u ^ (uintptr_t) font >> 4) %
+		GLYPH_CACHE_BUCKETS;
+	for (entry = cache->table[hash]; entry; entry = entry->next) {
+		if (entry->index == index && entry->font == font &&
+		    entry->scale == scale) {
+			cache->hits++;
+			return entry;
+		}
+	}
+
+	cache->misses++;
+	entry = glyph_cache_rasterize(cache, font, index, scale);
+	if (entry == NULL)
+		return NULL;
+
+	/* rasterizing may have emptied the cache */
+	entry->next = cache->table[hash];
+	cache->table[hash] = entry;
+
+	return entry;
+}
+
+struct glyph_cache *
+display_get_glyph_cache(struct display *display)
+{
+	if (display->glyph_cache == NULL)
+		display->glyph_cache = glyph_cache_create();
+
+	return display->glyph_cache;
+}
+
+/*
+ * Draws glyphs in the current source of cr, like cairo_show_glyphs(),
+ * from the cached masks.  Transformations other than a uniform scale
+ * and translation are drawn by cairo directly.
+ */
+void
+glyph_cache_show_glyphs(struct glyph_cache *cache, cairo_t *cr,
+			cairo_scaled_font_t *font,
+			const cairo_glyph_t *glyphs, int count)
+{
+	struct glyph_cache_entry *entry;
+	cairo_matrix_t matrix;
+	double x, y;
+	int i;
+
+	cairo_get_matrix(cr, &matrix);
+	if (cache == NULL || matrix.xy != 0.0 || matrix.yx != 0.0 ||
+	    matrix.xx != matrix.yy || matrix.xx <= 0.0) {
+		cairo_set_scaled_font(cr, font);
+		cairo_show_glyphs(cr, glyphs, count);
+		return;
+	}
+
+	cairo_save(cr);
+	cairo_identity_matrix(cr);
+	for (i = 0; i < count; i++) {
+		entry = glyph_cache_lookup(cache, font,
+					   glyphs[i].index, matrix.xx);
+		if (entry == NULL) {
+			cairo_set_matrix(cr, &matrix);
+			cairo_set_scaled_font(cr, font);
+			cairo_show_glyphs(cr, &glyphs[i], 1);
+			cairo_identity_matrix(cr);
+			continue;
+		}
+
+		if (entry->mask == NULL)
+			continue;
+
+		x = glyphs[i].x;
+		y = glyphs[i].y;
+		cairo_matrix_transform_point(&matrix, &x, &y);
+		cairo_mask_surface(cr, entry->mask,
+				   floor(x + 0.5) + entry->x,
+				   floor(y + 0.5) + entry->y);
+	}
+	cairo_restore(cr);
+}
+
+void
+glyph_cache_get_stats(struct glyph_cache *cache,
+		      uint32_t *hits, uint32_t *misses)
+{
+	*hits = cache ? cache->hits : 0;
+	*misses = cache ? cache->misses : 0;
+}
+
 static void
 init_dummy_surface(struct display *display)
 {
@@ -4985,6 +5649,7 @@ display_create(int *argc, char *argv[])
 	wl_list_init(&d->input_list);
 	wl_list_init(&d->output_list);
 	wl_list_init(&d->global_list);
+	wl_list_init(&d->shm_pool_cache);
 
 	d->xkb_context = xkb_context_new(0);
 	if (d->xkb_context == NULL) {
@@ -5053,6 +5718,11 @@ display_destroy(struct display *display)
 	cairo_surface_destroy(display->dummy_surface);
 	free(display->dummy_surface_data);
 
+	if (display->glyph_cache)
+		glyph_cache_destroy(display->glyph_cache);
+
+	shm_pool_cache_destroy(display);
+
 	display_destroy_outputs(display);
 	display_destroy_inputs(display);
 
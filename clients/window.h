@@ -142,6 +142,20 @@ display_get_buffer_for_surface(struct display *display,
 struct wl_cursor_image *
 display_get_pointer_image(struct display *display, int pointer);
 
+struct glyph_cache;
+
+struct glyph_cache *
+display_get_glyph_cache(struct display *display);
+
+void
+glyph_cache_show_glyphs(struct glyph_cache *cache, cairo_t *cr,
+			cairo_scaled_font_t *font,
+			const cairo_glyph_t *glyphs, int count);
+
+void
+glyph_cache_get_stats(struct glyph_cache *cache,
+		      uint32_t *hits, uint32_t *misses);
+
 void
 display_defer(struct display *display, struct task *task);
 
@@ -317,6 +331,11 @@ display_surface_damage(struct display *display, cairo_surface_t *cairo_surface,
 void
 window_set_buffer_type(struct window *window, enum window_buffer_type type);
 
+/* Number of shm buffers kept for the window: 2 for double buffering,
+ * 3 for triple buffering. Takes effect when the surface is created. */
+void
+window_set_buffer_count(struct window *window, int count);
+
 int
 window_is_fullscreen(struct window *window);
 
@@ -438,6 +457,17 @@ widget_set_axis_handler(struct widget *widget,
 
 void
 widget_schedule_redraw(struct widget *widget);
+void
+widget_schedule_partial_redraw(struct widget *widget);
+void
+widget_damage(struct widget *widget,
+	      int32_t x, int32_t y, int32_t width, int32_t height);
+/* What a partial redraw must repaint besides its own damage: other
+ * widgets being redrawn and what the buffer missed since it was last
+ * drawn. -1 means repaint all. */
+int
+widget_get_buffer_damage(struct widget *widget,
+			 const struct rectangle **rects);
 
 struct widget *
 frame_create(struct window *window, void *data);
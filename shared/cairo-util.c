@@ -28,6 +28,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <cairo.h>
 #include "cairo-util.h"
 
@@ -46,88 +55,178 @@ surface_flush_device(cairo_surface_t *surface)
 		cairo_device_flush(device);
 }
 
+/* The shadow was blurred with a 71 tap gaussian, exp(-x² / 71). Three
+ * box blurs of about the same variance approximate it closely. */
+#define BLUR_SIGMA sqrt(71 / 2.0)
+
+/* Widths of three box blurs approximating a gaussian with standard
+ * deviation sigma, two odd sizes whose variances add up to sigma². */
+static void
+blur_box_sizes(double sigma, int sizes[3])
+{
+	double v = 12 * sigma * sigma;
+	int wl, m, i;
+
+	wl = floor(sqrt(v / 3 + 1));
+	if (wl % 2 == 0)
+		wl--;
+	m = round((v - 3 * wl * wl - 12 * wl - 9) / (-4 * wl - 4));
+
+	for (i = 0; i < 3; i++)
+		sizes[i] = i < m ? wl : wl + 2;
+}
+
+/* A pixel spread out to 16 bits per channel, so all four channels are
+ * summed in one addition: b, r, g and a from the low lane up. */
+static inline uint64_t
+blur_expand(uint32_t p)
+{
+	return (p & 0x00ff00ff) | (uint64_t) (p & 0xff00ff00) << 24;
+}
+
+static inline uint32_t
+blur_pack(uint64_t v)
+{
+	return (v & 0x00ff00ff) | ((v >> 24) & 0xff00ff00);
+}
+
+static inline uint64_t
+blur_normalize(uint64_t sum, uint32_t recip)
+{
+	uint64_t v = 0;
+	int s;
+
+	for (s = 0; s < 64; s += 16)
+		v |= ((((sum >> s) & 0xffff) * recip + 0x8000) >> 16) << s;
+
+	return v;
+}
+
+/* One box blur of two interleaved lines of n expanded pixels, keeping
+ * a running sum of the window. Pixels beyond the ends count as
+ * transparent. The lanes don't overflow for sizes up to 257. */
+#ifdef __SSE2__
+static void
+blur_lines(const uint64_t *src, uint64_t *dst, int n, int size)
+{
+	const __m128i *s = (const __m128i *) src;
+	__m128i *d = (__m128i *) dst;
+	const __m128i recip = _mm_set1_epi16(65536 / size);
+	__m128i sum = _mm_setzero_si128(), lo, hi;
+	int i, r = size / 2;
+
+	for (i = 0; i < r && i < n; i++)
+		sum = _mm_add_epi16(sum, _mm_loadu_si128(&s[i]));
+
+	for (i = 0; i < n; i++) {
+		if (i + r < n)
+			sum = _mm_add_epi16(sum, _mm_loadu_si128(&s[i + r]));
+		/* The rounding of blur_normalize(): the high half of the
+		 * product, plus the top bit of the low half. */
+		lo = _mm_mullo_epi16(sum, recip);
+		hi = _mm_mulhi_epu16(sum, recip);
+		_mm_storeu_si128(&d[i],
+				 _mm_add_epi16(hi, _mm_srli_epi16(lo, 15)));
+		if (i - r >= 0)
+			sum = _mm_sub_epi16(sum, _mm_loadu_si128(&s[i - r]));
+	}
+}
+#else
+static void
+blur_lines(const uint64_t *src, uint64_t *dst, int n, int size)
+{
+	uint32_t recip = 65536 / size;
+	uint64_t sum[2] = { 0, 0 };
+	int i, k, r = size / 2;
+
+	for (i = 0; i < r && i < n; i++)
+		for (k = 0; k < 2; k++)
+			sum[k] += src[2 * i + k];
+
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < 2; k++) {
+			if (i + r < n)
+				sum[k] += src[2 * (i + r) + k];
+			dst[2 * i + k] = blur_normalize(sum[k], recip);
+			if (i - r >= 0)
+				sum[k] -= src[2 * (i - r) + k];
+		}
+	}
+}
+#endif
+
+/* Blur the lines in place, ending up in line, using tmp as scratch. */
+static void
+blur_line_passes(uint64_t *line, uint64_t *tmp, int n, const int sizes[3])
+{
+	blur_lines(line, tmp, n, sizes[0]);
+	blur_lines(tmp, line, n, sizes[1]);
+	blur_lines(line, tmp, n, sizes[2]);
+	memcpy(line, tmp, 2 * n * sizeof *line);
+}
+
 void
 blur_surface(cairo_surface_t *surface, int margin)
 {
-	int32_t width, height, stride, x, y, z, w;
-	uint8_t *src, *dst;
-	uint32_t *s, *d, a, p;
-	int i, j, k, size, half;
-	uint32_t kernel[71];
-	double f;
-
-	size = ARRAY_LENGTH(kernel);
+	int32_t width, height, stride;
+	uint8_t *src;
+	uint32_t *s, *t;
+	uint64_t *line, *tmp;
+	int i, j, sizes[3];
+
 	width = cairo_image_surface_get_width(surface);
 	height = cairo_image_surface_get_height(surface);
 	stride = cairo_image_surface_get_stride(surface);
 	src = cairo_image_surface_get_data(surface);
 
-	dst = malloc(height * stride);
+	/* Two rows or columns are blurred at a time. */
+	line = malloc(4 * (width > height ? width : height) * sizeof *line);
+	if (!line)
+		return;
+	tmp = line + 2 * (width > height ? width : height);
 
-	half = size / 2;
-	a = 0;
-	for (i = 0; i < size; i++) {
-		f = (i - half);
-		kernel[i] = exp(- f * f / ARRAY_LENGTH(kernel)) * 10000;
-		a += kernel[i];
-	}
+	blur_box_sizes(BLUR_SIGMA, sizes);
+	cairo_surface_flush(surface);
 
-	for (i = 0; i < height; i++) {
+	for (i = 0; i < height; i += 2) {
 		s = (uint32_t *) (src + i * stride);
-		d = (uint32_t *) (dst + i * stride);
+		t = i + 1 < height ? (uint32_t *) ((uint8_t *) s + stride) : NULL;
 		for (j = 0; j < width; j++) {
-			if (margin < j && j < width - margin) {
-				d[j] = s[j];
+			line[2 * j] = blur_expand(s[j]);
+			line[2 * j + 1] = t ? blur_expand(t[j]) : 0;
+		}
+
+		blur_line_passes(line, tmp, width, sizes);
+
+		for (j = 0; j < width; j++) {
+			if (margin < j && j < width - margin)
 				continue;
-			}
-
-			x = 0;
-			y = 0;
-			z = 0;
-			w = 0;
-			for (k = 0; k < size; k++) {
-				if (j - half + k < 0 || j - half + k >= width)
-					continue;
-				p = s[j - half + k];
-
-				x += (p >> 24) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >> 8) & 0xff) * kernel[k];
-				w += (p & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
+			s[j] = blur_pack(line[2 * j]);
+			if (t)
+				t[j] = blur_pack(line[2 * j + 1]);
 		}
 	}
 
-	for (i = 0; i < height; i++) {
-		s = (uint32_t *) (dst + i * stride);
-		d = (uint32_t *) (src + i * stride);
-		for (j = 0; j < width; j++) {
-			if (margin <= i && i < height - margin) {
-				d[j] = s[j];
+	for (j = 0; j < width; j += 2) {
+		for (i = 0; i < height; i++) {
+			s = (uint32_t *) (src + i * stride);
+			line[2 * i] = blur_expand(s[j]);
+			line[2 * i + 1] = j + 1 < width ? blur_expand(s[j + 1]) : 0;
+		}
+
+		blur_line_passes(line, tmp, height, sizes);
+
+		for (i = 0; i < height; i++) {
+			if (margin <= i && i < height - margin)
 				continue;
-			}
-
-			x = 0;
-			y = 0;
-			z = 0;
-			w = 0;
-			for (k = 0; k < size; k++) {
-				if (i - half + k < 0 || i - half + k >= height)
-					continue;
-				s = (uint32_t *) (dst + (i - half + k) * stride);
-				p = s[j];
-
-				x += (p >> 24) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >> 8) & 0xff) * kernel[k];
-				w += (p & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
+			s = (uint32_t *) (src + i * stride);
+			s[j] = blur_pack(line[2 * i]);
+			if (j + 1 < width)
+				s[j + 1] = blur_pack(line[2 * i + 1]);
 		}
 	}
 
-	free(dst);
+	free(line);
 	cairo_surface_mark_dirty(surface);
 }
 
@@ -316,12 +415,116 @@ load_cairo_surface(const char *filename)
 						   width, height, stride);
 }
 
+/* Blurred shadow tiles are cached in $XDG_CACHE_HOME/weston, as raw
+ * ARGB32 rows, under a name made of the parameters they depend on.
+ * Bump the version when the way they are rendered changes. */
+#define SHADOW_CACHE_VERSION 1
+
+static int
+shadow_cache_path(char *path, size_t size, int tile, int radius, int margin)
+{
+	const char *dir, *home;
+	int len;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir) {
+		len = snprintf(path, size, "%s", dir);
+	} else {
+		home = getenv("HOME");
+		if (!home)
+			return -1;
+		len = snprintf(path, size, "%s/.cache", home);
+	}
+	if (len < 0 || (size_t) len >= size)
+		return -1;
+	mkdir(path, 0700);
+
+	len += snprintf(path + len, size - len, "/weston");
+	if ((size_t) len >= size)
+		return -1;
+	mkdir(path, 0700);
+
+	len += snprintf(path + len, size - len,
+			"/shadow-v%d-%d-r%d-m%d.argb",
+			SHADOW_CACHE_VERSION, tile, radius, margin);
+	if ((size_t) len >= size)
+		return -1;
+
+	return 0;
+}
+
+static int
+shadow_cache_load(cairo_surface_t *surface, const char *path)
+{
+	int32_t width, height, stride, i;
+	uint8_t *data;
+	struct stat st;
+	int fd, ret = -1;
+
+	width = cairo_image_surface_get_width(surface);
+	height = cairo_image_surface_get_height(surface);
+	stride = cairo_image_surface_get_stride(surface);
+	data = cairo_image_surface_get_data(surface);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size != width * height * 4)
+		goto out;
+
+	cairo_surface_flush(surface);
+	for (i = 0; i < height; i++)
+		if (read(fd, data + i * stride, width * 4) != width * 4)
+			goto out;
+	cairo_surface_mark_dirty(surface);
+	ret = 0;
+
+out:
+	close(fd);
+	return ret;
+}
+
+static void
+shadow_cache_save(cairo_surface_t *surface, const char *path)
+{
+	int32_t width, height, stride, i;
+	uint8_t *data;
+	char tmp[PATH_MAX];
+	int fd;
+
+	width = cairo_image_surface_get_width(surface);
+	height = cairo_image_surface_get_height(surface);
+	stride = cairo_image_surface_get_stride(surface);
+	data = cairo_image_surface_get_data(surface);
+
+	/* write a private file and rename it into place, so a client
+	 * never picks up half a tile */
+	if (snprintf(tmp, sizeof tmp, "%s.%d", path, getpid()) >=
+	    (int) sizeof tmp)
+		return;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+
+	cairo_surface_flush(surface);
+	for (i = 0; i < height; i++)
+		if (write(fd, data + i * stride, width * 4) != width * 4)
+			break;
+
+	if (close(fd) < 0 || i < height || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
 struct theme *
 theme_create(void)
 {
 	struct theme *t;
 	cairo_t *cr;
 	cairo_pattern_t *pattern;
+	char path[PATH_MAX];
+	int use_cache;
 
 	t = malloc(sizeof *t);
 	t->margin = 32;
@@ -329,13 +532,21 @@ theme_create(void)
 	t->titlebar_height = 27;
 	t->frame_radius = 3;
 	t->shadow = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 128, 128);
-	cr = cairo_create(t->shadow);
-	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-	cairo_set_source_rgba(cr, 0, 0, 0, 1);
-	rounded_rect(cr, 32, 32, 96, 96, t->frame_radius);
-	cairo_fill(cr);
-	cairo_destroy(cr);
-	blur_surface(t->shadow, 64);
+
+	use_cache = shadow_cache_path(path, sizeof path,
+				   128, t->frame_radius, 64) == 0;
+	if (!use_cache || shadow_cache_load(t->shadow, path) < 0) {
+		cr = cairo_create(t->shadow);
+		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+		cairo_set_source_rgba(cr, 0, 0, 0, 1);
+		rounded_rect(cr, 32, 32, 96, 96, t->frame_radius);
+		cairo_fill(cr);
+		cairo_destroy(cr);
+		blur_surface(t->shadow, 64);
+
+		if (use_cache)
+			shadow_cache_save(t->shadow, path);
+	}
 
 	t->active_frame =
 		cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 128, 128);
@@ -374,43 +585,31 @@ theme_destroy(struct theme *t)
 }
 
 void
-theme_render_frame(struct theme *t,
+theme_clip_title(struct theme *t, cairo_t *cr, int width, int height,
+		 uint32_t flags)
+{
+	int margin;
+
+	margin = (flags & THEME_FRAME_MAXIMIZED) ? 0 : t->margin;
+
+	cairo_rectangle (cr, margin + t->width, margin,
+			 width - (margin + t->width) * 2,
+			 t->titlebar_height - t->width);
+	cairo_clip(cr);
+}
+
+void
+theme_render_title(struct theme *t,
 		   cairo_t *cr, int width, int height,
 		   const char *title, uint32_t flags)
 {
 	cairo_text_extents_t extents;
 	cairo_font_extents_t font_extents;
-	cairo_surface_t *source;
 	int x, y, margin;
 
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_rgba(cr, 0, 0, 0, 0);
-	cairo_paint(cr);
-
-	if (flags & THEME_FRAME_MAXIMIZED)
-		margin = 0;
-	else {
-		cairo_set_source_rgba(cr, 0, 0, 0, 0.45);
-		tile_mask(cr, t->shadow,
-			  2, 2, width + 8, height + 8,
-			  64, 64);
-		margin = t->margin;
-	}
-
-	if (flags & THEME_FRAME_ACTIVE)
-		source = t->active_frame;
-	else
-		source = t->inactive_frame;
-
-	tile_source(cr, source,
-		    margin, margin,
-		    width - margin * 2, height - margin * 2,
-		    t->width, t->titlebar_height);
+	margin = (flags & THEME_FRAME_MAXIMIZED) ? 0 : t->margin;
 
-	cairo_rectangle (cr, margin + t->width, margin,
-			 width - (margin + t->width) * 2,
-			 t->titlebar_height - t->width);
-	cairo_clip(cr);
+	theme_clip_title(t, cr, width, height, flags);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 	cairo_select_font_face(cr, "sans",
@@ -439,6 +638,41 @@ theme_render_frame(struct theme *t,
 	}
 }
 
+void
+theme_render_frame(struct theme *t,
+		   cairo_t *cr, int width, int height,
+		   const char *title, uint32_t flags)
+{
+	cairo_surface_t *source;
+	int margin;
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(cr, 0, 0, 0, 0);
+	cairo_paint(cr);
+
+	if (flags & THEME_FRAME_MAXIMIZED)
+		margin = 0;
+	else {
+		cairo_set_source_rgba(cr, 0, 0, 0, 0.45);
+		tile_mask(cr, t->shadow,
+			  2, 2, width + 8, height + 8,
+			  64, 64);
+		margin = t->margin;
+	}
+
+	if (flags & THEME_FRAME_ACTIVE)
+		source = t->active_frame;
+	else
+		source = t->inactive_frame;
+
+	tile_source(cr, source,
+		    margin, margin,
+		    width - margin * 2, height - margin * 2,
+		    t->width, t->titlebar_height);
+
+	theme_render_title(t, cr, width, height, title, flags);
+}
+
 enum theme_location
 theme_get_location(struct theme *t, int x, int y,
 				int width, int height, int flags)
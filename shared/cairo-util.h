@@ -70,6 +70,15 @@ theme_render_frame(struct theme *t,
 		   cairo_t *cr, int width, int height,
 		   const char *title, uint32_t flags);
 
+void
+theme_render_title(struct theme *t,
+		   cairo_t *cr, int width, int height,
+		   const char *title, uint32_t flags);
+
+void
+theme_clip_title(struct theme *t, cairo_t *cr, int width, int height,
+		 uint32_t flags);
+
 enum theme_location {
 	THEME_LOCATION_INTERIOR = 0,
 	THEME_LOCATION_RESIZING_TOP = 1,
@@ -20,6 +20,8 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -27,7 +29,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include <linux/input.h>
+#include <linux/sockios.h>
 
 #include <freerdp/freerdp.h>
 #include <freerdp/listener.h>
@@ -42,6 +49,14 @@
 #include "pixman-renderer.h"
 
 #define MAX_FREERDP_FDS 32
+#define RDP_TILE_SIZE 64
+#define RDP_ENCODE_TILE_SIZE 256
+#define RDP_MAX_ENCODER_THREADS 4
+#define RDP_MAX_PENDING_FRAMES 2
+#define RDP_MIN_FRAME_INTERVAL 16
+#define RDP_MAX_FRAME_INTERVAL 500
+#define RDP_BACKLOG_LOW (16 * 1024)
+#define RDP_BACKLOG_HIGH (128 * 1024)
 
 struct rdp_compositor_config {
 	int width;
@@ -91,15 +106,80 @@ struct rdp_output {
 	struct wl_list peers;
 };
 
+struct rdp_encode_job;
+struct rdp_peer_context;
+
+/* a piece of a frame that is encoded independently */
+struct rdp_encode_task {
+	struct wl_list link;
+	struct rdp_encode_job *job;
+	pixman_box32_t box;
+	RFX_RECT *rfx_rects;	/* RemoteFX only, relative to the job extents */
+	int nrects;
+	wStream *stream;
+};
+
+/* a frame for a peer, with a snapshot of the pixels to encode */
+struct rdp_encode_job {
+	struct wl_list link;
+	pixman_box32_t extents;
+	uint32_t *pixels;
+	int stride;
+	UINT32 codecID;
+	uint32_t submit_time;
+	struct rdp_encode_task *tasks;
+	int ntasks;
+	int pending;
+};
+
+struct rdp_encoder_worker {
+	pthread_t thread;
+	NSC_CONTEXT *nsc_context;
+	struct rdp_peer_context *context;
+};
+
+/* Encodes the frames of a peer off the compositor thread. Frames are split
+ * in tasks that workers pick up, and completed frames are sent in order
+ * from the compositor thread once the workers signal the pipe. */
+struct rdp_encoder {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct rdp_encoder_worker workers[RDP_MAX_ENCODER_THREADS];
+	int nworkers;
+	int rfx_busy;
+	int quit;
+
+	struct wl_list tasks;
+	struct wl_list jobs;
+	int njobs;
+
+	int pipe[2];
+	struct wl_event_source *pipe_source;
+};
+
+/* Adapts how often a peer is sent frames to how fast its socket drains and
+ * how long its frames take to encode. Damage is held back between frames. */
+struct rdp_peer_pacing {
+	uint32_t interval;
+	uint32_t last_frame;
+	uint32_t encode_time;
+	pixman_region32_t damage;
+	struct wl_event_source *timer;
+};
+
 struct rdp_peer_context {
 	rdpContext _p;
 
 	struct rdp_compositor *rdpCompositor;
+	struct rdp_output *output;
 	struct wl_event_source *events[MAX_FREERDP_FDS];
 	RFX_CONTEXT *rfx_context;
-	wStream *encode_stream;
-	RFX_RECT *rfx_rects;
-	NSC_CONTEXT *nsc_context;
+	struct rdp_encoder encoder;
+	struct rdp_peer_pacing pacing;
+
+	/* what the peer was last sent, to skip tiles that didn't change */
+	uint32_t *tile_cache;
+	int tile_cache_width, tile_cache_height;
 
 	struct rdp_peers_item item;
 };
@@ -118,95 +198,6 @@ rdp_compositor_config_init(struct rdp_compositor_config *config) {
 	config->env_socket = 0;
 }
 
-static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
-{
-	int width, height, nrects, i;
-	pixman_box32_t *region, *rects;
-	uint32_t *ptr;
-	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
-
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
-
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
-
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
-
-	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
-
-	for (i = 0; i < nrects; i++) {
-		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
-
-		rfxRect->x = (region->x1 - damage->extents.x1);
-		rfxRect->y = (region->y1 - damage->extents.y1);
-		rfxRect->width = (region->x2 - region->x1);
-		rfxRect->height = (region->y2 - region->y1);
-	}
-
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
-			(BYTE *)ptr, width, height,
-			pixman_image_get_stride(image)
-	);
-
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-
-	update->SurfaceBits(update->context, cmd);
-}
-
-
-static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
-{
-	int width, height;
-	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
-
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
-
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
-
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
-
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-	update->SurfaceBits(update->context, cmd);
-}
-
 static void
 pixman_image_flipped_subrect(const pixman_box32_t *rect, pixman_image_t *img, BYTE *dest) {
 	int stride = pixman_image_get_stride(img);
@@ -277,19 +268,648 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	update->SurfaceFrameMarker(peer->context, marker);
 }
 
+static int
+rdp_peer_get_backlog(freerdp_peer *peer)
+{
+	int backlog;
+
+	if (ioctl(peer->sockfd, SIOCOUTQ, &backlog) < 0)
+		return 0;
+
+	return backlog;
+}
+
+/* Called once a frame has been handed to the peer, encode_time is how long
+ * it took from the submission. */
 static void
-rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+rdp_peer_update_pacing(freerdp_peer *peer, uint32_t encode_time)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_peer_pacing *pacing = &context->pacing;
+	int backlog = rdp_peer_get_backlog(peer);
+
+	pacing->encode_time = (pacing->encode_time * 7 + encode_time) / 8;
+
+	if (backlog > RDP_BACKLOG_HIGH)
+		pacing->interval *= 2;
+	else if (backlog < RDP_BACKLOG_LOW)
+		pacing->interval -= pacing->interval / 4;
+
+	/* no point in producing frames faster than they are encoded */
+	if (pacing->interval < pacing->encode_time)
+		pacing->interval = pacing->encode_time;
+
+	if (pacing->interval < RDP_MIN_FRAME_INTERVAL)
+		pacing->interval = RDP_MIN_FRAME_INTERVAL;
+	else if (pacing->interval > RDP_MAX_FRAME_INTERVAL)
+		pacing->interval = RDP_MAX_FRAME_INTERVAL;
+}
+
+static void
+rdp_encode_task_run(struct rdp_peer_context *context, NSC_CONTEXT *nsc_context,
+		struct rdp_encode_task *task)
+{
+	struct rdp_encode_job *job = task->job;
+	uint32_t *ptr;
+
+	Stream_Clear(task->stream);
+	Stream_SetPosition(task->stream, 0);
+
+	if (task->rfx_rects) {
+		rfx_compose_message(context->rfx_context, task->stream,
+				task->rfx_rects, task->nrects, (BYTE *)job->pixels,
+				job->extents.x2 - job->extents.x1,
+				job->extents.y2 - job->extents.y1,
+				job->stride);
+	} else {
+		ptr = job->pixels + (task->box.x1 - job->extents.x1) +
+			(task->box.y1 - job->extents.y1) * (job->stride / sizeof(uint32_t));
+
+		nsc_compose_message(nsc_context, task->stream, (BYTE *)ptr,
+				task->box.x2 - task->box.x1,
+				task->box.y2 - task->box.y1,
+				job->stride);
+	}
+}
+
+/* must be called with the encoder mutex held */
+static struct rdp_encode_task *
+rdp_encoder_next_task(struct rdp_encoder *encoder)
+{
+	struct rdp_encode_task *task;
+
+	wl_list_for_each(task, &encoder->tasks, link) {
+		/* the RemoteFX context is stateful, its frames go one at a time */
+		if (task->rfx_rects && encoder->rfx_busy)
+			continue;
+		return task;
+	}
+
+	return NULL;
+}
+
+static void *
+rdp_encoder_worker_main(void *data)
+{
+	struct rdp_encoder_worker *worker = data;
+	struct rdp_encoder *encoder = &worker->context->encoder;
+	struct rdp_encode_task *task;
+	int isRfx;
+	char c = 0;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (1) {
+		while (!encoder->quit && !(task = rdp_encoder_next_task(encoder)))
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+		if (encoder->quit)
+			break;
+
+		wl_list_remove(&task->link);
+		isRfx = task->rfx_rects != NULL;
+		if (isRfx)
+			encoder->rfx_busy = 1;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		rdp_encode_task_run(worker->context, worker->nsc_context, task);
+
+		pthread_mutex_lock(&encoder->mutex);
+		if (isRfx) {
+			encoder->rfx_busy = 0;
+			pthread_cond_broadcast(&encoder->cond);
+		}
+
+		/* a full pipe already wakes up the compositor, ignore EAGAIN */
+		task->job->pending--;
+		if (!task->job->pending && write(encoder->pipe[1], &c, 1) < 0 &&
+				errno != EAGAIN)
+			weston_log("unable to signal the rdp encoder pipe\n");
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+static void
+rdp_encode_job_destroy(struct rdp_encode_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->ntasks; i++) {
+		free(job->tasks[i].rfx_rects);
+		Stream_Free(job->tasks[i].stream, TRUE);
+	}
+	free(job->tasks);
+	free(job->pixels);
+	free(job);
+}
+
+static void
+rdp_encode_job_send(struct rdp_encode_job *job, freerdp_peer *peer)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND cmd;
+	struct rdp_encode_task *task;
+	int i;
+
+	memset(&cmd, 0, sizeof cmd);
+	cmd.bpp = 32;
+	cmd.codecID = job->codecID;
+
+	for (i = 0; i < job->ntasks; i++) {
+		task = &job->tasks[i];
+
+		cmd.destLeft = task->box.x1;
+		cmd.destTop = task->box.y1;
+		cmd.destRight = task->box.x2;
+		cmd.destBottom = task->box.y2;
+		cmd.width = task->box.x2 - task->box.x1;
+		cmd.height = task->box.y2 - task->box.y1;
+		cmd.bitmapDataLength = Stream_GetPosition(task->stream);
+		cmd.bitmapData = Stream_Buffer(task->stream);
+
+		update->SurfaceBits(update->context, &cmd);
+	}
+}
+
+static int
+rdp_encode_job_add_task(struct rdp_encode_job *job, const pixman_box32_t *box)
+{
+	struct rdp_encode_task *task = &job->tasks[job->ntasks];
+
+	task->stream = Stream_New(NULL, 65536);
+	if (!task->stream)
+		return -1;
+
+	task->job = job;
+	task->box = *box;
+	job->ntasks++;
+	return 0;
+}
+
+static struct rdp_encode_job *
+rdp_encode_job_create(pixman_region32_t *region, pixman_image_t *image,
+		freerdp_peer *peer)
+{
+	struct rdp_encode_job *job;
+	struct rdp_encode_task *task;
+	pixman_region32_t tileRegion;
+	pixman_box32_t *rects;
+	int x, y, i, width, height, nrects, maxTasks, imageStride;
+	BYTE *src, *dst;
+
+	job = calloc(1, sizeof *job);
+	if (!job)
+		return NULL;
+
+	job->extents = *pixman_region32_extents(region);
+	width = job->extents.x2 - job->extents.x1;
+	height = job->extents.y2 - job->extents.y1;
+
+	/* the shadow surface is repainted while we encode, take a snapshot */
+	job->stride = width * 4;
+	job->pixels = malloc(job->stride * height);
+	if (!job->pixels)
+		goto out_free;
+
+	imageStride = pixman_image_get_stride(image);
+	src = (BYTE *)pixman_image_get_data(image) + job->extents.y1 * imageStride +
+		job->extents.x1 * 4;
+	dst = (BYTE *)job->pixels;
+	for (y = 0; y < height; y++, src += imageStride, dst += job->stride)
+		memcpy(dst, src, job->stride);
+
+	if (peer->settings->RemoteFxCodec) {
+		job->codecID = peer->settings->RemoteFxCodecId;
+		job->tasks = calloc(1, sizeof *job->tasks);
+		if (!job->tasks || rdp_encode_job_add_task(job, &job->extents) < 0)
+			goto out_free;
+
+		task = &job->tasks[0];
+		rects = pixman_region32_rectangles(region, &nrects);
+		task->rfx_rects = malloc(nrects * sizeof *task->rfx_rects);
+		if (!task->rfx_rects)
+			goto out_free;
+		task->nrects = nrects;
+
+		for (i = 0; i < nrects; i++) {
+			task->rfx_rects[i].x = rects[i].x1 - job->extents.x1;
+			task->rfx_rects[i].y = rects[i].y1 - job->extents.y1;
+			task->rfx_rects[i].width = rects[i].x2 - rects[i].x1;
+			task->rfx_rects[i].height = rects[i].y2 - rects[i].y1;
+		}
+	} else {
+		/* NSCodec messages are independent, encode large damage as tiles */
+		job->codecID = peer->settings->NSCodecId;
+		maxTasks = ((width + RDP_ENCODE_TILE_SIZE - 1) / RDP_ENCODE_TILE_SIZE + 1) *
+			((height + RDP_ENCODE_TILE_SIZE - 1) / RDP_ENCODE_TILE_SIZE + 1);
+		job->tasks = calloc(maxTasks, sizeof *job->tasks);
+		if (!job->tasks)
+			goto out_free;
+
+		pixman_region32_init(&tileRegion);
+		for (y = job->extents.y1 - job->extents.y1 % RDP_ENCODE_TILE_SIZE;
+				y < job->extents.y2; y += RDP_ENCODE_TILE_SIZE) {
+			for (x = job->extents.x1 - job->extents.x1 % RDP_ENCODE_TILE_SIZE;
+					x < job->extents.x2; x += RDP_ENCODE_TILE_SIZE) {
+				pixman_region32_intersect_rect(&tileRegion, region, x, y,
+						RDP_ENCODE_TILE_SIZE, RDP_ENCODE_TILE_SIZE);
+				if (!pixman_region32_not_empty(&tileRegion))
+					continue;
+
+				if (rdp_encode_job_add_task(job,
+						pixman_region32_extents(&tileRegion)) < 0) {
+					pixman_region32_fini(&tileRegion);
+					goto out_free;
+				}
+			}
+		}
+		pixman_region32_fini(&tileRegion);
+	}
+
+	job->pending = job->ntasks;
+	return job;
+
+out_free:
+	rdp_encode_job_destroy(job);
+	return NULL;
+}
+
+static void
+rdp_peer_flush(freerdp_peer *peer);
+
+static void
+rdp_encoder_submit(freerdp_peer *peer, pixman_region32_t *region)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_encoder *encoder = &context->encoder;
+	pixman_image_t *image = context->output->shadow_surface;
+	struct rdp_encode_job *job;
+	int i;
+
+	job = rdp_encode_job_create(region, image, peer);
+	if (!job) {
+		weston_log("unable to create an rdp encoding job\n");
+		return;
+	}
+	job->submit_time = weston_compositor_get_time();
+
+	if (!encoder->nworkers) {
+		for (i = 0; i < job->ntasks; i++)
+			rdp_encode_task_run(context, encoder->workers[0].nsc_context,
+					&job->tasks[i]);
+		rdp_encode_job_send(job, peer);
+		rdp_peer_update_pacing(peer,
+				weston_compositor_get_time() - job->submit_time);
+		rdp_encode_job_destroy(job);
+		return;
+	}
+
+	pthread_mutex_lock(&encoder->mutex);
+	wl_list_insert(encoder->jobs.prev, &job->link);
+	encoder->njobs++;
+	for (i = 0; i < job->ntasks; i++)
+		wl_list_insert(encoder->tasks.prev, &job->tasks[i].link);
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static int
+rdp_encoder_pipe_handler(int fd, uint32_t mask, void *data)
+{
+	freerdp_peer *peer = data;
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_encoder *encoder = &context->encoder;
+	struct rdp_encode_job *job;
+	char buf[64];
+
+	while (read(fd, buf, sizeof buf) == sizeof buf)
+		;
+
+	/* send completed frames in order */
+	pthread_mutex_lock(&encoder->mutex);
+	while (!wl_list_empty(&encoder->jobs)) {
+		job = container_of(encoder->jobs.next, struct rdp_encode_job, link);
+		if (job->pending)
+			break;
+
+		wl_list_remove(&job->link);
+		encoder->njobs--;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		rdp_encode_job_send(job, peer);
+		rdp_peer_update_pacing(peer,
+				weston_compositor_get_time() - job->submit_time);
+		rdp_encode_job_destroy(job);
+
+		pthread_mutex_lock(&encoder->mutex);
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	/* send the damage that was held back while the queue was full */
+	rdp_peer_flush(peer);
+
+	return 1;
+}
+
+static void
+rdp_encoder_init(struct rdp_encoder *encoder, RdpPeerContext *context)
+{
+	struct wl_event_loop *loop;
+	long ncpus;
+	int i, nworkers;
+
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->cond, NULL);
+	wl_list_init(&encoder->tasks);
+	wl_list_init(&encoder->jobs);
+	encoder->njobs = 0;
+	encoder->nworkers = 0;
+	encoder->rfx_busy = 0;
+	encoder->quit = 0;
+	encoder->pipe_source = NULL;
+
+	for (i = 0; i < RDP_MAX_ENCODER_THREADS; i++) {
+		encoder->workers[i].context = context;
+		encoder->workers[i].nsc_context = nsc_context_new();
+		nsc_context_set_pixel_format(encoder->workers[i].nsc_context,
+				RDP_PIXEL_FORMAT_B8G8R8A8);
+	}
+
+	if (pipe2(encoder->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		weston_log("unable to create the rdp encoder pipe, encoding synchronously\n");
+		encoder->pipe[0] = encoder->pipe[1] = -1;
+		return;
+	}
+
+	loop = wl_display_get_event_loop(context->rdpCompositor->base.wl_display);
+	encoder->pipe_source = wl_event_loop_add_fd(loop, encoder->pipe[0],
+			WL_EVENT_READABLE, rdp_encoder_pipe_handler, context->item.peer);
+	if (!encoder->pipe_source)
+		return;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = (ncpus > RDP_MAX_ENCODER_THREADS) ? RDP_MAX_ENCODER_THREADS : ncpus;
+	if (nworkers < 1)
+		nworkers = 1;
+
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&encoder->workers[i].thread, NULL,
+				rdp_encoder_worker_main, &encoder->workers[i]) != 0)
+			break;
+		encoder->nworkers++;
+	}
+}
+
+static void
+rdp_encoder_release(struct rdp_encoder *encoder)
+{
+	struct rdp_encode_job *job, *next;
+	int i;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->quit = 1;
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->nworkers; i++)
+		pthread_join(encoder->workers[i].thread, NULL);
+
+	wl_list_for_each_safe(job, next, &encoder->jobs, link)
+		rdp_encode_job_destroy(job);
+
+	for (i = 0; i < RDP_MAX_ENCODER_THREADS; i++)
+		nsc_context_free(encoder->workers[i].nsc_context);
+
+	if (encoder->pipe_source)
+		wl_event_source_remove(encoder->pipe_source);
+	if (encoder->pipe[0] >= 0) {
+		close(encoder->pipe[0]);
+		close(encoder->pipe[1]);
+	}
+
+	pthread_cond_destroy(&encoder->cond);
+	pthread_mutex_destroy(&encoder->mutex);
+}
+
+static int
+rdp_peer_tile_cache_ensure(RdpPeerContext *context, pixman_image_t *image)
+{
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+
+	if (context->tile_cache && context->tile_cache_width == width &&
+			context->tile_cache_height == height)
+		return 0;
+
+	free(context->tile_cache);
+	context->tile_cache = calloc(width * height, 4);
+	if (!context->tile_cache) {
+		context->tile_cache_width = context->tile_cache_height = 0;
+		return -1;
+	}
+
+	context->tile_cache_width = width;
+	context->tile_cache_height = height;
+	return 1;
+}
+
+/* Compares the given box of image against the tile cache and updates the
+ * cache. Returns non zero if the contents changed. */
+static int
+rdp_peer_tile_cache_update(RdpPeerContext *context, pixman_image_t *image,
+		const pixman_box32_t *box)
+{
+	int stride = pixman_image_get_stride(image);
+	int cacheStride = context->tile_cache_width * 4;
+	int bytes = (box->x2 - box->x1) * 4;
+	int y, changed = 0;
+	BYTE *src, *dst;
+
+	src = (BYTE *)pixman_image_get_data(image) + box->y1 * stride + box->x1 * 4;
+	dst = (BYTE *)context->tile_cache + box->y1 * cacheStride + box->x1 * 4;
+
+	for (y = box->y1; y < box->y2; y++, src += stride, dst += cacheStride) {
+		if (changed || memcmp(dst, src, bytes)) {
+			memcpy(dst, src, bytes);
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* Reduces region to the 64x64 tiles whose damaged part differs from what
+ * the peer was last sent. */
+static void
+rdp_peer_filter_region(RdpPeerContext *context, pixman_image_t *image,
+		pixman_region32_t *region, pixman_region32_t *changed)
+{
+	pixman_region32_t tileDamage;
+	pixman_box32_t *extents, *rects, full;
+	int x, y, i, nrects, tileChanged;
+
+	switch (rdp_peer_tile_cache_ensure(context, image)) {
+	case 0:
+		break;
+	case 1:
+		/* fresh cache, nothing in it matches what the peer has: fill
+		 * all of it and send the whole image */
+		full.x1 = 0;
+		full.y1 = 0;
+		full.x2 = pixman_image_get_width(image);
+		full.y2 = pixman_image_get_height(image);
+		rdp_peer_tile_cache_update(context, image, &full);
+		pixman_region32_fini(changed);
+		pixman_region32_init_rect(changed, 0, 0, full.x2, full.y2);
+		return;
+	default:
+		pixman_region32_copy(changed, region);
+		return;
+	}
+
+	pixman_region32_init(&tileDamage);
+	extents = pixman_region32_extents(region);
+	for (y = extents->y1 - extents->y1 % RDP_TILE_SIZE; y < extents->y2; y += RDP_TILE_SIZE) {
+		for (x = extents->x1 - extents->x1 % RDP_TILE_SIZE; x < extents->x2; x += RDP_TILE_SIZE) {
+			pixman_region32_intersect_rect(&tileDamage, region, x, y,
+					RDP_TILE_SIZE, RDP_TILE_SIZE);
+
+			rects = pixman_region32_rectangles(&tileDamage, &nrects);
+			tileChanged = 0;
+			for (i = 0; i < nrects; i++)
+				tileChanged |= rdp_peer_tile_cache_update(context, image, &rects[i]);
+
+			if (tileChanged)
+				pixman_region32_union(changed, changed, &tileDamage);
+		}
+	}
+	pixman_region32_fini(&tileDamage);
+}
+
+/* Sends the damage held back for the peer, unless it is not due for a new
+ * frame yet. */
+static void
+rdp_peer_flush(freerdp_peer *peer)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
-	struct rdp_output *output = context->rdpCompositor->output;
+	struct rdp_peer_pacing *pacing = &context->pacing;
+	pixman_image_t *image = context->output->shadow_surface;
 	rdpSettings *settings = peer->settings;
+	int useEncoder = settings->RemoteFxCodec || settings->NSCodec;
+	pixman_region32_t damage;
+	uint32_t now, elapsed;
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-	else
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+	if (!(context->item.flags & RDP_PEER_OUTPUT_ENABLED) ||
+			!pixman_region32_not_empty(&pacing->damage))
+		return;
+
+	/* the pipe handler flushes again once a frame in flight is sent */
+	if (useEncoder && context->encoder.njobs >= RDP_MAX_PENDING_FRAMES)
+		return;
+
+	now = weston_compositor_get_time();
+	elapsed = now - pacing->last_frame;
+	if (elapsed < pacing->interval) {
+		wl_event_source_timer_update(pacing->timer, pacing->interval - elapsed);
+		return;
+	}
+
+	/* the previous frames are still queued on the socket, back off */
+	if (rdp_peer_get_backlog(peer) > RDP_BACKLOG_HIGH) {
+		rdp_peer_update_pacing(peer, pacing->encode_time);
+		pacing->last_frame = now;
+		wl_event_source_timer_update(pacing->timer, pacing->interval);
+		return;
+	}
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect_rect(&damage, &pacing->damage, 0, 0,
+			pixman_image_get_width(image), pixman_image_get_height(image));
+	pixman_region32_clear(&pacing->damage);
+	pacing->last_frame = now;
+
+	if (pixman_region32_not_empty(&damage)) {
+		if (useEncoder) {
+			rdp_encoder_submit(peer, &damage);
+		} else {
+			rdp_peer_refresh_raw(&damage, image, peer);
+			rdp_peer_update_pacing(peer, weston_compositor_get_time() - now);
+		}
+	}
+	pixman_region32_fini(&damage);
+}
+
+static int
+rdp_peer_pacing_timer(void *data)
+{
+	rdp_peer_flush(data);
+
+	return 1;
+}
+
+static void
+rdp_peer_pacing_init(RdpPeerContext *context)
+{
+	struct rdp_peer_pacing *pacing = &context->pacing;
+	struct wl_event_loop *loop;
+
+	pacing->interval = RDP_MIN_FRAME_INTERVAL;
+	pacing->last_frame = 0;
+	pacing->encode_time = 0;
+	pixman_region32_init(&pacing->damage);
+
+	loop = wl_display_get_event_loop(context->rdpCompositor->base.wl_display);
+	pacing->timer = wl_event_loop_add_timer(loop, rdp_peer_pacing_timer,
+			context->item.peer);
+}
+
+static void
+rdp_peer_pacing_release(RdpPeerContext *context)
+{
+	struct rdp_peer_pacing *pacing = &context->pacing;
+
+	if (pacing->timer)
+		wl_event_source_remove(pacing->timer);
+	pixman_region32_fini(&pacing->damage);
+}
+
+static void
+rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_output *output = context->output;
+	pixman_region32_t changed;
+
+	pixman_region32_init(&changed);
+	rdp_peer_filter_region(context, output->shadow_surface, region, &changed);
+	pixman_region32_union(&context->pacing.damage, &context->pacing.damage, &changed);
+	pixman_region32_fini(&changed);
+
+	rdp_peer_flush(peer);
+}
+
+static void
+rdp_peer_refresh_full(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_output *output = context->output;
+	pixman_region32_t damage;
+
+	if (!output)
+		return;
+
+	pixman_region32_init_rect(&damage, 0, 0,
+			output->base.width, output->base.height);
+
+	/* the peer lost its contents, resynchronize the cache with what we send */
+	if (rdp_peer_tile_cache_ensure(context, output->shadow_surface) >= 0)
+		rdp_peer_tile_cache_update(context, output->shadow_surface,
+				pixman_region32_extents(&damage));
+
+	pixman_region32_union(&context->pacing.damage, &context->pacing.damage, &damage);
+	pixman_region32_fini(&damage);
+
+	rdp_peer_flush(peer);
 }
 
 static void
@@ -303,36 +923,78 @@ rdp_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, msec);
 }
 
+/* The output doesn't need to be repainted faster than its fastest peer
+ * takes frames, the damage piles up on the primary plane meanwhile. */
+static uint32_t
+rdp_output_frame_interval(struct rdp_output *output)
+{
+	struct rdp_peers_item *item;
+	RdpPeerContext *context;
+	uint32_t interval = RDP_MAX_FRAME_INTERVAL;
+	int enabled = 0;
+
+	wl_list_for_each(item, &output->peers, link) {
+		if (!(item->flags & RDP_PEER_ACTIVATED) ||
+				!(item->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		context = (RdpPeerContext *)item->peer->context;
+		if (context->pacing.interval < interval)
+			interval = context->pacing.interval;
+		enabled = 1;
+	}
+
+	return enabled ? interval : RDP_MIN_FRAME_INTERVAL;
+}
+
 static void
 rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
 	struct rdp_peers_item *outputPeer;
+	pixman_region32_t local_damage;
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
+	/* damage is in global coordinates, peers work in the output's */
+	pixman_region32_init(&local_damage);
+	pixman_region32_copy(&local_damage, damage);
+	pixman_region32_translate(&local_damage, -output->base.x, -output->base.y);
+
 	wl_list_for_each(outputPeer, &output->peers, link) {
 		if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
 				(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
 		{
-			rdp_peer_refresh_region(damage, outputPeer->peer);
+			rdp_peer_refresh_region(&local_damage, outputPeer->peer);
 		}
 	}
+	pixman_region32_fini(&local_damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	wl_event_source_timer_update(output->finish_frame_timer,
+			rdp_output_frame_interval(output));
 }
 
 static void
 rdp_output_destroy(struct weston_output *output_base)
 {
 	struct rdp_output *output = (struct rdp_output *)output_base;
+	struct weston_mode *mode, *next;
 
+	wl_list_remove(&output->base.link);
 	wl_event_source_remove(output->finish_frame_timer);
+
+	pixman_renderer_output_destroy(output_base);
+	pixman_image_unref(output->shadow_surface);
+
+	weston_output_destroy(&output->base);
+
+	wl_list_for_each_safe(mode, next, &output->base.mode_list, link)
+		free(mode);
 	free(output);
 }
 
@@ -363,6 +1025,7 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode) {
 	rdpSettings *settings;
 	pixman_image_t *new_shadow_buffer;
 	struct weston_mode *local_mode;
+	struct weston_output *other;
 
 	local_mode = find_matching_mode(output, target_mode);
 	if(!local_mode) {
@@ -373,6 +1036,21 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode) {
 	if(local_mode == output->current)
 		return 0;
 
+	/* the outputs are laid out side by side, an output can't grow over
+	 * its neighbours */
+	wl_list_for_each(other, &output->compositor->output_list, link) {
+		if (other == output)
+			continue;
+		if (output->x < other->x + other->width &&
+				other->x < output->x + local_mode->width &&
+				output->y < other->y + other->height &&
+				other->y < output->y + local_mode->height) {
+			weston_log("mode %dx%d would overlap another output\n",
+					target_mode->width, target_mode->height);
+			return -EBUSY;
+		}
+	}
+
 	output->current->flags = 0;
 	output->current = local_mode;
 	output->current->flags = WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
@@ -438,8 +1116,8 @@ parse_extra_modes(const char *modes_str, struct rdp_output *output) {
 	}
 	return 0;
 }
-static int
-rdp_compositor_create_output(struct rdp_compositor *c, int width, int height,
+static struct rdp_output *
+rdp_compositor_create_output(struct rdp_compositor *c, int x, int width, int height,
 		const char *extraModes)
 {
 	struct rdp_output *output;
@@ -448,7 +1126,7 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height,
 
 	output = malloc(sizeof *output);
 	if (output == NULL)
-		return -1;
+		return NULL;
 	memset(output, 0, sizeof *output);
 
 	wl_list_init(&output->peers);
@@ -469,7 +1147,7 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height,
 	}
 
 	output->base.current = currentMode;
-	weston_output_init(&output->base, &c->base, 0, 0, width, height,
+	weston_output_init(&output->base, &c->base, x, 0, width, height,
 			   WL_OUTPUT_TRANSFORM_NORMAL, 1);
 
 	output->base.make = "weston";
@@ -486,7 +1164,7 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height,
 	if (pixman_renderer_output_create(&output->base) < 0)
 		goto out_shadow_surface;
 
-	weston_output_move(&output->base, 0, 0);
+	weston_output_move(&output->base, x, 0);
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
 	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
@@ -499,10 +1177,9 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height,
 	output->base.set_backlight = NULL;
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = rdp_switch_mode;
-	c->output = output;
 
 	wl_list_insert(c->base.output_list.prev, &output->base.link);
-	return 0;
+	return output;
 
 out_shadow_surface:
 	pixman_image_unref(output->shadow_surface);
@@ -513,7 +1190,50 @@ out_free_output_and_modes:
 		free(currentMode);
 out_free_output:
 	free(output);
-	return -1;
+	return NULL;
+}
+
+/* Peers after the first get an output of their own, in the first gap wide
+ * enough along the row of outputs, so they don't disturb the others. */
+static struct rdp_output *
+rdp_compositor_create_peer_output(struct rdp_compositor *c, int width, int height)
+{
+	struct weston_output *output;
+	int x = 0, moved = 1;
+
+	while (moved) {
+		moved = 0;
+		wl_list_for_each(output, &c->base.output_list, link) {
+			if (x < output->x + output->width && output->x < x + width) {
+				x = output->x + output->width;
+				moved = 1;
+			}
+		}
+	}
+
+	return rdp_compositor_create_output(c, x, width, height, NULL);
+}
+
+static void
+rdp_peer_attach_output(RdpPeerContext *context, struct rdp_output *output)
+{
+	context->output = output;
+	wl_list_insert(&output->peers, &context->item.link);
+}
+
+static void
+rdp_peer_detach_output(RdpPeerContext *context)
+{
+	struct rdp_output *output = context->output;
+
+	wl_list_remove(&context->item.link);
+	wl_list_init(&context->item.link);
+	context->output = NULL;
+
+	/* the initial output stays around for the next peer */
+	if (output && output != context->rdpCompositor->output &&
+			wl_list_empty(&output->peers))
+		output->base.destroy(&output->base);
 }
 
 static void
@@ -574,6 +1294,7 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 {
 	context->item.peer = client;
 	context->item.flags = 0;
+	wl_list_init(&context->item.link);
 
 	context->rfx_context = rfx_context_new();
 	context->rfx_context->mode = RLGR3;
@@ -581,10 +1302,6 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	context->rfx_context->height = client->settings->DesktopHeight;
 	rfx_context_set_pixel_format(context->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
 
-	context->nsc_context = nsc_context_new();
-	nsc_context_set_pixel_format(context->nsc_context, RDP_PIXEL_FORMAT_B8G8R8A8);
-
-	context->encode_stream = Stream_New(NULL, 65536);
 }
 
 static void
@@ -594,7 +1311,6 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 	if(!context)
 		return;
 
-	wl_list_remove(&context->item.link);
 	for(i = 0; i < MAX_FREERDP_FDS; i++) {
 		if (context->events[i])
 			wl_event_source_remove(context->events[i]);
@@ -602,10 +1318,11 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 
 	if(context->item.flags & RDP_PEER_ACTIVATED)
 		weston_seat_release(&context->item.seat);
-	Stream_Free(context->encode_stream, TRUE);
-	nsc_context_free(context->nsc_context);
+	rdp_peer_pacing_release(context);
+	rdp_encoder_release(&context->encoder);
 	rfx_context_free(context->rfx_context);
-	free(context->rfx_rects);
+	free(context->tile_cache);
+	rdp_peer_detach_output(context);
 }
 
 
@@ -672,13 +1389,9 @@ xf_peer_post_connect(freerdp_peer* client)
 	struct xkb_rule_names xkbRuleNames;
 	struct xkb_keymap *keymap;
 	int i;
-	pixman_box32_t box;
-	pixman_region32_t damage;
-
 
 	peerCtx = (RdpPeerContext *)client->context;
 	c = peerCtx->rdpCompositor;
-	output = c->output;
 	settings = client->settings;
 
 	if(!settings->SurfaceCommandsEnabled) {
@@ -686,6 +1399,19 @@ xf_peer_post_connect(freerdp_peer* client)
 		return FALSE;
 	}
 
+	/* the first peer takes the initial output, the others get their own at
+	 * the size they asked for */
+	output = c->output;
+	if(!wl_list_empty(&output->peers)) {
+		output = rdp_compositor_create_peer_output(c, settings->DesktopWidth,
+				settings->DesktopHeight);
+		if(!output) {
+			weston_log("unable to create an output for the peer, sharing the first one\n");
+			output = c->output;
+		}
+	}
+	rdp_peer_attach_output(peerCtx, output);
+
 	if(output->base.width != (int)settings->DesktopWidth ||
 			output->base.height != (int)settings->DesktopHeight)
 	{
@@ -727,7 +1453,7 @@ xf_peer_post_connect(freerdp_peer* client)
 	weston_seat_init_keyboard(&peerCtx->item.seat, keymap);
 	weston_seat_init_pointer(&peerCtx->item.seat);
 
-	peerCtx->item.flags |= RDP_PEER_ACTIVATED;
+	peerCtx->item.flags |= RDP_PEER_ACTIVATED | RDP_PEER_OUTPUT_ENABLED;
 
 	/* disable pointer on the client side */
 	pointer = client->update->pointer;
@@ -735,15 +1461,7 @@ xf_peer_post_connect(freerdp_peer* client)
 	pointer->PointerSystem(client->context, &pointer->pointer_system);
 
 	/* sends a full refresh */
-	box.x1 = 0;
-	box.y1 = 0;
-	box.x2 = output->base.width;
-	box.y2 = output->base.height;
-	pixman_region32_init_with_extents(&damage, &box);
-
-	rdp_peer_refresh_region(&damage, client);
-
-	pixman_region32_fini(&damage);
+	rdp_peer_refresh_full(client);
 
 	return TRUE;
 }
@@ -752,7 +1470,14 @@ static BOOL
 xf_peer_activate(freerdp_peer *client)
 {
 	RdpPeerContext *context = (RdpPeerContext *)client->context;
+	struct rdp_encoder *encoder = &context->encoder;
+
+	/* don't pull the RemoteFX context from under an encoder thread */
+	pthread_mutex_lock(&encoder->mutex);
+	while (encoder->rfx_busy)
+		pthread_cond_wait(&encoder->cond, &encoder->mutex);
 	rfx_context_reset(context->rfx_context);
+	pthread_mutex_unlock(&encoder->mutex);
 	return TRUE;
 }
 
@@ -764,10 +1489,10 @@ xf_mouseEvent(rdpInput *input, UINT16 flags, UINT16 x, UINT16 y) {
 	uint32_t button = 0;
 
 	if (flags & PTR_FLAGS_MOVE) {
-		output = peerContext->rdpCompositor->output;
-		if(x < output->base.width && y < output->base.height) {
-			wl_x = wl_fixed_from_int((int)x);
-			wl_y = wl_fixed_from_int((int)y);
+		output = peerContext->output;
+		if(output && x < output->base.width && y < output->base.height) {
+			wl_x = wl_fixed_from_int((int)x + output->base.x);
+			wl_y = wl_fixed_from_int((int)y + output->base.y);
 			notify_motion_absolute(&peerContext->item.seat, weston_compositor_get_time(),
 					wl_x, wl_y);
 		}
@@ -793,10 +1518,10 @@ xf_extendedMouseEvent(rdpInput *input, UINT16 flags, UINT16 x, UINT16 y) {
 	RdpPeerContext *peerContext = (RdpPeerContext *)input->context;
 	struct rdp_output *output;
 
-	output = peerContext->rdpCompositor->output;
-	if(x < output->base.width && y < output->base.height) {
-		wl_x = wl_fixed_from_int((int)x);
-		wl_y = wl_fixed_from_int((int)y);
+	output = peerContext->output;
+	if(output && x < output->base.width && y < output->base.height) {
+		wl_x = wl_fixed_from_int((int)x + output->base.x);
+		wl_y = wl_fixed_from_int((int)y + output->base.y);
 		notify_motion_absolute(&peerContext->item.seat, weston_compositor_get_time(),
 				wl_x, wl_y);
 	}
@@ -807,21 +1532,9 @@ static void
 xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 {
 	freerdp_peer *client = input->context->peer;
-	RdpPeerContext *peerCtx = (RdpPeerContext *)input->context;
-	struct rdp_output *output = peerCtx->rdpCompositor->output;
-	pixman_box32_t box;
-	pixman_region32_t damage;
 
 	/* sends a full refresh */
-	box.x1 = 0;
-	box.y1 = 0;
-	box.x2 = output->base.width;
-	box.y2 = output->base.height;
-	pixman_region32_init_with_extents(&damage, &box);
-
-	rdp_peer_refresh_region(&damage, client);
-
-	pixman_region32_fini(&damage);
+	rdp_peer_refresh_full(client);
 }
 
 extern DWORD KEYCODE_TO_VKCODE_EVDEV[];
@@ -882,10 +1595,16 @@ xf_input_unicode_keyboard_event(rdpInput *input, UINT16 flags, UINT16 code)
 static void
 xf_suppress_output(rdpContext *context, BYTE allow, RECTANGLE_16 *area) {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	int wasEnabled = peerContext->item.flags & RDP_PEER_OUTPUT_ENABLED;
+
 	if(allow)
 		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
 	else
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
+
+	/* damage isn't tracked while the output is suppressed */
+	if(allow && !wasEnabled && (peerContext->item.flags & RDP_PEER_ACTIVATED))
+		rdp_peer_refresh_full(context->peer);
 }
 
 static int
@@ -906,6 +1625,8 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 
 	peerCtx = (RdpPeerContext *) client->context;
 	peerCtx->rdpCompositor = c;
+	rdp_encoder_init(&peerCtx->encoder, peerCtx);
+	rdp_peer_pacing_init(peerCtx);
 
 	settings = client->settings;
 	settings->RdpKeyFile = c->rdp_key;
@@ -949,7 +1670,6 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 	for ( ; i < MAX_FREERDP_FDS; i++)
 		peerCtx->events[i] = 0;
 
-	wl_list_insert(&c->output->peers, &peerCtx->item.link);
 	return 0;
 }
 
@@ -997,7 +1717,9 @@ rdp_compositor_create(struct wl_display *display,
 	if (pixman_renderer_init(&c->base) < 0)
 		goto err_compositor;
 
-	if (rdp_compositor_create_output(c, config->width, config->height, config->extra_modes) < 0)
+	c->output = rdp_compositor_create_output(c, 0, config->width, config->height,
+			config->extra_modes);
+	if (!c->output)
 		goto err_compositor;
 
 	if(!config->env_socket) {
@@ -1029,7 +1751,7 @@ rdp_compositor_create(struct wl_display *display,
 err_listener:
 	freerdp_listener_free(c->listener);
 err_output:
-	weston_output_destroy(&c->output->base);
+	c->output->base.destroy(&c->output->base);
 err_compositor:
 	weston_compositor_shutdown(&c->base);
 err_free_strings:
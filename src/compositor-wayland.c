@@ -38,6 +38,7 @@
 
 #include "compositor.h"
 #include "gl-renderer.h"
+#include "pixman-renderer.h"
 #include "../shared/image-loader.h"
 #include "../shared/os-compatibility.h"
 
@@ -60,6 +61,8 @@ struct wayland_compositor {
 		uint32_t event_mask;
 	} parent;
 
+	int use_pixman;
+
 	struct {
 		int32_t top, bottom, left, right;
 	} border;
@@ -76,6 +79,27 @@ struct wayland_output {
 		struct wl_egl_window	*egl_window;
 	} parent;
 	struct weston_mode	mode;
+
+	/* pixman renderer only: every buffer handed to the parent, and
+	 * those it has released */
+	struct {
+		struct wl_list buffers;
+		struct wl_list free_buffers;
+	} shm;
+};
+
+struct wayland_shm_buffer {
+	struct wayland_output *output;
+	struct wl_list link;
+	struct wl_list free_link;
+
+	struct wl_buffer *buffer;
+	void *data;
+	size_t size;
+	pixman_image_t *pm_image;
+
+	/* what changed on the output since this buffer was drawn */
+	pixman_region32_t damage;
 };
 
 struct wayland_input {
@@ -214,8 +238,8 @@ wayland_output_start_repaint_loop(struct weston_output *output_base)
 }
 
 static void
-wayland_output_repaint(struct weston_output *output_base,
-		       pixman_region32_t *damage)
+wayland_output_repaint_gl(struct weston_output *output_base,
+			  pixman_region32_t *damage)
 {
 	struct wayland_output *output = (struct wayland_output *) output_base;
 	struct weston_compositor *ec = output->base.compositor;
@@ -231,14 +255,166 @@ wayland_output_repaint(struct weston_output *output_base,
 
 }
 
+static void
+wayland_shm_buffer_destroy(struct wayland_shm_buffer *sb)
+{
+	pixman_image_unref(sb->pm_image);
+	wl_buffer_destroy(sb->buffer);
+	munmap(sb->data, sb->size);
+	pixman_region32_fini(&sb->damage);
+
+	wl_list_remove(&sb->link);
+	wl_list_remove(&sb->free_link);
+	free(sb);
+}
+
+static void
+shm_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_shm_buffer *sb = data;
+
+	wl_list_insert(&sb->output->shm.free_buffers, &sb->free_link);
+}
+
+static const struct wl_buffer_listener shm_buffer_listener = {
+	shm_buffer_release
+};
+
+static struct wayland_shm_buffer *
+wayland_output_get_shm_buffer(struct wayland_output *output)
+{
+	struct wayland_compositor *c =
+		(struct wayland_compositor *) output->base.compositor;
+	struct wayland_shm_buffer *sb;
+	struct wl_shm_pool *pool;
+	int width, height, stride;
+	size_t size;
+	int fd;
+	void *data;
+
+	/* reuse a buffer the parent is done with */
+	if (!wl_list_empty(&output->shm.free_buffers)) {
+		sb = container_of(output->shm.free_buffers.next,
+				  struct wayland_shm_buffer, free_link);
+		wl_list_remove(&sb->free_link);
+		wl_list_init(&sb->free_link);
+
+		return sb;
+	}
+
+	width = output->mode.width;
+	height = output->mode.height;
+	stride = width * 4;
+	size = height * stride;
+
+	fd = os_create_anonymous_file(size);
+	if (fd < 0) {
+		weston_log("could not create an anonymous file buffer: %m\n");
+		return NULL;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		weston_log("could not mmap %zu memory for data: %m\n", size);
+		close(fd);
+		return NULL;
+	}
+
+	sb = malloc(sizeof *sb);
+	if (sb == NULL) {
+		munmap(data, size);
+		close(fd);
+		return NULL;
+	}
+	memset(sb, 0, sizeof *sb);
+
+	sb->output = output;
+	wl_list_init(&sb->free_link);
+	wl_list_insert(&output->shm.buffers, &sb->link);
+
+	/* a new buffer has no valid contents yet */
+	pixman_region32_init(&sb->damage);
+	pixman_region32_copy(&sb->damage, &output->base.region);
+
+	sb->data = data;
+	sb->size = size;
+
+	pool = wl_shm_create_pool(c->parent.shm, fd, size);
+	sb->buffer = wl_shm_pool_create_buffer(pool, 0,
+					       width, height,
+					       stride,
+					       WL_SHM_FORMAT_XRGB8888);
+	wl_buffer_add_listener(sb->buffer, &shm_buffer_listener, sb);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	sb->pm_image =
+		pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+					 (uint32_t *) data, stride);
+
+	return sb;
+}
+
+static void
+wayland_output_repaint_pixman(struct weston_output *output_base,
+			      pixman_region32_t *damage)
+{
+	struct wayland_output *output = (struct wayland_output *) output_base;
+	struct weston_compositor *ec = output->base.compositor;
+	struct wayland_shm_buffer *sb;
+	struct wl_callback *callback;
+	pixman_box32_t *rects;
+	int nrects, i;
+
+	wl_list_for_each(sb, &output->shm.buffers, link)
+		pixman_region32_union(&sb->damage, &sb->damage, damage);
+
+	sb = wayland_output_get_shm_buffer(output);
+	if (sb) {
+		/* bring the buffer up to date, not only this frame */
+		pixman_renderer_output_set_buffer(output_base, sb->pm_image);
+		ec->renderer->repaint_output(output_base, &sb->damage);
+		pixman_region32_clear(&sb->damage);
+
+		wl_surface_attach(output->parent.surface, sb->buffer, 0, 0);
+
+		/* the parent only needs what changed since the last commit */
+		rects = pixman_region32_rectangles(damage, &nrects);
+		for (i = 0; i < nrects; i++)
+			wl_surface_damage(output->parent.surface,
+					  rects[i].x1 - output->base.x,
+					  rects[i].y1 - output->base.y,
+					  rects[i].x2 - rects[i].x1,
+					  rects[i].y2 - rects[i].y1);
+	}
+
+	pixman_region32_subtract(&ec->primary_plane.damage,
+				 &ec->primary_plane.damage, damage);
+
+	callback = wl_surface_frame(output->parent.surface);
+	wl_callback_add_listener(callback, &frame_listener, output);
+	wl_surface_commit(output->parent.surface);
+}
+
 static void
 wayland_output_destroy(struct weston_output *output_base)
 {
 	struct wayland_output *output = (struct wayland_output *) output_base;
+	struct wayland_compositor *c =
+		(struct wayland_compositor *) output->base.compositor;
+	struct wayland_shm_buffer *sb, *next;
 
-	gl_renderer_output_destroy(output_base);
+	if (c->use_pixman) {
+		pixman_renderer_output_destroy(output_base);
+
+		wl_list_for_each_safe(sb, next, &output->shm.buffers, link)
+			wayland_shm_buffer_destroy(sb);
+	} else {
+		gl_renderer_output_destroy(output_base);
+
+		wl_egl_window_destroy(output->parent.egl_window);
+	}
 
-	wl_egl_window_destroy(output->parent.egl_window);
 	free(output);
 
 	return;
@@ -278,19 +454,27 @@ wayland_compositor_create_output(struct wayland_compositor *c,
 		wl_compositor_create_surface(c->parent.compositor);
 	wl_surface_set_user_data(output->parent.surface, output);
 
-	output->parent.egl_window =
-		wl_egl_window_create(output->parent.surface,
-				     width + c->border.left + c->border.right,
-				     height + c->border.top + c->border.bottom);
-	if (!output->parent.egl_window) {
-		weston_log("failure to create wl_egl_window\n");
-		goto cleanup_output;
+	wl_list_init(&output->shm.buffers);
+	wl_list_init(&output->shm.free_buffers);
+
+	if (c->use_pixman) {
+		if (pixman_renderer_output_create(&output->base) < 0)
+			goto cleanup_output;
+	} else {
+		output->parent.egl_window =
+			wl_egl_window_create(output->parent.surface,
+					     width + c->border.left + c->border.right,
+					     height + c->border.top + c->border.bottom);
+		if (!output->parent.egl_window) {
+			weston_log("failure to create wl_egl_window\n");
+			goto cleanup_output;
+		}
+
+		if (gl_renderer_output_create(&output->base,
+				output->parent.egl_window) < 0)
+			goto cleanup_window;
 	}
 
-	if (gl_renderer_output_create(&output->base,
-			output->parent.egl_window) < 0)
-		goto cleanup_window;
-
 	output->parent.draw_initial_frame = 1;
 	output->parent.shell_surface =
 		wl_shell_get_shell_surface(c->parent.shell,
@@ -301,7 +485,10 @@ wayland_compositor_create_output(struct wayland_compositor *c,
 
 	output->base.origin = output->base.current;
 	output->base.start_repaint_loop = wayland_output_start_repaint_loop;
-	output->base.repaint = wayland_output_repaint;
+	if (c->use_pixman)
+		output->base.repaint = wayland_output_repaint_pixman;
+	else
+		output->base.repaint = wayland_output_repaint_gl;
 	output->base.destroy = wayland_output_destroy;
 	output->base.assign_planes = NULL;
 	output->base.set_backlight = NULL;
@@ -721,7 +908,7 @@ wayland_destroy(struct weston_compositor *ec)
 static struct weston_compositor *
 wayland_compositor_create(struct wl_display *display,
 			  int width, int height, const char *display_name,
-			  int *argc, char *argv[],
+			  int use_pixman, int *argc, char *argv[],
 			  struct weston_config *config)
 {
 	struct wayland_compositor *c;
@@ -751,18 +938,31 @@ wayland_compositor_create(struct wl_display *display,
 	wl_display_dispatch(c->parent.wl_display);
 
 	c->base.wl_display = display;
-	if (gl_renderer_create(&c->base, c->parent.wl_display,
-			gl_renderer_alpha_attribs,
-			NULL) < 0)
-		goto err_display;
+	c->use_pixman = use_pixman;
+	if (c->use_pixman) {
+		if (!c->parent.shm) {
+			weston_log("parent compositor has no wl_shm\n");
+			goto err_display;
+		}
+		if (pixman_renderer_init(&c->base) < 0)
+			goto err_display;
+	} else {
+		if (gl_renderer_create(&c->base, c->parent.wl_display,
+				gl_renderer_alpha_attribs,
+				NULL) < 0)
+			goto err_display;
+	}
 
 	c->base.destroy = wayland_destroy;
 	c->base.restore = wayland_restore;
 
-	c->border.top = 30;
-	c->border.bottom = 24;
-	c->border.left = 25;
-	c->border.right = 26;
+	/* the pixman renderer doesn't draw a border */
+	if (!c->use_pixman) {
+		c->border.top = 30;
+		c->border.bottom = 24;
+		c->border.left = 25;
+		c->border.right = 26;
+	}
 
 	/* requires border fields */
 	if (wayland_compositor_create_output(c, width, height) < 0)
@@ -770,7 +970,8 @@ wayland_compositor_create(struct wl_display *display,
 
 	/* requires gl_renderer_output_state_create called
 	 * by wayland_compositor_create_output */
-	create_border(c);
+	if (!c->use_pixman)
+		create_border(c);
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
 
@@ -802,16 +1003,18 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 {
 	int width = 1024, height = 640;
 	char *display_name = NULL;
+	int use_pixman = 0;
 
 	const struct weston_option wayland_options[] = {
 		{ WESTON_OPTION_INTEGER, "width", 0, &width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &height },
 		{ WESTON_OPTION_STRING, "display", 0, &display_name },
+		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &use_pixman },
 	};
 
 	parse_options(wayland_options,
 		      ARRAY_LENGTH(wayland_options), argc, argv);
 
 	return wayland_compositor_create(display, width, height, display_name,
-					 argc, argv, config);
+					 use_pixman, argc, argv, config);
 }
@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/shm.h>
 #include <linux/input.h>
@@ -42,6 +43,9 @@
 #ifdef HAVE_XCB_XKB
 #include <xcb/xkb.h>
 #endif
+#ifdef HAVE_XCB_PRESENT
+#include <xcb/present.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Xlib-xcb.h>
@@ -72,6 +76,9 @@ struct x11_compositor {
 	struct xkb_keymap	*xkb_keymap;
 	unsigned int		 has_xkb;
 	uint8_t			 xkb_event_base;
+	uint8_t			 shm_event_base;
+	unsigned int		 has_present;
+	uint8_t			 present_opcode;
 	int			 use_pixman;
 
 	int			 has_net_wm_state_fullscreen;
@@ -115,6 +122,13 @@ struct x11_output {
 	void		       *buf;
 	uint8_t			depth;
 	int32_t                 scale;
+
+	/* The put_image whose completion finishes the frame, if any. */
+	int			shm_pending;
+	uint16_t		shm_sequence;
+
+	uint32_t		present_serial;
+	uint32_t		present_event_id;
 };
 
 static struct xkb_keymap *
@@ -286,6 +300,41 @@ x11_compositor_setup_xkb(struct x11_compositor *c)
 #endif
 }
 
+static void
+x11_compositor_setup_present(struct x11_compositor *c)
+{
+#ifndef HAVE_XCB_PRESENT
+	weston_log("XCB-Present not available during build\n");
+	c->has_present = 0;
+	c->present_opcode = 0;
+#else
+	const xcb_query_extension_reply_t *ext;
+	xcb_present_query_version_cookie_t cookie;
+	xcb_present_query_version_reply_t *reply;
+
+	c->has_present = 0;
+	c->present_opcode = 0;
+
+	ext = xcb_get_extension_data(c->conn, &xcb_present_id);
+	if (!ext || !ext->present) {
+		weston_log("Present extension not available on host X11 server\n");
+		return;
+	}
+	c->present_opcode = ext->major_opcode;
+
+	cookie = xcb_present_query_version(c->conn, XCB_PRESENT_MAJOR_VERSION,
+					   XCB_PRESENT_MINOR_VERSION);
+	reply = xcb_present_query_version_reply(c->conn, cookie, NULL);
+	if (!reply) {
+		weston_log("failed to query Present version\n");
+		return;
+	}
+	free(reply);
+
+	c->has_present = 1;
+#endif
+}
+
 static int
 x11_input_create(struct x11_compositor *c, int no_input)
 {
@@ -332,33 +381,51 @@ x11_output_repaint_gl(struct weston_output *output_base,
 {
 	struct x11_output *output = (struct x11_output *)output_base;
 	struct weston_compositor *ec = output->base.compositor;
+#ifdef HAVE_XCB_PRESENT
+	struct x11_compositor *c = (struct x11_compositor *)ec;
+#endif
 
 	ec->renderer->repaint_output(output_base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
+#ifdef HAVE_XCB_PRESENT
+	if (c->has_present) {
+		/* The swap lands on the next vblank, have the server tell
+		 * us when that happens.  The timer only covers a lost
+		 * notification. */
+		output->present_serial++;
+		xcb_present_notify_msc(c->conn, output->window,
+				       output->present_serial, 0, 1, 0);
+		xcb_flush(c->conn);
+		wl_event_source_timer_update(output->finish_frame_timer, 100);
+		return;
+	}
+#endif
+
 	wl_event_source_timer_update(output->finish_frame_timer, 10);
 }
 
-static void
-set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region)
+/* Returns the rectangles of region in window coordinates, or NULL. */
+static xcb_rectangle_t *
+transform_region_for_output(struct weston_output *output_base,
+			    pixman_region32_t *region, int *nrects_out)
 {
-	struct x11_output *output = (struct x11_output *)output_base;
-	struct weston_compositor *ec = output->base.compositor;
-	struct x11_compositor *c = (struct x11_compositor *)ec;
 	pixman_box32_t *rects;
 	xcb_rectangle_t *output_rects;
 	pixman_box32_t rect, transformed_rect;
-	xcb_void_cookie_t cookie;
 	int width, height, nrects, i;
-	xcb_generic_error_t *err;
 
 	rects = pixman_region32_rectangles(region, &nrects);
+	*nrects_out = 0;
+	if (nrects == 0)
+		return NULL;
+
 	output_rects = calloc(nrects, sizeof(xcb_rectangle_t));
 
 	if (output_rects == NULL)
-		return;
+		return NULL;
 
 	width = output_base->width;
 	height = output_base->height;
@@ -433,19 +500,27 @@ set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region
 		output_rects[i].height = transformed_rect.y2 - transformed_rect.y1;
 	}
 
-	cookie = xcb_set_clip_rectangles_checked(c->conn, XCB_CLIP_ORDERING_UNSORTED,
-					output->gc,
-					0, 0, nrects,
-					output_rects);
-	err = xcb_request_check(c->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to set clip rects, err: %d\n", err->error_code);
-		free(err);
-	}
-	free(output_rects);
+	*nrects_out = nrects;
+	return output_rects;
 }
 
 
+static unsigned int
+x11_output_put_shm(struct x11_compositor *c, struct x11_output *output,
+		   int x, int y, int width, int height, int send_event)
+{
+	xcb_void_cookie_t cookie;
+
+	cookie = xcb_shm_put_image(c->conn, output->window, output->gc,
+				   pixman_image_get_width(output->hw_surface),
+				   pixman_image_get_height(output->hw_surface),
+				   x, y, width, height, x, y,
+				   output->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
+				   send_event, output->segment, 0);
+
+	return cookie.sequence;
+}
+
 static void
 x11_output_repaint_shm(struct weston_output *output_base,
 		       pixman_region32_t *damage)
@@ -453,30 +528,36 @@ x11_output_repaint_shm(struct weston_output *output_base,
 	struct x11_output *output = (struct x11_output *)output_base;
 	struct weston_compositor *ec = output->base.compositor;
 	struct x11_compositor *c = (struct x11_compositor *)ec;
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
+	xcb_rectangle_t *rects;
+	int nrects, i;
 
 	pixman_renderer_output_set_buffer(output_base, output->hw_surface);
 	ec->renderer->repaint_output(output_base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
-	set_clip_for_output(output_base, damage);
-	cookie = xcb_shm_put_image_checked(c->conn, output->window, output->gc,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0, output->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
-					0, output->segment, 0);
-	err = xcb_request_check(c->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to put shm image, err: %d\n", err->error_code);
-		free(err);
+
+	rects = transform_region_for_output(output_base, damage, &nrects);
+	if (rects == NULL) {
+		wl_event_source_timer_update(output->finish_frame_timer, 10);
+		return;
 	}
 
-	wl_event_source_timer_update(output->finish_frame_timer, 10);
+	/* Only put the damaged rectangles, and ask for a completion event
+	 * on the last one: the frame is done once the server has read the
+	 * segment, which also makes it safe to render into again.  Errors
+	 * come back as events, so there is no round trip here. */
+	for (i = 0; i < nrects; i++)
+		output->shm_sequence =
+			x11_output_put_shm(c, output, rects[i].x, rects[i].y,
+					   rects[i].width, rects[i].height,
+					   i == nrects - 1);
+	free(rects);
+	xcb_flush(c->conn);
+	output->shm_pending = 1;
+
+	/* In case the completion event never shows up. */
+	wl_event_source_timer_update(output->finish_frame_timer, 100);
 }
 
 static int
@@ -484,6 +565,10 @@ finish_frame_handler(void *data)
 {
 	struct x11_output *output = data;
 
+	/* Whatever the server sends for this frame now comes too late. */
+	output->shm_pending = 0;
+	output->present_serial++;
+
 	x11_output_start_repaint_loop(&output->base);
 
 	return 1;
@@ -523,6 +608,15 @@ x11_output_destroy(struct weston_output *output_base)
 	} else
 		gl_renderer_output_destroy(output_base);
 
+#ifdef HAVE_XCB_PRESENT
+	/* An empty mask frees the event selection on the server */
+	if (output->present_event_id)
+		xcb_present_select_input(compositor->conn,
+					 output->present_event_id,
+					 output->window,
+					 XCB_PRESENT_EVENT_MASK_NO_EVENT);
+#endif
+
 	xcb_destroy_window(compositor->conn, output->window);
 
 	weston_output_destroy(&output->base);
@@ -701,6 +795,7 @@ x11_output_init_shm(struct x11_compositor *c, struct x11_output *output,
 		errno = ENOENT;
 		return -1;
 	}
+	c->shm_event_base = ext->first_event;
 
 	iter = xcb_setup_roots_iterator(xcb_get_setup(c->conn));
 	visual_type = find_visual_by_id(iter.data, iter.data->root_visual);
@@ -912,6 +1007,15 @@ x11_compositor_create_output(struct x11_compositor *c, int x, int y,
 	} else {
 		if (gl_renderer_output_create(&output->base, (EGLNativeWindowType)output->window) < 0)
 			return NULL;
+#ifdef HAVE_XCB_PRESENT
+		if (c->has_present) {
+			output->present_event_id = xcb_generate_id(c->conn);
+			xcb_present_select_input(c->conn,
+						 output->present_event_id,
+						 output->window,
+						 XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+		}
+#endif
 	}
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
@@ -939,6 +1043,39 @@ x11_compositor_find_output(struct x11_compositor *c, xcb_window_t window)
 	return NULL;
 }
 
+#ifdef HAVE_XCB_PRESENT
+static void
+x11_compositor_deliver_present_event(struct x11_compositor *c,
+				     xcb_generic_event_t *event)
+{
+	xcb_present_complete_notify_event_t *complete =
+		(xcb_present_complete_notify_event_t *) event;
+	struct x11_output *output;
+	struct timespec ts;
+	struct timeval tv;
+	int64_t offset;
+
+	if (complete->extension != c->present_opcode ||
+	    complete->event_type != XCB_PRESENT_COMPLETE_NOTIFY)
+		return;
+
+	output = x11_compositor_find_output(c, complete->window);
+	if (!output || complete->serial != output->present_serial)
+		return;
+
+	/* ust is CLOCK_MONOTONIC microseconds, while frame times are on
+	 * the same clock as weston_compositor_get_time(). */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	gettimeofday(&tv, NULL);
+	offset = ((int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000) -
+		 ((int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+
+	wl_event_source_timer_update(output->finish_frame_timer, 0);
+	weston_output_finish_frame(&output->base,
+				   (int64_t) (complete->ust / 1000) + offset);
+}
+#endif
+
 #ifdef HAVE_XCB_XKB
 static void
 update_xkb_state(struct x11_compositor *c, xcb_xkb_state_notify_event_t *state)
@@ -1191,6 +1328,7 @@ x11_compositor_handle_event(int fd, uint32_t mask, void *data)
 	xcb_keymap_notify_event_t *keymap_notify;
 	xcb_focus_in_event_t *focus_in;
 	xcb_expose_event_t *expose;
+	xcb_shm_completion_event_t *shm_completion;
 	xcb_atom_t atom;
 	uint32_t *k;
 	uint32_t i, set;
@@ -1300,6 +1438,13 @@ x11_compositor_handle_event(int fd, uint32_t mask, void *data)
 		case XCB_EXPOSE:
 			expose = (xcb_expose_event_t *) event;
 			output = x11_compositor_find_output(c, expose->window);
+			if (c->use_pixman) {
+				/* frames only put their damage, restore the
+				 * exposed area from the last one */
+				x11_output_put_shm(c, output, expose->x, expose->y,
+						   expose->width, expose->height, 0);
+				xcb_flush(c->conn);
+			}
 			weston_output_schedule_repaint(&output->base);
 			break;
 
@@ -1343,6 +1488,24 @@ x11_compositor_handle_event(int fd, uint32_t mask, void *data)
 			break;
 		}
 
+		if (c->use_pixman &&
+		    response_type == c->shm_event_base + XCB_SHM_COMPLETION) {
+			shm_completion = (xcb_shm_completion_event_t *) event;
+			output = x11_compositor_find_output(c,
+						shm_completion->drawable);
+			if (output && output->shm_pending &&
+			    shm_completion->sequence == output->shm_sequence) {
+				output->shm_pending = 0;
+				wl_event_source_timer_update(output->finish_frame_timer, 0);
+				x11_output_start_repaint_loop(&output->base);
+			}
+		}
+
+#ifdef HAVE_XCB_PRESENT
+		if (c->has_present && response_type == XCB_GE_GENERIC)
+			x11_compositor_deliver_present_event(c, event);
+#endif
+
 #ifdef HAVE_XCB_XKB
 		if (c->has_xkb &&
 		    response_type == c->xkb_event_base) {
@@ -1563,6 +1726,7 @@ x11_compositor_create(struct wl_display *display,
 		if (gl_renderer_create(&c->base, (EGLNativeDisplayType)c->dpy, gl_renderer_opaque_attribs,
 				NULL) < 0)
 			goto err_xdisplay;
+		x11_compositor_setup_present(c);
 	}
 	weston_log("Using %s renderer\n", use_pixman ? "pixman" : "gl");
 
@@ -3168,7 +3168,8 @@ usage(int error_code)
 		"Options for wayland-backend.so:\n\n"
 		"  --width=WIDTH\t\tWidth of Wayland surface\n"
 		"  --height=HEIGHT\tHeight of Wayland surface\n"
-		"  --display=DISPLAY\tWayland display to connect to\n\n");
+		"  --display=DISPLAY\tWayland display to connect to\n"
+		"  --use-pixman\t\tUse the pixman (CPU) renderer\n\n");
 
 #if defined(BUILD_RPI_COMPOSITOR) && defined(HAVE_BCM_HOST)
 	fprintf(stderr,
@@ -300,6 +300,10 @@ struct weston_pointer {
 
 	wl_fixed_t x, y;
 	uint32_t button_count;
+
+	/* set while a coalesced motion waits to be delivered */
+	struct wl_event_source *motion_source;
+	uint32_t motion_time;
 };
 
 
@@ -333,6 +337,8 @@ weston_pointer_start_grab(struct weston_pointer *pointer,
 			  struct weston_pointer_grab *grab);
 void
 weston_pointer_end_grab(struct weston_pointer *pointer);
+void
+weston_pointer_flush_motion(struct weston_pointer *pointer);
 
 struct weston_keyboard *
 weston_keyboard_create(void);
@@ -37,6 +37,22 @@
 
 #define DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON BTN_LEFT
 #define DEFAULT_TOUCHPAD_SINGLE_TAP_TIMEOUT 100
+#define DEFAULT_TOUCHPAD_TAP_MAX_DURATION 180
+
+/* A touch starting within this fraction of the width from the left or
+ * right edge is a palm, unless it leaves the edge within the timeout. */
+#define DEFAULT_PALM_EDGE_FRACTION 0.05
+#define DEFAULT_PALM_EDGE_TIMEOUT 200
+/* A touch wider than this fraction of the touch major range is a palm. */
+#define DEFAULT_PALM_MAJOR_FRACTION 0.5
+
+/* Two finger scrolling continues after the fingers leave the pad when
+ * they were moving faster than the minimum velocity, in axis units per
+ * ms, and slows down exponentially with the given time constant. */
+#define DEFAULT_KINETIC_MIN_VELOCITY 0.1
+#define DEFAULT_KINETIC_TIME_CONSTANT 325.0
+#define DEFAULT_KINETIC_INTERVAL 16
+#define DEFAULT_KINETIC_MAX_IDLE 100
 
 enum touchpad_model {
 	TOUCHPAD_MODEL_UNKNOWN = 0,
@@ -111,10 +127,6 @@ struct touchpad_dispatch {
 	int finger_state;
 	int last_finger_state;
 
-	double constant_accel_factor;
-	double min_accel_factor;
-	double max_accel_factor;
-
 	unsigned int event_mask;
 	unsigned int event_mask_filter;
 
@@ -126,8 +138,38 @@ struct touchpad_dispatch {
 		struct wl_array events;
 		enum fsm_state state;
 		struct wl_event_source *timer_source;
+
+		uint32_t touch_time;
+		int fingers;
+		uint32_t button;
 	} fsm;
 
+	/* Slot state of multitouch pads, kept as one array per field and
+	 * bit masks of slots so that a report only walks what is down. */
+	struct {
+		int slot;
+		uint32_t active;
+		uint32_t fresh;
+		uint32_t palm;
+		uint32_t edge;
+		int32_t x[MAX_SLOTS];
+		int32_t y[MAX_SLOTS];
+		int32_t major[MAX_SLOTS];
+		uint32_t begin[MAX_SLOTS];
+	} mt;
+
+	struct {
+		int32_t left;
+		int32_t right;
+		int32_t major;
+	} palm;
+
+	struct {
+		double vx, vy;
+		uint32_t time;
+		struct wl_event_source *timer_source;
+	} kinetic;
+
 	struct {
 		int32_t x;
 		int32_t y;
@@ -193,27 +235,6 @@ configure_touchpad_pressure(struct touchpad_dispatch *touchpad,
 	}
 }
 
-static double
-touchpad_profile(struct weston_motion_filter *filter,
-		 void *data,
-		 double velocity,
-		 uint32_t time)
-{
-	struct touchpad_dispatch *touchpad =
-		(struct touchpad_dispatch *) data;
-
-	double accel_factor;
-
-	accel_factor = velocity * touchpad->constant_accel_factor;
-
-	if (accel_factor > touchpad->max_accel_factor)
-		accel_factor = touchpad->max_accel_factor;
-	else if (accel_factor < touchpad->min_accel_factor)
-		accel_factor = touchpad->min_accel_factor;
-
-	return accel_factor;
-}
-
 static inline struct touchpad_motion *
 motion_history_offset(struct touchpad_dispatch *touchpad, int offset)
 {
@@ -276,7 +297,7 @@ static void
 notify_button_pressed(struct touchpad_dispatch *touchpad, uint32_t time)
 {
 	notify_button(touchpad->device->seat, time,
-		      DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
+		      touchpad->fsm.button,
 		      WL_POINTER_BUTTON_STATE_PRESSED);
 }
 
@@ -284,10 +305,25 @@ static void
 notify_button_released(struct touchpad_dispatch *touchpad, uint32_t time)
 {
 	notify_button(touchpad->device->seat, time,
-		      DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
+		      touchpad->fsm.button,
 		      WL_POINTER_BUTTON_STATE_RELEASED);
 }
 
+/* One, two and three finger taps click the left, right and middle
+ * buttons. */
+static uint32_t
+tap_button(int fingers)
+{
+	switch (fingers) {
+	case 2:
+		return BTN_RIGHT;
+	case 3:
+		return BTN_MIDDLE;
+	default:
+		return DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON;
+	}
+}
+
 static void
 notify_tap(struct touchpad_dispatch *touchpad, uint32_t time)
 {
@@ -316,6 +352,7 @@ process_fsm_events(struct touchpad_dispatch *touchpad, uint32_t time)
 		case FSM_IDLE:
 			switch (event) {
 			case FSM_EVENT_TOUCH:
+				touchpad->fsm.touch_time = time;
 				touchpad->fsm.state = FSM_TOUCH;
 				break;
 			default:
@@ -325,6 +362,14 @@ process_fsm_events(struct touchpad_dispatch *touchpad, uint32_t time)
 		case FSM_TOUCH:
 			switch (event) {
 			case FSM_EVENT_RELEASE:
+				/* held too long to be a tap */
+				if (time - touchpad->fsm.touch_time >
+				    DEFAULT_TOUCHPAD_TAP_MAX_DURATION) {
+					touchpad->fsm.state = FSM_IDLE;
+					break;
+				}
+				touchpad->fsm.button =
+					tap_button(touchpad->fsm.fingers);
 				timeout = DEFAULT_TOUCHPAD_SINGLE_TAP_TIMEOUT;
 				touchpad->fsm.state = FSM_TAP;
 				break;
@@ -419,15 +464,123 @@ fsm_timout_handler(void *data)
 	return 1;
 }
 
+static void
+kinetic_stop(struct touchpad_dispatch *touchpad)
+{
+	touchpad->kinetic.vx = 0.0;
+	touchpad->kinetic.vy = 0.0;
+	wl_event_source_timer_update(touchpad->kinetic.timer_source, 0);
+}
+
+/* Keeps a smoothed estimate of the two finger scroll velocity. */
+static void
+kinetic_track(struct touchpad_dispatch *touchpad,
+	      double dx, double dy, uint32_t time)
+{
+	uint32_t dt = time - touchpad->kinetic.time;
+
+	if (dt == 0)
+		return;
+
+	if (dt < DEFAULT_KINETIC_MAX_IDLE) {
+		touchpad->kinetic.vx = 0.5 * touchpad->kinetic.vx +
+			0.5 * dx / dt;
+		touchpad->kinetic.vy = 0.5 * touchpad->kinetic.vy +
+			0.5 * dy / dt;
+	} else {
+		/* the fingers paused, start over */
+		touchpad->kinetic.vx = dx / dt;
+		touchpad->kinetic.vy = dy / dt;
+	}
+	touchpad->kinetic.time = time;
+}
+
+static void
+kinetic_start(struct touchpad_dispatch *touchpad, uint32_t time)
+{
+	/* The velocity is only updated while the fingers move, so one that
+	 * was last tracked before the fingers rested is stale. */
+	if (time - touchpad->kinetic.time > DEFAULT_KINETIC_MAX_IDLE ||
+	    hypot(touchpad->kinetic.vx, touchpad->kinetic.vy) <
+	    DEFAULT_KINETIC_MIN_VELOCITY) {
+		kinetic_stop(touchpad);
+		return;
+	}
+
+	touchpad->kinetic.time = time;
+	wl_event_source_timer_update(touchpad->kinetic.timer_source,
+				     DEFAULT_KINETIC_INTERVAL);
+}
+
+static int
+kinetic_timeout_handler(void *data)
+{
+	struct touchpad_dispatch *touchpad = data;
+	uint32_t time = weston_compositor_get_time();
+	double dt, decay, dx, dy;
+
+	dt = time - touchpad->kinetic.time;
+	if (dt <= 0.0)
+		dt = DEFAULT_KINETIC_INTERVAL;
+	touchpad->kinetic.time = time;
+
+	decay = exp(-dt / DEFAULT_KINETIC_TIME_CONSTANT);
+	touchpad->kinetic.vx *= decay;
+	touchpad->kinetic.vy *= decay;
+	if (hypot(touchpad->kinetic.vx, touchpad->kinetic.vy) <
+	    DEFAULT_KINETIC_MIN_VELOCITY) {
+		kinetic_stop(touchpad);
+		return 1;
+	}
+
+	dx = touchpad->kinetic.vx * dt;
+	dy = touchpad->kinetic.vy * dt;
+	if (dx != 0.0)
+		notify_axis(touchpad->device->seat, time,
+			    WL_POINTER_AXIS_HORIZONTAL_SCROLL,
+			    wl_fixed_from_double(dx));
+	if (dy != 0.0)
+		notify_axis(touchpad->device->seat, time,
+			    WL_POINTER_AXIS_VERTICAL_SCROLL,
+			    wl_fixed_from_double(dy));
+
+	wl_event_source_timer_update(touchpad->kinetic.timer_source,
+				     DEFAULT_KINETIC_INTERVAL);
+
+	return 1;
+}
+
+static int
+finger_count(int finger_state)
+{
+	if (finger_state & TOUCHPAD_FINGERS_THREE)
+		return 3;
+	if (finger_state & TOUCHPAD_FINGERS_TWO)
+		return 2;
+	if (finger_state & TOUCHPAD_FINGERS_ONE)
+		return 1;
+	return 0;
+}
+
 static void
 touchpad_update_state(struct touchpad_dispatch *touchpad, uint32_t time)
 {
 	int motion_index;
 	int center_x, center_y;
 	double dx = 0.0, dy = 0.0;
+	int fingers;
+
+	/* the most fingers seen decide which button a tap clicks */
+	fingers = finger_count(touchpad->finger_state);
+	if (fingers > touchpad->fsm.fingers)
+		touchpad->fsm.fingers = fingers;
 
 	if (touchpad->reset ||
 	    touchpad->last_finger_state != touchpad->finger_state) {
+		if (touchpad->last_finger_state == TOUCHPAD_FINGERS_TWO &&
+		    touchpad->finger_state != TOUCHPAD_FINGERS_TWO)
+			kinetic_start(touchpad, time);
+
 		touchpad->reset = 0;
 		touchpad->motion_count = 0;
 		touchpad->event_mask = TOUCHPAD_EVENT_NONE;
@@ -486,6 +639,10 @@ touchpad_update_state(struct touchpad_dispatch *touchpad, uint32_t time)
 		filter_motion(touchpad, &dx, &dy, time);
 
 		if (touchpad->finger_state == TOUCHPAD_FINGERS_ONE) {
+			/* a finger left behind by a scroll stops it */
+			if (touchpad->kinetic.vx != 0.0 ||
+			    touchpad->kinetic.vy != 0.0)
+				kinetic_stop(touchpad);
 			touchpad->device->rel.dx = wl_fixed_from_double(dx);
 			touchpad->device->rel.dy = wl_fixed_from_double(dy);
 			touchpad->device->pending_events |=
@@ -501,6 +658,7 @@ touchpad_update_state(struct touchpad_dispatch *touchpad, uint32_t time)
 					    time,
 					    WL_POINTER_AXIS_VERTICAL_SCROLL,
 					    wl_fixed_from_double(dy));
+			kinetic_track(touchpad, dx, dy, time);
 		}
 	}
 
@@ -517,6 +675,8 @@ static void
 on_touch(struct touchpad_dispatch *touchpad)
 {
 	touchpad->state |= TOUCHPAD_STATE_TOUCH;
+	touchpad->fsm.fingers = 0;
+	kinetic_stop(touchpad);
 
 	push_fsm_event(touchpad, FSM_EVENT_TOUCH);
 }
@@ -531,11 +691,133 @@ on_release(struct touchpad_dispatch *touchpad)
 	push_fsm_event(touchpad, FSM_EVENT_RELEASE);
 }
 
+static void
+process_mt_absolute(struct touchpad_dispatch *touchpad,
+		    struct input_event *e, uint32_t time)
+{
+	int slot = touchpad->mt.slot;
+	uint32_t bit;
+
+	if (e->code == ABS_MT_SLOT) {
+		touchpad->mt.slot = e->value;
+		return;
+	}
+
+	if (slot < 0 || slot >= MAX_SLOTS)
+		return;
+	bit = 1 << slot;
+
+	switch (e->code) {
+	case ABS_MT_TRACKING_ID:
+		if (e->value >= 0) {
+			touchpad->mt.active |= bit;
+			touchpad->mt.fresh |= bit;
+			touchpad->mt.begin[slot] = time;
+			touchpad->mt.major[slot] = 0;
+		} else {
+			touchpad->mt.active &= ~bit;
+			touchpad->mt.fresh &= ~bit;
+			touchpad->mt.palm &= ~bit;
+			touchpad->mt.edge &= ~bit;
+		}
+		break;
+	case ABS_MT_POSITION_X:
+		touchpad->mt.x[slot] = e->value;
+		break;
+	case ABS_MT_POSITION_Y:
+		touchpad->mt.y[slot] = e->value;
+		break;
+	case ABS_MT_TOUCH_MAJOR:
+		touchpad->mt.major[slot] = e->value;
+		break;
+	}
+}
+
+/* Classifies the touches of a multitouch pad at the end of a report and
+ * derives the finger state and pointer position the single touch code
+ * works with: palms are left out, and two fingers move their centroid. */
+static void
+touchpad_mt_report(struct touchpad_dispatch *touchpad, uint32_t time)
+{
+	uint32_t bit, fingers;
+	int32_t x = 0, y = 0;
+	int slot, count = 0;
+	bool in_edge;
+
+	for (slot = 0; slot < MAX_SLOTS; slot++) {
+		bit = 1 << slot;
+		if (!(touchpad->mt.active & bit))
+			continue;
+
+		in_edge = touchpad->mt.x[slot] < touchpad->palm.left ||
+			  touchpad->mt.x[slot] > touchpad->palm.right;
+		if ((touchpad->mt.fresh & bit) && in_edge) {
+			touchpad->mt.palm |= bit;
+			touchpad->mt.edge |= bit;
+		} else if ((touchpad->mt.edge & bit) && !in_edge &&
+			   time - touchpad->mt.begin[slot] <
+			   DEFAULT_PALM_EDGE_TIMEOUT) {
+			touchpad->mt.palm &= ~bit;
+			touchpad->mt.edge &= ~bit;
+		}
+
+		if (touchpad->palm.major > 0 &&
+		    touchpad->mt.major[slot] > touchpad->palm.major)
+			touchpad->mt.palm |= bit;
+	}
+	touchpad->mt.fresh = 0;
+
+	fingers = touchpad->mt.active & ~touchpad->mt.palm;
+	for (slot = 0; slot < MAX_SLOTS; slot++) {
+		if (!(fingers & (1 << slot)))
+			continue;
+		if (count < 2) {
+			x += touchpad->mt.x[slot];
+			y += touchpad->mt.y[slot];
+		}
+		count++;
+	}
+
+	switch (count) {
+	case 0:
+		touchpad->finger_state = 0;
+		break;
+	case 1:
+		touchpad->finger_state = TOUCHPAD_FINGERS_ONE;
+		break;
+	case 2:
+		touchpad->finger_state = TOUCHPAD_FINGERS_TWO;
+		break;
+	default:
+		touchpad->finger_state = TOUCHPAD_FINGERS_THREE;
+		break;
+	}
+
+	if (count > 0 && !(touchpad->state & TOUCHPAD_STATE_TOUCH))
+		on_touch(touchpad);
+	else if (count == 0 && touchpad->state & TOUCHPAD_STATE_TOUCH)
+		on_release(touchpad);
+
+	if (count > 0) {
+		count = count < 2 ? count : 2;
+		touchpad->hw_abs.x = x / count;
+		touchpad->hw_abs.y = y / count;
+		touchpad->event_mask |= TOUCHPAD_EVENT_ABSOLUTE_ANY |
+			TOUCHPAD_EVENT_ABSOLUTE_X | TOUCHPAD_EVENT_ABSOLUTE_Y;
+	}
+}
+
 static inline void
 process_absolute(struct touchpad_dispatch *touchpad,
 		 struct evdev_device *device,
-		 struct input_event *e)
+		 struct input_event *e,
+		 uint32_t time)
 {
+	if (device->is_mt) {
+		process_mt_absolute(touchpad, e, time);
+		return;
+	}
+
 	switch (e->code) {
 	case ABS_PRESSURE:
 		if (e->value > touchpad->pressure.touch_high &&
@@ -563,6 +845,32 @@ process_absolute(struct touchpad_dispatch *touchpad,
 	}
 }
 
+static void
+process_finger_tool(struct touchpad_dispatch *touchpad,
+		    struct input_event *e)
+{
+	switch (e->code) {
+	case BTN_TOOL_FINGER:
+		if (e->value)
+			touchpad->finger_state |= TOUCHPAD_FINGERS_ONE;
+		else
+			touchpad->finger_state &= ~TOUCHPAD_FINGERS_ONE;
+		break;
+	case BTN_TOOL_DOUBLETAP:
+		if (e->value)
+			touchpad->finger_state |= TOUCHPAD_FINGERS_TWO;
+		else
+			touchpad->finger_state &= ~TOUCHPAD_FINGERS_TWO;
+		break;
+	case BTN_TOOL_TRIPLETAP:
+		if (e->value)
+			touchpad->finger_state |= TOUCHPAD_FINGERS_THREE;
+		else
+			touchpad->finger_state &= ~TOUCHPAD_FINGERS_THREE;
+		break;
+	}
+}
+
 static inline void
 process_key(struct touchpad_dispatch *touchpad,
 	    struct evdev_device *device,
@@ -571,7 +879,7 @@ process_key(struct touchpad_dispatch *touchpad,
 {
 	switch (e->code) {
 	case BTN_TOUCH:
-		if (!touchpad->has_pressure) {
+		if (!touchpad->has_pressure && !device->is_mt) {
 			if (e->value && !(touchpad->state & TOUCHPAD_STATE_TOUCH))
 				on_touch(touchpad);
 			else if (!e->value)
@@ -601,22 +909,11 @@ process_key(struct touchpad_dispatch *touchpad,
 		touchpad->reset = 1;
 		break;
 	case BTN_TOOL_FINGER:
-		if (e->value)
-			touchpad->finger_state |= TOUCHPAD_FINGERS_ONE;
-		else
-			touchpad->finger_state &= ~TOUCHPAD_FINGERS_ONE;
-		break;
 	case BTN_TOOL_DOUBLETAP:
-		if (e->value)
-			touchpad->finger_state |= TOUCHPAD_FINGERS_TWO;
-		else
-			touchpad->finger_state &= ~TOUCHPAD_FINGERS_TWO;
-		break;
 	case BTN_TOOL_TRIPLETAP:
-		if (e->value)
-			touchpad->finger_state |= TOUCHPAD_FINGERS_THREE;
-		else
-			touchpad->finger_state &= ~TOUCHPAD_FINGERS_THREE;
+		/* multitouch pads count their slots instead */
+		if (!device->is_mt)
+			process_finger_tool(touchpad, e);
 		break;
 	}
 }
@@ -632,11 +929,14 @@ touchpad_process(struct evdev_dispatch *dispatch,
 
 	switch (e->type) {
 	case EV_SYN:
-		if (e->code == SYN_REPORT)
-			touchpad->event_mask |= TOUCHPAD_EVENT_REPORT;
+		if (e->code != SYN_REPORT)
+			break;
+		if (device->is_mt)
+			touchpad_mt_report(touchpad, time);
+		touchpad->event_mask |= TOUCHPAD_EVENT_REPORT;
 		break;
 	case EV_ABS:
-		process_absolute(touchpad, device, e);
+		process_absolute(touchpad, device, e, time);
 		break;
 	case EV_KEY:
 		process_key(touchpad, device, e, time);
@@ -654,6 +954,7 @@ touchpad_destroy(struct evdev_dispatch *dispatch)
 
 	touchpad->filter->interface->destroy(touchpad->filter);
 	wl_event_source_remove(touchpad->fsm.timer_source);
+	wl_event_source_remove(touchpad->kinetic.timer_source);
 	free(dispatch);
 }
 
@@ -662,11 +963,47 @@ struct evdev_dispatch_interface touchpad_interface = {
 	touchpad_destroy
 };
 
+/* Picks up the slot and touches the device already has, the kernel only
+ * reports changes from here on. */
+static void
+touchpad_init_slots(struct touchpad_dispatch *touchpad,
+		    struct evdev_device *device)
+{
+	struct input_absinfo absinfo;
+	struct {
+		uint32_t code;
+		int32_t values[MAX_SLOTS];
+	} ids, xs, ys;
+	int slot;
+
+	if (ioctl(device->fd, EVIOCGABS(ABS_MT_SLOT), &absinfo) < 0)
+		return;
+	touchpad->mt.slot = absinfo.value;
+
+	ids.code = ABS_MT_TRACKING_ID;
+	xs.code = ABS_MT_POSITION_X;
+	ys.code = ABS_MT_POSITION_Y;
+	if (ioctl(device->fd, EVIOCGMTSLOTS(sizeof ids), &ids) < 0 ||
+	    ioctl(device->fd, EVIOCGMTSLOTS(sizeof xs), &xs) < 0 ||
+	    ioctl(device->fd, EVIOCGMTSLOTS(sizeof ys), &ys) < 0)
+		return;
+
+	for (slot = 0; slot < MAX_SLOTS; slot++) {
+		if (ids.values[slot] < 0)
+			continue;
+		touchpad->mt.active |= 1 << slot;
+		touchpad->mt.fresh |= 1 << slot;
+		touchpad->mt.x[slot] = xs.values[slot];
+		touchpad->mt.y[slot] = ys.values[slot];
+	}
+}
+
 static int
 touchpad_init(struct touchpad_dispatch *touchpad,
 	      struct evdev_device *device)
 {
 	struct weston_motion_filter *accel;
+	struct weston_accel_config accel_config;
 	struct wl_event_loop *loop;
 
 	unsigned long prop_bits[INPUT_PROP_MAX];
@@ -685,10 +1022,12 @@ touchpad_init(struct touchpad_dispatch *touchpad,
 	/* Detect model */
 	touchpad->model = get_touchpad_model(device);
 
+	memset(prop_bits, 0, sizeof prop_bits);
 	ioctl(device->fd, EVIOCGPROP(sizeof(prop_bits)), prop_bits);
 	has_buttonpad = TEST_BIT(prop_bits, INPUT_PROP_BUTTONPAD);
 
 	/* Configure pressure */
+	memset(abs_bits, 0, sizeof abs_bits);
 	ioctl(device->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits);
 	if (TEST_BIT(abs_bits, ABS_PRESSURE)) {
 		ioctl(device->fd, EVIOCGABS(ABS_PRESSURE), &absinfo);
@@ -697,16 +1036,31 @@ touchpad_init(struct touchpad_dispatch *touchpad,
 					    absinfo.maximum);
 	}
 
+	/* Configure palm detection */
+	if (TEST_BIT(abs_bits, ABS_MT_TOUCH_MAJOR) &&
+	    ioctl(device->fd, EVIOCGABS(ABS_MT_TOUCH_MAJOR), &absinfo) == 0)
+		touchpad->palm.major =
+			absinfo.maximum * DEFAULT_PALM_MAJOR_FRACTION;
+
+	if (TEST_BIT(abs_bits, ABS_MT_SLOT))
+		touchpad_init_slots(touchpad, device);
+
 	/* Configure acceleration factor */
 	width = abs(device->abs.max_x - device->abs.min_x);
 	height = abs(device->abs.max_y - device->abs.min_y);
 	diagonal = sqrt(width*width + height*height);
 
-	touchpad->constant_accel_factor =
-		DEFAULT_CONSTANT_ACCEL_NUMERATOR / diagonal;
+	touchpad->palm.left =
+		device->abs.min_x + width * DEFAULT_PALM_EDGE_FRACTION;
+	touchpad->palm.right =
+		device->abs.max_x - width * DEFAULT_PALM_EDGE_FRACTION;
 
-	touchpad->min_accel_factor = DEFAULT_MIN_ACCEL_FACTOR;
-	touchpad->max_accel_factor = DEFAULT_MAX_ACCEL_FACTOR;
+	memset(&accel_config, 0, sizeof accel_config);
+	accel_config.curve = weston_accel_curve_from_name("linear");
+	accel_config.factor = DEFAULT_CONSTANT_ACCEL_NUMERATOR / diagonal;
+	accel_config.min_factor = DEFAULT_MIN_ACCEL_FACTOR;
+	accel_config.max_factor = DEFAULT_MAX_ACCEL_FACTOR;
+	evdev_device_get_accel_config(device, "touchpad", &accel_config);
 
 	touchpad->hysteresis.margin_x =
 		diagonal / DEFAULT_HYSTERESIS_MARGIN_DENOMINATOR;
@@ -716,7 +1070,7 @@ touchpad_init(struct touchpad_dispatch *touchpad,
 	touchpad->hysteresis.center_y = 0;
 
 	/* Configure acceleration profile */
-	accel = create_pointer_accelator_filter(touchpad_profile);
+	accel = create_pointer_accelerator_filter_from_config(&accel_config);
 	if (accel == NULL)
 		return -1;
 	touchpad->filter = accel;
@@ -743,6 +1097,15 @@ touchpad_init(struct touchpad_dispatch *touchpad,
 		return -1;
 	}
 
+	touchpad->kinetic.timer_source =
+		wl_event_loop_add_timer(loop, kinetic_timeout_handler,
+					touchpad);
+	if (touchpad->kinetic.timer_source == NULL) {
+		wl_event_source_remove(touchpad->fsm.timer_source);
+		accel->interface->destroy(accel);
+		return -1;
+	}
+
 	/* Configure */
 	touchpad->fsm.enable = !has_buttonpad;
 
@@ -757,6 +1120,7 @@ evdev_touchpad_create(struct evdev_device *device)
 	touchpad = malloc(sizeof *touchpad);
 	if (touchpad == NULL)
 		return NULL;
+	memset(touchpad, 0, sizeof *touchpad);
 
 	if (touchpad_init(touchpad, device) != 0) {
 		free(touchpad);
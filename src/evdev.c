@@ -20,15 +20,23 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <linux/input.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <mtdev.h>
 
 #include "compositor.h"
 #include "evdev.h"
+#include "filter.h"
 
 #define DEFAULT_AXIS_STEP_DISTANCE wl_fixed_from_int(10)
 
@@ -244,6 +252,18 @@ transform_absolute(struct evdev_device *device)
 			device->abs.calibration[5];
 }
 
+static void
+evdev_filter_relative(struct evdev_device *device, uint32_t time)
+{
+	struct weston_motion_params motion;
+
+	motion.dx = wl_fixed_to_double(device->rel.dx);
+	motion.dy = wl_fixed_to_double(device->rel.dy);
+	weston_filter_dispatch(device->filter, &motion, device, time);
+	device->rel.dx = wl_fixed_from_double(motion.dx);
+	device->rel.dy = wl_fixed_from_double(motion.dy);
+}
+
 static void
 evdev_flush_motion(struct evdev_device *device, uint32_t time)
 {
@@ -254,6 +274,8 @@ evdev_flush_motion(struct evdev_device *device, uint32_t time)
 
 	device->pending_events &= ~EVDEV_SYN;
 	if (device->pending_events & EVDEV_RELATIVE_MOTION) {
+		if (device->filter)
+			evdev_filter_relative(device, time);
 		notify_motion(master, time, device->rel.dx, device->rel.dy);
 		device->pending_events &= ~EVDEV_RELATIVE_MOTION;
 		device->rel.dx = 0;
@@ -363,41 +385,713 @@ evdev_process_events(struct evdev_device *device,
 	evdev_flush_motion(device, time);
 }
 
+/* Input thread
+ *
+ * All evdev fds are read on a thread of their own so that a slow frame
+ * on the main thread never leaves events sitting in the kernel buffer
+ * long enough to overflow it.  The thread copies the events into the
+ * per device ring and pokes the main thread through a pipe added to the
+ * compositor input loop, which drains the rings and runs the regular
+ * dispatch.  Notifications to the seat therefore still happen on the
+ * main thread, once per frame while a repaint is pending. */
+
+/* Reads start at EVDEV_READ_MIN events and grow up to EVDEV_READ_MAX
+ * while the device keeps filling them.  EVDEV_SYNC_EVENTS of the ring
+ * are kept free for the events queued by a resync. */
+#define EVDEV_READ_MIN 64
+#define EVDEV_READ_MAX 512
+#define EVDEV_SYNC_EVENTS 256
+
+struct evdev_reader {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint32_t epoch;
+	int quit;
+
+	int epoll_fd;
+	int wake_pipe[2];
+	int notify_pipe[2];
+	int notify_pending;
+	struct wl_event_source *source;
+
+	struct wl_list device_list;
+};
+
+static struct evdev_reader *evdev_reader;
+
 static int
-evdev_device_data(int fd, uint32_t mask, void *data)
+is_relative_motion_frame(struct input_event *ev, int count,
+			 int *x, int *y)
 {
-	struct weston_compositor *ec;
-	struct evdev_device *device = data;
-	struct input_event ev[32];
-	int len;
+	int i;
+
+	*x = -1;
+	*y = -1;
+	for (i = 0; i < count; i++) {
+		if (ev[i].type != EV_REL)
+			return 0;
+		if (ev[i].code == REL_X && *x < 0)
+			*x = i;
+		else if (ev[i].code == REL_Y && *y < 0)
+			*y = i;
+		else
+			return 0;
+	}
 
-	ec = device->seat->compositor;
-	if (!ec->focus)
-		return 1;
+	return count > 0;
+}
+
+/* Fold runs of frames that only carry REL_X/REL_Y into the first frame
+ * of the run, keeping the time of the last one.  Returns the number of
+ * events left in ev. */
+static int
+evdev_coalesce_motion(struct input_event *ev, int count)
+{
+	int i, start, out, n;
+	int x, y, prev, prev_x, prev_y;
+
+	start = 0;
+	out = 0;
+	prev = -1;
+	prev_x = prev_y = -1;
+	for (i = 0; i < count; i++) {
+		if (ev[i].type != EV_SYN || ev[i].code != SYN_REPORT)
+			continue;
+
+		n = i - start;
+		if (!is_relative_motion_frame(&ev[start], n, &x, &y)) {
+			prev = -1;
+		} else if (prev >= 0 &&
+			   (x < 0 || prev_x >= 0) && (y < 0 || prev_y >= 0)) {
+			if (x >= 0)
+				ev[prev + prev_x].value += ev[start + x].value;
+			if (y >= 0)
+				ev[prev + prev_y].value += ev[start + y].value;
+			for (n = prev; n < out; n++)
+				ev[n].time = ev[i].time;
+			start = i + 1;
+			continue;
+		} else {
+			prev = out;
+			prev_x = x;
+			prev_y = y;
+		}
+
+		memmove(&ev[out], &ev[start], (i - start + 1) * sizeof *ev);
+		out += i - start + 1;
+		start = i + 1;
+	}
+
+	/* Trailing partial frame, leave it alone. */
+	memmove(&ev[out], &ev[start], (count - start) * sizeof *ev);
+
+	return out + count - start;
+}
+
+static void
+evdev_reader_watch(struct evdev_reader *reader, struct evdev_device *device)
+{
+	struct epoll_event ep;
+
+	/* A removed device may be freed before the next epoll_wait. */
+	if (device->queue.removed)
+		return;
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = EPOLLIN;
+	ep.data.ptr = device;
+	epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, device->fd, &ep);
+}
+
+static unsigned int
+evdev_queue_space(struct evdev_device *device)
+{
+	unsigned int tail;
+
+	tail = __atomic_load_n(&device->queue.tail, __ATOMIC_SEQ_CST);
+
+	return EVDEV_QUEUE_SIZE - (device->queue.head - tail);
+}
+
+/* Keeps track of the key and touch state the main thread will end up
+ * with once it has processed e, for evdev_device_resync(). */
+static void
+evdev_sync_track(struct evdev_device *device, struct input_event *e)
+{
+	int slot;
+
+	switch (e->type) {
+	case EV_KEY:
+		if (e->code >= KEY_CNT || e->value == 2)
+			break;
+		if (e->value)
+			device->sync.keys[e->code >> 3] |= 1 << (e->code & 7);
+		else
+			device->sync.keys[e->code >> 3] &= ~(1 << (e->code & 7));
+		break;
+	case EV_ABS:
+		slot = device->sync.slot;
+		if (e->code == ABS_MT_SLOT)
+			device->sync.slot = e->value;
+		else if (e->code == ABS_MT_TRACKING_ID &&
+			 slot >= 0 && slot < MAX_SLOTS)
+			device->sync.tracking_id[slot] = e->value;
+		break;
+	}
+}
+
+static void
+evdev_queue_push(struct evdev_device *device,
+		 struct input_event *ev, int count)
+{
+	unsigned int head, index, n;
+	int i;
+
+	for (i = 0; i < count; i++)
+		evdev_sync_track(device, &ev[i]);
+
+	head = device->queue.head;
+	for (i = 0; i < count; i += n) {
+		index = head & (EVDEV_QUEUE_SIZE - 1);
+		n = EVDEV_QUEUE_SIZE - index;
+		if (n > (unsigned int) (count - i))
+			n = count - i;
+		memcpy(&device->queue.events[index], &ev[i], n * sizeof ev[0]);
+		head += n;
+	}
+	__atomic_store_n(&device->queue.head, head, __ATOMIC_RELEASE);
+}
+
+static int
+evdev_sync_add(struct input_event *ev, int n, const struct timeval *time,
+	       int type, int code, int value)
+{
+	/* the last slot is kept for the final SYN_REPORT */
+	if (n >= EVDEV_SYNC_EVENTS - 1 && type != EV_SYN)
+		return n;
+	if (n >= EVDEV_SYNC_EVENTS)
+		return n;
+
+	ev[n].time = *time;
+	ev[n].type = type;
+	ev[n].code = code;
+	ev[n].value = value;
+
+	return n + 1;
+}
+
+/* Queues the events needed to bring what the main thread has seen in
+ * line with the current kernel state, after the kernel dropped events.
+ * When the device is gone, everything it held down is released. */
+static void
+evdev_device_resync(struct evdev_device *device,
+		    const struct timeval *time, int gone)
+{
+	struct input_event ev[EVDEV_SYNC_EVENTS];
+	uint8_t keys[sizeof device->sync.keys];
+	struct {
+		uint32_t code;
+		int32_t values[MAX_SLOTS];
+	} ids, xs, ys;
+	struct input_absinfo absinfo;
+	unsigned int code, bit;
+	int32_t id, old;
+	int n = 0, slot;
+
+	memset(keys, 0, sizeof keys);
+	if (!gone && ioctl(device->fd, EVIOCGKEY(sizeof keys), keys) < 0)
+		memcpy(keys, device->sync.keys, sizeof keys);
+	for (code = 0; code < KEY_CNT; code++) {
+		bit = 1 << (code & 7);
+		if ((keys[code >> 3] ^ device->sync.keys[code >> 3]) & bit)
+			n = evdev_sync_add(ev, n, time, EV_KEY, code,
+					   !!(keys[code >> 3] & bit));
+	}
+	if (n > 0)
+		n = evdev_sync_add(ev, n, time, EV_SYN, SYN_REPORT, 0);
+
+	if (device->is_mt) {
+		memset(&ids, 0xff, sizeof ids);
+		memset(&xs, 0, sizeof xs);
+		memset(&ys, 0, sizeof ys);
+		ids.code = ABS_MT_TRACKING_ID;
+		xs.code = ABS_MT_POSITION_X;
+		ys.code = ABS_MT_POSITION_Y;
+
+		/* Devices without kernel slots go through mtdev, there is
+		 * nothing to query for them. */
+		if (!gone &&
+		    (ioctl(device->fd, EVIOCGMTSLOTS(sizeof ids), &ids) < 0 ||
+		     ioctl(device->fd, EVIOCGMTSLOTS(sizeof xs), &xs) < 0 ||
+		     ioctl(device->fd, EVIOCGMTSLOTS(sizeof ys), &ys) < 0))
+			goto out;
+
+		for (slot = 0; slot < MAX_SLOTS; slot++) {
+			id = ids.values[slot];
+			old = device->sync.tracking_id[slot];
+			if (id < 0 && old < 0)
+				continue;
+
+			n = evdev_sync_add(ev, n, time,
+					   EV_ABS, ABS_MT_SLOT, slot);
+			if (old >= 0 && id != old) {
+				n = evdev_sync_add(ev, n, time, EV_ABS,
+						   ABS_MT_TRACKING_ID, -1);
+				n = evdev_sync_add(ev, n, time,
+						   EV_SYN, SYN_REPORT, 0);
+				if (id < 0)
+					continue;
+				n = evdev_sync_add(ev, n, time,
+						   EV_ABS, ABS_MT_SLOT, slot);
+			}
+			if (id != old)
+				n = evdev_sync_add(ev, n, time, EV_ABS,
+						   ABS_MT_TRACKING_ID, id);
+			n = evdev_sync_add(ev, n, time, EV_ABS,
+					   ABS_MT_POSITION_X, xs.values[slot]);
+			n = evdev_sync_add(ev, n, time, EV_ABS,
+					   ABS_MT_POSITION_Y, ys.values[slot]);
+			n = evdev_sync_add(ev, n, time, EV_SYN, SYN_REPORT, 0);
+		}
+
+		if (!gone &&
+		    ioctl(device->fd, EVIOCGABS(ABS_MT_SLOT), &absinfo) == 0)
+			n = evdev_sync_add(ev, n, time, EV_ABS,
+					   ABS_MT_SLOT, absinfo.value);
+	} else if (!gone && (device->caps & EVDEV_MOTION_ABS)) {
+		if (ioctl(device->fd, EVIOCGABS(ABS_X), &absinfo) == 0)
+			n = evdev_sync_add(ev, n, time, EV_ABS,
+					   ABS_X, absinfo.value);
+		if (ioctl(device->fd, EVIOCGABS(ABS_Y), &absinfo) == 0)
+			n = evdev_sync_add(ev, n, time, EV_ABS,
+					   ABS_Y, absinfo.value);
+		n = evdev_sync_add(ev, n, time, EV_SYN, SYN_REPORT, 0);
+	}
+
+out:
+	evdev_queue_push(device, ev, n);
+}
+
+/* Queues a batch read from the device.  After a SYN_DROPPED the kernel
+ * wants the incomplete frame and everything up to the next SYN_REPORT
+ * thrown away, the state is then queried instead. */
+static void
+evdev_device_queue(struct evdev_device *device,
+		   struct input_event *ev, int count)
+{
+	int i, start = 0, frame = 0;
+
+	for (i = 0; i < count; i++) {
+		if (ev[i].type != EV_SYN)
+			continue;
+
+		if (device->sync.dropped) {
+			if (ev[i].code == SYN_REPORT) {
+				device->sync.dropped = 0;
+				evdev_device_resync(device, &ev[i].time, 0);
+			}
+			start = frame = i + 1;
+		} else if (ev[i].code == SYN_DROPPED) {
+			evdev_queue_push(device, &ev[start], frame - start);
+			__atomic_add_fetch(&device->stats.drops, 1,
+					   __ATOMIC_RELAXED);
+			device->sync.dropped = 1;
+			start = frame = i + 1;
+		} else if (ev[i].code == SYN_REPORT) {
+			frame = i + 1;
+		}
+	}
+
+	if (device->sync.dropped)
+		return;
+	evdev_queue_push(device, &ev[start], count - start);
+}
+
+/* Reads the device until the fd runs dry or the ring is full.  Returns
+ * 0 in the first case, 1 in the second and -1 when the device is gone
+ * or broken. */
+static int
+evdev_device_read(struct evdev_device *device)
+{
+	struct input_event ev[EVDEV_READ_MAX];
+	struct timeval now;
+	unsigned int space, want;
+	int len, count;
+
+	for (;;) {
+		space = evdev_queue_space(device);
+		if (space < EVDEV_READ_MIN + EVDEV_SYNC_EVENTS)
+			return 1;
+		want = device->sync.batch;
+		if (want > space - EVDEV_SYNC_EVENTS)
+			want = space - EVDEV_SYNC_EVENTS;
 
-	/* If the compositor is repainting, this function is called only once
-	 * per frame and we have to process all the events available on the
-	 * fd, otherwise there will be input lag. */
-	do {
 		if (device->mtdev)
-			len = mtdev_get(device->mtdev, fd, ev,
-					ARRAY_LENGTH(ev)) *
+			len = mtdev_get(device->mtdev, device->fd, ev, want) *
 				sizeof (struct input_event);
 		else
-			len = read(fd, &ev, sizeof ev);
+			len = read(device->fd, &ev, want * sizeof ev[0]);
 
-		if (len < 0 || len % sizeof ev[0] != 0) {
-			/* FIXME: call evdev_device_destroy when errno is ENODEV. */
-			return 1;
+		if (len < 0 && errno == EAGAIN)
+			return 0;
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0 || len % sizeof ev[0] != 0) {
+			gettimeofday(&now, NULL);
+			evdev_device_resync(device, &now, 1);
+			__atomic_store_n(&device->queue.failed,
+					 len < 0 ? errno : EIO,
+					 __ATOMIC_SEQ_CST);
+			return -1;
+		}
+
+		count = len / sizeof ev[0];
+		__atomic_add_fetch(&device->stats.events, count,
+				   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&device->stats.reads, 1, __ATOMIC_RELAXED);
+
+		/* A full read means the device produces faster than we
+		 * read it, a mostly empty one that we read too eagerly. */
+		if ((unsigned int) count == want &&
+		    device->sync.batch < EVDEV_READ_MAX)
+			device->sync.batch *= 2;
+		else if (count < device->sync.batch / 4 &&
+			 device->sync.batch > EVDEV_READ_MIN)
+			device->sync.batch /= 2;
+
+		count = evdev_coalesce_motion(ev, count);
+		evdev_device_queue(device, ev, count);
+	}
+}
+
+/* Called on the input thread with the reader mutex held. */
+static int
+evdev_reader_fill(struct evdev_reader *reader, struct evdev_device *device)
+{
+	unsigned int head = device->queue.head;
+	int ret;
+
+	/* Still in ep from before evdev_reader_remove_device(). */
+	if (device->queue.removed)
+		return 0;
+
+	ret = evdev_device_read(device);
+	if (ret < 0) {
+		/* A dead device keeps signalling EPOLLHUP. */
+		epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+	} else if (ret > 0) {
+		/* The ring is full.  Leave the rest in the kernel buffer
+		 * until the main thread catches up, it watches the fd
+		 * again after draining.  Whoever clears the stalled flag
+		 * adds the fd back, so a drain racing with us cannot leave
+		 * the device unwatched. */
+		epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+		__atomic_store_n(&device->queue.stalled, 1, __ATOMIC_SEQ_CST);
+		if (evdev_queue_space(device) >=
+		    EVDEV_READ_MIN + EVDEV_SYNC_EVENTS &&
+		    __sync_bool_compare_and_swap(&device->queue.stalled, 1, 0))
+			evdev_reader_watch(reader, device);
+	}
+
+	return device->queue.head != head || ret < 0;
+}
+
+static void *
+evdev_reader_thread(void *data)
+{
+	struct evdev_reader *reader = data;
+	struct epoll_event ep[16];
+	char buf[64];
+	int i, count, queued;
+
+	for (;;) {
+		count = epoll_wait(reader->epoll_fd, ep, ARRAY_LENGTH(ep), -1);
+		if (count < 0)
+			count = 0;
+
+		pthread_mutex_lock(&reader->mutex);
+		if (reader->quit) {
+			pthread_mutex_unlock(&reader->mutex);
+			break;
+		}
+
+		queued = 0;
+		for (i = 0; i < count; i++) {
+			if (ep[i].data.ptr == NULL) {
+				while (read(reader->wake_pipe[0],
+					    buf, sizeof buf) > 0)
+					;
+				continue;
+			}
+			queued |= evdev_reader_fill(reader, ep[i].data.ptr);
 		}
 
-		evdev_process_events(device, ev, len / sizeof ev[0]);
+		/* Devices removed before this point can no longer show
+		 * up in ep, let evdev_reader_remove_device() go on. */
+		reader->epoch++;
+		pthread_cond_broadcast(&reader->cond);
+		pthread_mutex_unlock(&reader->mutex);
+
+		/* a full pipe already wakes up the compositor, ignore EAGAIN */
+		if (queued &&
+		    !__sync_lock_test_and_set(&reader->notify_pending, 1) &&
+		    write(reader->notify_pipe[1], "", 1) < 0 &&
+		    errno != EAGAIN)
+			weston_log("unable to signal the evdev reader pipe\n");
+	}
+
+	return NULL;
+}
+
+static void
+evdev_device_drain(struct evdev_device *device)
+{
+	struct weston_compositor *ec = device->seat->compositor;
+	unsigned int head, tail, index, n;
+	unsigned long drops;
+
+	tail = device->queue.tail;
+	head = __atomic_load_n(&device->queue.head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		index = tail & (EVDEV_QUEUE_SIZE - 1);
+		n = EVDEV_QUEUE_SIZE - index;
+		if (n > head - tail)
+			n = head - tail;
+		if (ec->focus)
+			evdev_process_events(device,
+					     &device->queue.events[index], n);
+		tail += n;
+	}
+	__atomic_store_n(&device->queue.tail, tail, __ATOMIC_SEQ_CST);
+
+	if (__sync_bool_compare_and_swap(&device->queue.stalled, 1, 0))
+		evdev_reader_watch(evdev_reader, device);
+
+	drops = __atomic_load_n(&device->stats.drops, __ATOMIC_RELAXED);
+	if (drops != device->stats.drops_logged) {
+		device->stats.drops_logged = drops;
+		weston_log("input device %s, %s: kernel buffer overflowed, "
+			   "resynchronized (%lu drops, %lu events in "
+			   "%lu reads)\n", device->devname, device->devnode,
+			   drops, device->stats.events, device->stats.reads);
+	}
+}
+
+/* Returns the error of a failed read the first time it is seen. */
+static int
+evdev_device_take_error(struct evdev_device *device)
+{
+	int err;
+
+	err = __atomic_load_n(&device->queue.failed, __ATOMIC_SEQ_CST);
+	if (err <= 0 ||
+	    !__sync_bool_compare_and_swap(&device->queue.failed, err, -1))
+		return 0;
+
+	weston_log("input device %s, %s: read failed (%s), "
+		   "no longer reading it\n",
+		   device->devname, device->devnode, strerror(err));
 
-	} while (len > 0);
+	return err;
+}
+
+static int
+evdev_device_data(int fd, uint32_t mask, void *data)
+{
+	struct evdev_device *device = data;
+	int ret;
+
+	/* Without the input thread the ring is filled and drained here.
+	 * If the compositor is repainting, this function is called only
+	 * once per frame and we have to process all the events available
+	 * on the fd, otherwise there will be input lag. */
+	do {
+		ret = evdev_device_read(device);
+		evdev_device_drain(device);
+	} while (ret > 0);
+
+	if (ret < 0) {
+		wl_event_source_remove(device->source);
+		device->source = NULL;
+
+		/* Unplugged, udev may not have told us yet. */
+		if (evdev_device_take_error(device) == ENODEV)
+			evdev_device_destroy(device);
+	}
 
 	return 1;
 }
 
+static struct evdev_device *
+evdev_reader_find_unplugged(struct evdev_reader *reader)
+{
+	struct evdev_device *device;
+
+	wl_list_for_each(device, &reader->device_list, reader_link)
+		if (evdev_device_take_error(device) == ENODEV)
+			return device;
+
+	return NULL;
+}
+
+static int
+evdev_reader_dispatch(int fd, uint32_t mask, void *data)
+{
+	struct evdev_reader *reader = data;
+	struct evdev_device *device, *next;
+	char buf[64];
+
+	/* Clear the flag before draining so that events queued from now
+	 * on signal the pipe again. */
+	__sync_lock_release(&reader->notify_pending);
+	while (read(fd, buf, sizeof buf) > 0)
+		;
+
+	wl_list_for_each_safe(device, next,
+			      &reader->device_list, reader_link)
+		evdev_device_drain(device);
+
+	/* Destroying the last device destroys the reader too, so look
+	 * it up again every time. */
+	while (evdev_reader &&
+	       (device = evdev_reader_find_unplugged(evdev_reader)) != NULL)
+		evdev_device_destroy(device);
+
+	return 1;
+}
+
+static void
+evdev_reader_destroy(struct evdev_reader *reader)
+{
+	pthread_mutex_lock(&reader->mutex);
+	reader->quit = 1;
+	pthread_mutex_unlock(&reader->mutex);
+	if (write(reader->wake_pipe[1], "", 1) < 0)
+		weston_log("unable to wake up the evdev reader\n");
+	pthread_join(reader->thread, NULL);
+
+	wl_event_source_remove(reader->source);
+	close(reader->notify_pipe[0]);
+	close(reader->notify_pipe[1]);
+	close(reader->wake_pipe[0]);
+	close(reader->wake_pipe[1]);
+	close(reader->epoll_fd);
+	pthread_cond_destroy(&reader->cond);
+	pthread_mutex_destroy(&reader->mutex);
+	free(reader);
+}
+
+static struct evdev_reader *
+evdev_reader_create(struct weston_compositor *ec)
+{
+	struct evdev_reader *reader;
+	struct epoll_event ep;
+	sigset_t mask, saved;
+	int ret;
+
+	reader = malloc(sizeof *reader);
+	if (reader == NULL)
+		return NULL;
+	memset(reader, 0, sizeof *reader);
+
+	wl_list_init(&reader->device_list);
+	pthread_mutex_init(&reader->mutex, NULL);
+	pthread_cond_init(&reader->cond, NULL);
+
+	reader->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reader->epoll_fd < 0)
+		goto err_free;
+	if (pipe2(reader->wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+		goto err_epoll;
+	if (pipe2(reader->notify_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+		goto err_wake;
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = EPOLLIN;
+	ep.data.ptr = NULL;
+	if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD,
+		      reader->wake_pipe[0], &ep) < 0)
+		goto err_notify;
+
+	reader->source = wl_event_loop_add_fd(ec->input_loop,
+					      reader->notify_pipe[0],
+					      WL_EVENT_READABLE,
+					      evdev_reader_dispatch, reader);
+	if (reader->source == NULL)
+		goto err_notify;
+
+	/* Signals are handled through signalfd on the main thread. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &saved);
+	ret = pthread_create(&reader->thread, NULL,
+			     evdev_reader_thread, reader);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (ret != 0)
+		goto err_source;
+
+	return reader;
+
+err_source:
+	wl_event_source_remove(reader->source);
+err_notify:
+	close(reader->notify_pipe[0]);
+	close(reader->notify_pipe[1]);
+err_wake:
+	close(reader->wake_pipe[0]);
+	close(reader->wake_pipe[1]);
+err_epoll:
+	close(reader->epoll_fd);
+err_free:
+	pthread_cond_destroy(&reader->cond);
+	pthread_mutex_destroy(&reader->mutex);
+	free(reader);
+	weston_log("failed to start the evdev input thread, "
+		   "reading input on the main thread\n");
+	return NULL;
+}
+
+static int
+evdev_reader_add_device(struct evdev_device *device)
+{
+	if (evdev_reader == NULL)
+		evdev_reader = evdev_reader_create(device->seat->compositor);
+	if (evdev_reader == NULL)
+		return -1;
+
+	wl_list_insert(&evdev_reader->device_list, &device->reader_link);
+	pthread_mutex_lock(&evdev_reader->mutex);
+	evdev_reader_watch(evdev_reader, device);
+	pthread_mutex_unlock(&evdev_reader->mutex);
+
+	return 0;
+}
+
+static void
+evdev_reader_remove_device(struct evdev_device *device)
+{
+	struct evdev_reader *reader = evdev_reader;
+	uint32_t epoch;
+
+	/* Wait for the thread to finish its current round, it may still
+	 * hold a pointer to the device from an earlier epoll_wait. */
+	pthread_mutex_lock(&reader->mutex);
+	device->queue.removed = 1;
+	epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+	epoch = reader->epoch;
+	if (write(reader->wake_pipe[1], "", 1) < 0 && errno != EAGAIN)
+		weston_log("unable to wake up the evdev reader\n");
+	while (reader->epoch == epoch)
+		pthread_cond_wait(&reader->cond, &reader->mutex);
+	pthread_mutex_unlock(&reader->mutex);
+
+	wl_list_remove(&device->reader_link);
+	if (wl_list_empty(&reader->device_list)) {
+		evdev_reader_destroy(reader);
+		evdev_reader = NULL;
+	}
+}
+
 static int
 evdev_handle_device(struct evdev_device *device)
 {
@@ -491,6 +1185,96 @@ evdev_handle_device(struct evdev_device *device)
 	return 1;
 }
 
+static void
+config_get_double(struct weston_config_section *section,
+		  const char *key, double *value)
+{
+	char *string, *end;
+	double d;
+
+	weston_config_section_get_string(section, key, &string, NULL);
+	if (string == NULL)
+		return;
+
+	d = strtod(string, &end);
+	if (end != string && *end == '\0')
+		*value = d;
+	else
+		weston_log("invalid value \"%s\" for %s\n", string, key);
+	free(string);
+}
+
+static void
+evdev_read_accel_section(struct weston_config_section *section,
+			 struct weston_accel_config *config)
+{
+	accel_curve_func_t curve;
+	char *profile;
+
+	if (section == NULL)
+		return;
+
+	weston_config_section_get_string(section, "acceleration-profile",
+					 &profile, NULL);
+	if (profile) {
+		curve = weston_accel_curve_from_name(profile);
+		if (curve)
+			config->curve = curve;
+		else
+			weston_log("unknown acceleration profile \"%s\"\n",
+				   profile);
+		free(profile);
+	}
+
+	config_get_double(section, "acceleration-factor", &config->factor);
+	config_get_double(section, "acceleration-min", &config->min_factor);
+	config_get_double(section, "acceleration-max", &config->max_factor);
+	config_get_double(section, "acceleration-threshold",
+			  &config->threshold);
+}
+
+/* Applies the acceleration keys of the given weston.ini section, then
+ * those of an [input-device] section naming this device, on top of the
+ * defaults already in config. */
+void
+evdev_device_get_accel_config(struct evdev_device *device,
+			      const char *section_name,
+			      struct weston_accel_config *config)
+{
+	struct weston_config *wc = device->seat->compositor->config;
+
+	evdev_read_accel_section(weston_config_get_section(wc, section_name,
+							   NULL, NULL),
+				 config);
+	evdev_read_accel_section(weston_config_get_section(wc, "input-device",
+							   "name",
+							   device->devname),
+				 config);
+}
+
+static int
+evdev_configure_pointer_accel(struct evdev_device *device)
+{
+	struct weston_accel_config config;
+
+	memset(&config, 0, sizeof config);
+	config.curve = weston_accel_curve_from_name("flat");
+	config.factor = 1.0;
+	config.min_factor = 1.0;
+	config.max_factor = 1.0;
+	evdev_device_get_accel_config(device, "pointer", &config);
+
+	/* unaccelerated motion does not need the filter at all */
+	if (weston_accel_config_is_identity(&config))
+		return 0;
+
+	device->filter = create_pointer_accelerator_filter_from_config(&config);
+	if (device->filter == NULL)
+		return -1;
+
+	return 0;
+}
+
 static int
 evdev_configure_device(struct evdev_device *device)
 {
@@ -524,6 +1308,7 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 	struct evdev_device *device;
 	struct weston_compositor *ec;
 	char devname[256] = "unknown";
+	int i;
 
 	device = malloc(sizeof *device);
 	if (device == NULL)
@@ -543,6 +1328,9 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 	device->rel.dy = 0;
 	device->dispatch = NULL;
 	device->fd = device_fd;
+	device->sync.batch = EVDEV_READ_MIN;
+	for (i = 0; i < MAX_SLOTS; i++)
+		device->sync.tracking_id[i] = -1;
 
 	ioctl(device->fd, EVIOCGNAME(sizeof(devname)), devname);
 	device->devname = strdup(devname);
@@ -558,10 +1346,14 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 		goto err1;
 
 	/* If the dispatch was not set up use the fallback. */
-	if (device->dispatch == NULL)
+	if (device->dispatch == NULL) {
 		device->dispatch = fallback_dispatch_create();
-	if (device->dispatch == NULL)
-		goto err1;
+		if (device->dispatch == NULL)
+			goto err1;
+		if ((device->caps & EVDEV_MOTION_REL) &&
+		    evdev_configure_pointer_accel(device) < 0)
+			goto err2;
+	}
 
 
 	if (device->is_mt) {
@@ -570,15 +1362,22 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 			weston_log("mtdev failed to open for %s\n", path);
 	}
 
-	device->source = wl_event_loop_add_fd(ec->input_loop, device->fd,
-					      WL_EVENT_READABLE,
-					      evdev_device_data, device);
-	if (device->source == NULL)
-		goto err2;
+	wl_list_init(&device->reader_link);
+	if (evdev_reader_add_device(device) < 0) {
+		device->source = wl_event_loop_add_fd(ec->input_loop,
+						      device->fd,
+						      WL_EVENT_READABLE,
+						      evdev_device_data,
+						      device);
+		if (device->source == NULL)
+			goto err2;
+	}
 
 	return device;
 
 err2:
+	if (device->filter)
+		device->filter->interface->destroy(device->filter);
 	device->dispatch->interface->destroy(device->dispatch);
 err1:
 	free(device->devname);
@@ -592,11 +1391,22 @@ evdev_device_destroy(struct evdev_device *device)
 {
 	struct evdev_dispatch *dispatch;
 
+	if (device->source)
+		wl_event_source_remove(device->source);
+	else if (!wl_list_empty(&device->reader_link))
+		evdev_reader_remove_device(device);
+
+	weston_log("input device %s, %s: %lu events in %lu reads, "
+		   "%lu drops\n", device->devname, device->devnode,
+		   device->stats.events, device->stats.reads,
+		   device->stats.drops);
+
 	dispatch = device->dispatch;
 	if (dispatch)
 		dispatch->interface->destroy(dispatch);
+	if (device->filter)
+		device->filter->interface->destroy(device->filter);
 
-	wl_event_source_remove(device->source);
 	wl_list_remove(&device->link);
 	if (device->mtdev)
 		mtdev_close_delete(device->mtdev);
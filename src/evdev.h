@@ -28,6 +28,10 @@
 
 #define MAX_SLOTS 16
 
+/* Events buffered per device between the input thread and the main
+ * thread.  Must be a power of two. */
+#define EVDEV_QUEUE_SIZE 2048
+
 enum evdev_event_type {
 	EVDEV_ABSOLUTE_MOTION = (1 << 0),
 	EVDEV_ABSOLUTE_MT_DOWN = (1 << 1),
@@ -73,10 +77,45 @@ struct evdev_device {
 		wl_fixed_t dx, dy;
 	} rel;
 
+	struct weston_motion_filter *filter;
+
 	enum evdev_event_type pending_events;
 	enum evdev_device_capability caps;
 
 	int is_mt;
+
+	/* Single producer, single consumer ring.  The input thread only
+	 * advances head, the main thread only advances tail. */
+	struct {
+		struct input_event events[EVDEV_QUEUE_SIZE];
+		unsigned int head;
+		unsigned int tail;
+		int stalled;
+		/* errno of a failed read, -1 once the main thread saw it */
+		int failed;
+		/* off the input thread, set under the reader mutex */
+		int removed;
+	} queue;
+
+	/* State of the reading side, only touched by whoever reads the fd:
+	 * the size of the next read, whether the kernel dropped events,
+	 * and the keys and touches the main thread was told about. */
+	struct {
+		int batch;
+		int dropped;
+		int slot;
+		int32_t tracking_id[MAX_SLOTS];
+		uint8_t keys[(KEY_CNT + 7) / 8];
+	} sync;
+
+	/* Debugging counters, logged on drops and when the device goes. */
+	struct {
+		unsigned long events;
+		unsigned long reads;
+		unsigned long drops;
+		unsigned long drops_logged;
+	} stats;
+	struct wl_list reader_link;
 };
 
 /* copied from udev/extras/input_id/input_id.c */
@@ -111,6 +150,13 @@ struct evdev_dispatch {
 struct evdev_dispatch *
 evdev_touchpad_create(struct evdev_device *device);
 
+struct weston_accel_config;
+
+void
+evdev_device_get_accel_config(struct evdev_device *device,
+			      const char *section_name,
+			      struct weston_accel_config *config);
+
 void
 evdev_led_update(struct evdev_device *device, enum weston_led leds);
 
@@ -22,6 +22,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <limits.h>
 #include <math.h>
 
@@ -45,6 +46,7 @@ weston_filter_dispatch(struct weston_motion_filter *filter,
 #define MAX_VELOCITY_DIFF	1.0
 #define MOTION_TIMEOUT		300 /* (ms) */
 #define NUM_POINTER_TRACKERS	16
+#define ACCEL_TABLE_SIZE	256
 
 struct pointer_tracker {
 	double dx;
@@ -59,6 +61,11 @@ struct pointer_accelerator {
 
 	accel_profile_func_t profile;
 
+	/* When set, the profile sampled from 0 to ACCEL_TABLE_SIZE - 1
+	 * times 1 / table_scale, constant past the end. */
+	double *table;
+	double table_scale;
+
 	double velocity;
 	double last_velocity;
 	int last_dx;
@@ -223,10 +230,29 @@ calculate_velocity(struct pointer_accelerator *accel, uint32_t time)
 	return result;
 }
 
+static double
+table_lookup(struct pointer_accelerator *accel, double velocity)
+{
+	double pos = velocity * accel->table_scale;
+	int i;
+
+	if (pos <= 0.0)
+		return accel->table[0];
+	if (pos >= ACCEL_TABLE_SIZE - 1)
+		return accel->table[ACCEL_TABLE_SIZE - 1];
+
+	i = (int) pos;
+	return accel->table[i] +
+		(accel->table[i + 1] - accel->table[i]) * (pos - i);
+}
+
 static double
 acceleration_profile(struct pointer_accelerator *accel,
 		     void *data, double velocity, uint32_t time)
 {
+	if (accel->table)
+		return table_lookup(accel, velocity);
+
 	return accel->profile(&accel->base, data, velocity, time);
 }
 
@@ -302,6 +328,7 @@ accelerator_destroy(struct weston_motion_filter *filter)
 	struct pointer_accelerator *accel =
 		(struct pointer_accelerator *) filter;
 
+	free(accel->table);
 	free(accel->trackers);
 	free(accel);
 }
@@ -324,6 +351,8 @@ create_pointer_accelator_filter(accel_profile_func_t profile)
 	wl_list_init(&filter->base.link);
 
 	filter->profile = profile;
+	filter->table = NULL;
+	filter->table_scale = 0.0;
 	filter->last_velocity = 0.0;
 	filter->last_dx = 0;
 	filter->last_dy = 0;
@@ -334,3 +363,112 @@ create_pointer_accelator_filter(accel_profile_func_t profile)
 
 	return &filter->base;
 }
+
+/*
+ * Acceleration curves
+ */
+
+/* A constant factor, 1.0 leaves the motion alone. */
+static double
+curve_flat(const struct weston_accel_config *config, double velocity)
+{
+	return config->factor;
+}
+
+/* Proportional to the velocity, clamped to [min_factor, max_factor]. */
+static double
+curve_linear(const struct weston_accel_config *config, double velocity)
+{
+	double factor = velocity * config->factor;
+
+	if (factor > config->max_factor)
+		return config->max_factor;
+	if (factor < config->min_factor)
+		return config->min_factor;
+	return factor;
+}
+
+/* min_factor up to threshold, then easing towards max_factor at a rate
+ * given by factor. */
+static double
+curve_adaptive(const struct weston_accel_config *config, double velocity)
+{
+	double range = config->max_factor - config->min_factor;
+
+	if (velocity <= config->threshold)
+		return config->min_factor;
+
+	return config->min_factor + range *
+		(1.0 - exp(-(velocity - config->threshold) * config->factor));
+}
+
+static const struct {
+	const char *name;
+	accel_curve_func_t curve;
+} accel_curves[] = {
+	{ "flat", curve_flat },
+	{ "linear", curve_linear },
+	{ "adaptive", curve_adaptive },
+};
+
+WL_EXPORT accel_curve_func_t
+weston_accel_curve_from_name(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(accel_curves); i++)
+		if (strcmp(accel_curves[i].name, name) == 0)
+			return accel_curves[i].curve;
+
+	return NULL;
+}
+
+WL_EXPORT int
+weston_accel_config_is_identity(const struct weston_accel_config *config)
+{
+	return config->curve == curve_flat && config->factor == 1.0;
+}
+
+/* Finds where the curve has settled on its final value, so that the
+ * table covers the whole part of it that changes. */
+static double
+curve_saturation_velocity(const struct weston_accel_config *config)
+{
+	double velocity = 65536.0;
+	double limit = config->curve(config, velocity);
+
+	while (velocity > 1.0 &&
+	       fabs(config->curve(config, velocity / 2.0) - limit) < 1e-3)
+		velocity /= 2.0;
+
+	return velocity;
+}
+
+WL_EXPORT struct weston_motion_filter *
+create_pointer_accelerator_filter_from_config(
+	const struct weston_accel_config *config)
+{
+	struct weston_motion_filter *base;
+	struct pointer_accelerator *filter;
+	double max_velocity;
+	int i;
+
+	base = create_pointer_accelator_filter(NULL);
+	if (base == NULL)
+		return NULL;
+	filter = (struct pointer_accelerator *) base;
+
+	filter->table = malloc(ACCEL_TABLE_SIZE * sizeof *filter->table);
+	if (filter->table == NULL) {
+		accelerator_destroy(base);
+		return NULL;
+	}
+
+	max_velocity = curve_saturation_velocity(config);
+	filter->table_scale = (ACCEL_TABLE_SIZE - 1) / max_velocity;
+	for (i = 0; i < ACCEL_TABLE_SIZE; i++)
+		filter->table[i] = config->curve(config,
+						 i / filter->table_scale);
+
+	return base;
+}
@@ -62,4 +62,36 @@ typedef double (*accel_profile_func_t)(struct weston_motion_filter *filter,
 WL_EXPORT struct weston_motion_filter *
 create_pointer_accelator_filter(accel_profile_func_t filter);
 
+/*
+ * Table driven acceleration
+ *
+ * A curve maps the pointer velocity, in device units per millisecond, to
+ * an acceleration factor.  Curves are looked up by name so that they can
+ * be picked from weston.ini, and sampled into a table when the filter is
+ * created so that filtering an event never evaluates them.
+ */
+
+struct weston_accel_config;
+
+typedef double (*accel_curve_func_t)(const struct weston_accel_config *config,
+				     double velocity);
+
+struct weston_accel_config {
+	accel_curve_func_t curve;
+	double factor;
+	double min_factor;
+	double max_factor;
+	double threshold;
+};
+
+WL_EXPORT accel_curve_func_t
+weston_accel_curve_from_name(const char *name);
+
+WL_EXPORT int
+weston_accel_config_is_identity(const struct weston_accel_config *config);
+
+WL_EXPORT struct weston_motion_filter *
+create_pointer_accelerator_filter_from_config(
+	const struct weston_accel_config *config);
+
 #endif // _FILTER_H_
@@ -52,6 +52,7 @@ struct gl_shader {
 struct gl_output_state {
 	EGLSurface egl_surface;
 	pixman_region32_t buffer_damage[BUFFER_DAMAGE_COUNT];
+	int swapped;
 };
 
 struct gl_surface_state {
@@ -105,6 +106,8 @@ struct gl_renderer {
 
 	int has_egl_buffer_age;
 
+	PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+
 	struct gl_shader texture_shader_rgba;
 	struct gl_shader texture_shader_rgbx;
 	struct gl_shader texture_shader_egl_external;
@@ -1002,11 +1005,54 @@ output_rotate_damage(struct weston_output *output,
 	pixman_region32_copy(&go->buffer_damage[0], output_damage);
 }
 
+/* Tells the window system which part of the frame changed, when it can
+ * take that hint.  Damage is in global coordinates, EGL wants surface
+ * coordinates with the origin at the bottom left. */
+static EGLBoolean
+output_swap_buffers(struct weston_output *output,
+		    pixman_region32_t *output_damage)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	pixman_box32_t *rects;
+	EGLint *egl_damage, *d;
+	EGLBoolean ret;
+	int nrects, i, height;
+
+	/* the first frame has to cover the border too */
+	if (!gr->swap_buffers_with_damage || !go->swapped ||
+	    output->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    output->scale != 1) {
+		go->swapped = 1;
+		return eglSwapBuffers(gr->egl_display, go->egl_surface);
+	}
+
+	rects = pixman_region32_rectangles(output_damage, &nrects);
+	egl_damage = malloc(nrects * 4 * sizeof(EGLint));
+	if (egl_damage == NULL)
+		return eglSwapBuffers(gr->egl_display, go->egl_surface);
+
+	height = output->current->height +
+		output->border.top + output->border.bottom;
+
+	for (i = 0, d = egl_damage; i < nrects; i++, d += 4) {
+		d[0] = rects[i].x1 - output->x + output->border.left;
+		d[1] = height - (rects[i].y2 - output->y + output->border.top);
+		d[2] = rects[i].x2 - rects[i].x1;
+		d[3] = rects[i].y2 - rects[i].y1;
+	}
+
+	ret = gr->swap_buffers_with_damage(gr->egl_display, go->egl_surface,
+					   egl_damage, nrects);
+	free(egl_damage);
+
+	return ret;
+}
+
 static void
 gl_renderer_repaint_output(struct weston_output *output,
 			      pixman_region32_t *output_damage)
 {
-	struct gl_output_state *go = get_output_state(output);
 	struct weston_compositor *compositor = output->compositor;
 	struct gl_renderer *gr = get_renderer(compositor);
 	EGLBoolean ret;
@@ -1057,7 +1103,7 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
 
-	ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
+	ret = output_swap_buffers(output, output_damage);
 	if (ret == EGL_FALSE && !errored) {
 		errored = 1;
 		weston_log("Failed in eglSwapBuffers.\n");
@@ -2002,6 +2048,10 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 			gr->has_bind_display = 0;
 	}
 
+	if (strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+		gr->swap_buffers_with_damage =
+			(void *) eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+
 	if (strstr(extensions, "EGL_EXT_buffer_age"))
 		gr->has_egl_buffer_age = 1;
 	else
@@ -339,6 +339,9 @@ weston_pointer_destroy(struct weston_pointer *pointer)
 	if (pointer->sprite)
 		pointer_unmap_sprite(pointer);
 
+	if (pointer->motion_source)
+		wl_event_source_remove(pointer->motion_source);
+
 	/* XXX: What about pointer->resource_list? */
 	if (pointer->focus_resource)
 		wl_list_remove(&pointer->focus_listener.link);
@@ -630,38 +633,89 @@ move_pointer(struct weston_seat *seat, wl_fixed_t x, wl_fixed_t y)
 	}
 }
 
+static void
+pointer_send_motion(struct weston_pointer *pointer)
+{
+	const struct weston_pointer_grab_interface *interface;
+
+	interface = pointer->grab->interface;
+	interface->focus(pointer->grab);
+	interface->motion(pointer->grab, pointer->motion_time);
+}
+
+static void
+pointer_motion_idle(void *data)
+{
+	struct weston_pointer *pointer = data;
+
+	pointer->motion_source = NULL;
+	pointer_send_motion(pointer);
+
+	/* Idle sources run after the clients were flushed and before the
+	 * loop sleeps, the motion would sit in the buffers until the next
+	 * wakeup otherwise. */
+	wl_display_flush_clients(pointer->seat->compositor->wl_display);
+}
+
+/* The pointer position follows every motion event, but the repick and
+ * the motion sent by the grab are deferred until the compositor goes
+ * idle, with the time of the last event.  While a repaint is pending
+ * input is only dispatched once per frame, so clients get at most one
+ * motion per frame however fast the device reports. */
+static void
+pointer_queue_motion(struct weston_pointer *pointer, uint32_t time)
+{
+	struct weston_compositor *ec = pointer->seat->compositor;
+	struct wl_event_loop *loop;
+
+	pointer->motion_time = time;
+	if (pointer->motion_source)
+		return;
+
+	loop = wl_display_get_event_loop(ec->wl_display);
+	pointer->motion_source =
+		wl_event_loop_add_idle(loop, pointer_motion_idle, pointer);
+	if (pointer->motion_source == NULL)
+		pointer_send_motion(pointer);
+}
+
+/* Delivers a pending coalesced motion right away, for events that must
+ * be seen at the current pointer position. */
+WL_EXPORT void
+weston_pointer_flush_motion(struct weston_pointer *pointer)
+{
+	if (pointer->motion_source == NULL)
+		return;
+
+	wl_event_source_remove(pointer->motion_source);
+	pointer->motion_source = NULL;
+	pointer_send_motion(pointer);
+}
+
 WL_EXPORT void
 notify_motion(struct weston_seat *seat,
 	      uint32_t time, wl_fixed_t dx, wl_fixed_t dy)
 {
-	const struct weston_pointer_grab_interface *interface;
 	struct weston_compositor *ec = seat->compositor;
 	struct weston_pointer *pointer = seat->pointer;
 
 	weston_compositor_wake(ec);
 
 	move_pointer(seat, pointer->x + dx, pointer->y + dy);
-
-	interface = pointer->grab->interface;
-	interface->focus(pointer->grab);
-	interface->motion(pointer->grab, time);
+	pointer_queue_motion(pointer, time);
 }
 
 WL_EXPORT void
 notify_motion_absolute(struct weston_seat *seat,
 		       uint32_t time, wl_fixed_t x, wl_fixed_t y)
 {
-	const struct weston_pointer_grab_interface *interface;
 	struct weston_compositor *ec = seat->compositor;
 	struct weston_pointer *pointer = seat->pointer;
 
 	weston_compositor_wake(ec);
 
 	move_pointer(seat, x, y);
-
-	interface = pointer->grab->interface;
-	interface->focus(pointer->grab);
-	interface->motion(pointer->grab, time);
+	pointer_queue_motion(pointer, time);
 }
 
 WL_EXPORT void
@@ -684,9 +738,12 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 {
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = seat->pointer;
-	struct weston_surface *focus =
-		(struct weston_surface *) pointer->focus;
-	uint32_t serial = wl_display_next_serial(compositor->wl_display);
+	struct weston_surface *focus;
+	uint32_t serial;
+
+	weston_pointer_flush_motion(pointer);
+	focus = (struct weston_surface *) pointer->focus;
+	serial = wl_display_next_serial(compositor->wl_display);
 
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		if (compositor->ping_handler && focus)
@@ -720,9 +777,12 @@ notify_axis(struct weston_seat *seat, uint32_t time, uint32_t axis,
 {
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = seat->pointer;
-	struct weston_surface *focus =
-		(struct weston_surface *) pointer->focus;
-	uint32_t serial = wl_display_next_serial(compositor->wl_display);
+	struct weston_surface *focus;
+	uint32_t serial;
+
+	weston_pointer_flush_motion(pointer);
+	focus = (struct weston_surface *) pointer->focus;
+	serial = wl_display_next_serial(compositor->wl_display);
 
 	if (compositor->ping_handler && focus)
 		compositor->ping_handler(focus, serial);
@@ -28,44 +28,81 @@
 #include <unistd.h>
 #include <sys/uio.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "compositor.h"
 #include "screenshooter-server-protocol.h"
+#include "screencast-server-protocol.h"
 
 #include "../wcap/wcap-decode.h"
 
+struct screenshooter_staging {
+	uint8_t *data;
+	size_t size;
+	int busy;
+};
+
 struct screenshooter {
 	struct wl_object base;
 	struct weston_compositor *ec;
 	struct wl_global *global;
+	struct wl_global *screencaster_global;
 	struct wl_client *client;
 	struct weston_process process;
 	struct wl_listener destroy_listener;
+
+	/* Readbacks land in one of these and are copied into the client
+	 * buffer from an idle callback, so a new shot can be read back
+	 * while the previous one is still being delivered. */
+	struct screenshooter_staging staging[2];
 };
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
+	struct wl_listener buffer_destroy_listener;
+	struct screenshooter *shooter;
 	struct wl_buffer *buffer;
 	struct wl_resource *resource;
+	struct screenshooter_staging *staging;
+	struct screenshooter_staging private_staging;
+	pixman_format_code_t format;
+	int yflip;
+	int32_t x, y, width, height;
 };
 
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_bgra_yflip(uint8_t *dst, int dst_stride,
+		uint8_t *src, int src_stride, int height, int bytes)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
+		memcpy(dst, src, bytes);
+		dst += dst_stride;
+		src -= src_stride;
 	}
 }
 
 static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_bgra(uint8_t *dst, int dst_stride,
+	  uint8_t *src, int src_stride, int height, int bytes)
 {
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
+	uint8_t *end;
+
+	if (dst_stride == src_stride && bytes == src_stride) {
+		memcpy(dst, src, height * bytes);
+		return;
+	}
+
+	end = dst + height * dst_stride;
+	while (dst < end) {
+		memcpy(dst, src, bytes);
+		dst += dst_stride;
+		src += src_stride;
+	}
 }
 
 static void
@@ -75,6 +112,25 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 	uint32_t *src = vsrc;
 	uint32_t *end = dst + bytes / 4;
 
+#ifdef __SSE2__
+	const __m128i ag_mask = _mm_set1_epi32(0xff00ff00);
+	const __m128i b_mask = _mm_set1_epi32(0x000000ff);
+	const __m128i r_mask = _mm_set1_epi32(0x00ff0000);
+	__m128i v, tmp;
+
+	while (dst + 4 <= end) {
+		v = _mm_loadu_si128((__m128i *) src);
+		tmp = _mm_and_si128(v, ag_mask);
+		tmp = _mm_or_si128(tmp,
+			_mm_and_si128(_mm_srli_epi32(v, 16), b_mask));
+		tmp = _mm_or_si128(tmp,
+			_mm_and_si128(_mm_slli_epi32(v, 16), r_mask));
+		_mm_storeu_si128((__m128i *) dst, tmp);
+		src += 4;
+		dst += 4;
+	}
+#endif
+
 	while (dst < end) {
 		uint32_t v = *src++;
 		/*                    A R G B */
@@ -86,31 +142,141 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 }
 
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_rgba_yflip(uint8_t *dst, int dst_stride,
+		uint8_t *src, int src_stride, int height, int bytes)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
+		copy_row_swap_RB(dst, src, bytes);
+		dst += dst_stride;
+		src -= src_stride;
 	}
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_rgba(uint8_t *dst, int dst_stride,
+	  uint8_t *src, int src_stride, int height, int bytes)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+		copy_row_swap_RB(dst, src, bytes);
+		dst += dst_stride;
+		src += src_stride;
+	}
+}
+
+/* Copy a width x height block read back with read_pixels() into dst,
+ * converting to BGRA and undoing the y flip if needed. */
+static void
+copy_pixels(pixman_format_code_t format, int yflip,
+	    uint8_t *dst, int dst_stride, uint8_t *src,
+	    int width, int height)
+{
+	int bytes = width * 4;
+	uint8_t *last = src + bytes * (height - 1);
+
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+	case PIXMAN_x8r8g8b8:
+		if (yflip)
+			copy_bgra_yflip(dst, dst_stride, last, bytes,
+					height, bytes);
+		else
+			copy_bgra(dst, dst_stride, src, bytes, height, bytes);
+		break;
+	case PIXMAN_x8b8g8r8:
+	case PIXMAN_a8b8g8r8:
+		if (yflip)
+			copy_rgba_yflip(dst, dst_stride, last, bytes,
+					height, bytes);
+		else
+			copy_rgba(dst, dst_stride, src, bytes, height, bytes);
+		break;
+	default:
+		break;
 	}
 }
 
+static void
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l)
+{
+	if (l->staging == &l->private_staging)
+		free(l->private_staging.data);
+	else if (l->staging)
+		l->staging->busy = 0;
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	free(l);
+}
+
+static void
+screenshooter_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
+
+	l->buffer = NULL;
+}
+
+static void
+screenshooter_deliver(void *data)
+{
+	struct screenshooter_frame_listener *l = data;
+
+	if (l->buffer == NULL) {
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
+
+	copy_pixels(l->format, l->yflip,
+		    wl_shm_buffer_get_data(l->buffer),
+		    wl_shm_buffer_get_stride(l->buffer),
+		    l->staging->data, l->width, l->height);
+
+	screenshooter_send_done(l->resource);
+	screenshooter_frame_listener_destroy(l);
+}
+
+static struct screenshooter_staging *
+screenshooter_get_staging(struct screenshooter_frame_listener *l, size_t size)
+{
+	struct screenshooter *shooter = l->shooter;
+	struct screenshooter_staging *staging;
+	uint8_t *data;
+	int i;
+
+	for (i = 0; i < (int) ARRAY_LENGTH(shooter->staging); i++) {
+		staging = &shooter->staging[i];
+		if (staging->busy)
+			continue;
+
+		if (staging->size < size) {
+			data = realloc(staging->data, size);
+			if (data == NULL)
+				return NULL;
+			staging->data = data;
+			staging->size = size;
+		}
+
+		staging->busy = 1;
+		return staging;
+	}
+
+	/* Both staging buffers are still waiting to be delivered, fall
+	 * back to a private allocation. */
+	l->private_staging.data = malloc(size);
+	if (l->private_staging.data == NULL)
+		return NULL;
+	l->private_staging.size = size;
+
+	return &l->private_staging;
+}
+
 static void
 screenshooter_frame_notify(struct wl_listener *listener, void *data)
 {
@@ -119,69 +285,77 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 			     struct screenshooter_frame_listener, listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	struct wl_event_loop *loop;
+	struct wl_event_source *idle;
+	int32_t stride, y;
 
 	output->disable_planes--;
 	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
 
-	if (pixels == NULL) {
-		wl_resource_post_no_memory(l->resource);
-		free(l);
+	if (l->buffer == NULL) {
+		screenshooter_frame_listener_destroy(l);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current->width,
-			     output->current->height);
-
-	stride = wl_shm_buffer_get_stride(l->buffer);
-
-	d = wl_shm_buffer_get_data(l->buffer);
-	s = pixels + stride * (l->buffer->height - 1);
-
-	switch (compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current->height, stride);
-		else
-			copy_bgra(d, pixels, output->current->height, stride);
-		break;
-	case PIXMAN_x8b8g8r8:
-	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current->height, stride);
-		else
-			copy_rgba(d, pixels, output->current->height, stride);
-		break;
-	default:
-		break;
+	stride = l->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+	l->staging = screenshooter_get_staging(l, stride * l->height);
+	if (l->staging == NULL) {
+		wl_resource_post_no_memory(l->resource);
+		screenshooter_frame_listener_destroy(l);
+		return;
 	}
 
-	screenshooter_send_done(l->resource);
-	free(pixels);
-	free(l);
+	l->format = compositor->read_format;
+	l->yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	if (l->yflip)
+		y = output->current->height - (l->y + l->height);
+	else
+		y = l->y;
+
+	compositor->renderer->read_pixels(output,
+			     compositor->read_format, l->staging->data,
+			     l->x, y, l->width, l->height);
+
+	/* The readback above is synchronous. Only the copy into the
+	 * client buffer moves to an idle callback, later in the same
+	 * loop iteration, so it doesn't hold up the rest of the frame
+	 * signal. */
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	idle = wl_event_loop_add_idle(loop, screenshooter_deliver, l);
+	if (idle == NULL)
+		screenshooter_deliver(l);
 }
 
 static void
-screenshooter_shoot(struct wl_client *client,
-		    struct wl_resource *resource,
-		    struct wl_resource *output_resource,
-		    struct wl_resource *buffer_resource)
+screenshooter_shoot_rect(struct wl_resource *resource,
+			 struct weston_output *output,
+			 struct wl_buffer *buffer,
+			 int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	struct weston_output *output = output_resource->data;
 	struct screenshooter_frame_listener *l;
-	struct wl_buffer *buffer = buffer_resource->data;
+	int64_t x1, y1, x2, y2;
 
 	if (!wl_buffer_is_shm(buffer))
 		return;
 
-	if (buffer->width < output->current->width ||
-	    buffer->height < output->current->height)
+	/* Clip in 64 bits, the rectangle comes straight from the client. */
+	x1 = x > 0 ? x : 0;
+	y1 = y > 0 ? y : 0;
+	x2 = (int64_t) x + width;
+	y2 = (int64_t) y + height;
+	if (x2 > output->current->width)
+		x2 = output->current->width;
+	if (y2 > output->current->height)
+		y2 = output->current->height;
+	if (x2 <= x1 || y2 <= y1)
+		return;
+
+	x = x1;
+	y = y1;
+	width = x2 - x1;
+	height = y2 - y1;
+
+	if (buffer->width < width || buffer->height < height)
 		return;
 
 	l = malloc(sizeof *l);
@@ -190,8 +364,18 @@ screenshooter_shoot(struct wl_client *client,
 		return;
 	}
 
+	l->shooter = resource->data;
 	l->buffer = buffer;
 	l->resource = resource;
+	l->staging = NULL;
+	l->x = x;
+	l->y = y;
+	l->width = width;
+	l->height = height;
+
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroyed;
+	wl_signal_add(&buffer->resource.destroy_signal,
+		      &l->buffer_destroy_listener);
 
 	l->listener.notify = screenshooter_frame_notify;
 	wl_signal_add(&output->frame_signal, &l->listener);
@@ -199,8 +383,42 @@ screenshooter_shoot(struct wl_client *client,
 	weston_output_schedule_repaint(output);
 }
 
+static void
+screenshooter_shoot(struct wl_client *client,
+		    struct wl_resource *resource,
+		    struct wl_resource *output_resource,
+		    struct wl_resource *buffer_resource)
+{
+	struct weston_output *output = output_resource->data;
+	struct wl_buffer *buffer = buffer_resource->data;
+
+	if (buffer->width < output->current->width ||
+	    buffer->height < output->current->height)
+		return;
+
+	screenshooter_shoot_rect(resource, output, buffer, 0, 0,
+				 output->current->width,
+				 output->current->height);
+}
+
+static void
+screenshooter_shoot_region(struct wl_client *client,
+			   struct wl_resource *resource,
+			   struct wl_resource *output_resource,
+			   struct wl_resource *buffer_resource,
+			   int32_t x, int32_t y,
+			   int32_t width, int32_t height)
+{
+	struct weston_output *output = output_resource->data;
+	struct wl_buffer *buffer = buffer_resource->data;
+
+	screenshooter_shoot_rect(resource, output, buffer,
+				 x, y, width, height);
+}
+
 struct screenshooter_interface screenshooter_implementation = {
-	screenshooter_shoot
+	screenshooter_shoot,
+	screenshooter_shoot_region
 };
 
 static void
@@ -543,6 +761,379 @@ recorder_binding(struct weston_seat *seat, uint32_t time, uint32_t key, void *da
 	}
 }
 
+struct screencast_buffer {
+	struct wl_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+	struct wl_list link;
+	/* The part of the buffer that is out of date. */
+	pixman_region32_t damage;
+	/* Handed to the client and not yet attached again. */
+	int busy;
+};
+
+struct weston_screencast {
+	struct wl_resource *resource;
+	struct weston_output *output;
+	struct wl_listener frame_listener;
+	struct wl_listener output_destroy_listener;
+	struct wl_list buffer_list;
+	/* Damage since the last ready event, as reported to the client. */
+	pixman_region32_t damage;
+	/* The output mode tmp and the pool are sized for. */
+	int32_t width, height;
+	uint32_t *tmp;
+	int frame_requested;
+};
+
+static void
+screencast_buffer_destroy(struct screencast_buffer *cb)
+{
+	wl_list_remove(&cb->buffer_destroy_listener.link);
+	wl_list_remove(&cb->link);
+	pixman_region32_fini(&cb->damage);
+	free(cb);
+}
+
+static void
+screencast_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+	struct screencast_buffer *cb =
+		container_of(listener, struct screencast_buffer,
+			     buffer_destroy_listener);
+
+	screencast_buffer_destroy(cb);
+}
+
+static void
+screencast_stop(struct weston_screencast *cast)
+{
+	if (cast->output == NULL)
+		return;
+
+	wl_list_remove(&cast->frame_listener.link);
+	wl_list_remove(&cast->output_destroy_listener.link);
+	cast->output->disable_planes--;
+	cast->output = NULL;
+}
+
+static void
+screencast_deliver(struct weston_screencast *cast, struct screencast_buffer *cb)
+{
+	struct weston_output *output = cast->output;
+	struct weston_compositor *compositor = output->compositor;
+	pixman_box32_t *r;
+	uint8_t *data;
+	int32_t stride, width, height, y;
+	int i, n, yflip;
+
+	yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	data = wl_shm_buffer_get_data(cb->buffer);
+	stride = wl_shm_buffer_get_stride(cb->buffer);
+
+	/* Never read past tmp or write past the client buffer. */
+	pixman_region32_intersect_rect(&cb->damage, &cb->damage, 0, 0,
+				       cast->width, cast->height);
+	pixman_region32_intersect_rect(&cb->damage, &cb->damage, 0, 0,
+				       cb->buffer->width, cb->buffer->height);
+
+	/* Bring the buffer up to date, which may be more than what
+	 * changed since the last frame if it has been out of the pool
+	 * for a while. */
+	r = pixman_region32_rectangles(&cb->damage, &n);
+	for (i = 0; i < n; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+		if (yflip)
+			y = output->current->height - r[i].y2;
+		else
+			y = r[i].y1;
+
+		compositor->renderer->read_pixels(output,
+				compositor->read_format, cast->tmp,
+				r[i].x1, y, width, height);
+		copy_pixels(compositor->read_format, yflip,
+			    data + r[i].y1 * stride + r[i].x1 * 4, stride,
+			    (uint8_t *) cast->tmp, width, height);
+	}
+
+	r = pixman_region32_rectangles(&cast->damage, &n);
+	for (i = 0; i < n; i++)
+		screencast_send_damage(cast->resource,
+				       r[i].x1, r[i].y1,
+				       r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+	screencast_send_ready(cast->resource, &cb->buffer->resource,
+			      output->frame_time);
+
+	pixman_region32_clear(&cast->damage);
+	pixman_region32_clear(&cb->damage);
+	cb->busy = 1;
+	cast->frame_requested = 0;
+}
+
+static int
+box_area(pixman_box32_t *box)
+{
+	return (box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+/* The pool was filled for the old mode: buffers too small for the new
+ * one are dropped, the rest need every pixel again. */
+static int
+screencast_mode_changed(struct weston_screencast *cast)
+{
+	struct weston_mode *mode = cast->output->current;
+	struct screencast_buffer *cb, *next;
+	uint32_t *tmp;
+
+	tmp = realloc(cast->tmp, mode->width * mode->height * 4);
+	if (tmp == NULL) {
+		wl_resource_post_no_memory(cast->resource);
+		screencast_stop(cast);
+		return -1;
+	}
+
+	cast->tmp = tmp;
+	cast->width = mode->width;
+	cast->height = mode->height;
+
+	/* Busy buffers are dropped when the client attaches them again. */
+	wl_list_for_each_safe(cb, next, &cast->buffer_list, link) {
+		if (!cb->busy && (cb->buffer->width < mode->width ||
+				  cb->buffer->height < mode->height)) {
+			screencast_buffer_destroy(cb);
+		} else {
+			pixman_region32_fini(&cb->damage);
+			pixman_region32_init_rect(&cb->damage, 0, 0,
+						  mode->width, mode->height);
+		}
+	}
+
+	pixman_region32_fini(&cast->damage);
+	pixman_region32_init_rect(&cast->damage, 0, 0,
+				  mode->width, mode->height);
+
+	screencast_send_size(cast->resource, mode->width, mode->height);
+
+	return 0;
+}
+
+static void
+screencast_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct weston_screencast *cast =
+		container_of(listener, struct weston_screencast,
+			     frame_listener);
+	struct weston_output *output = data;
+	struct screencast_buffer *cb, *best;
+	pixman_region32_t damage;
+	pixman_box32_t *r;
+	int i, n, area, best_area = 0;
+
+	if ((output->current->width != cast->width ||
+	     output->current->height != cast->height) &&
+	    screencast_mode_changed(cast) < 0)
+		return;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &output->region,
+				  &output->previous_damage);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+
+	r = pixman_region32_rectangles(&damage, &n);
+	for (i = 0; i < n; i++) {
+		transform_rect(output, &r[i]);
+		pixman_region32_union_rect(&cast->damage, &cast->damage,
+					   r[i].x1, r[i].y1,
+					   r[i].x2 - r[i].x1,
+					   r[i].y2 - r[i].y1);
+	}
+	pixman_region32_fini(&damage);
+
+	wl_list_for_each(cb, &cast->buffer_list, link)
+		pixman_region32_union(&cb->damage, &cb->damage, &cast->damage);
+
+	if (!cast->frame_requested || !pixman_region32_not_empty(&cast->damage))
+		return;
+
+	/* Pick the free buffer that needs the least copying. */
+	best = NULL;
+	wl_list_for_each(cb, &cast->buffer_list, link) {
+		if (cb->busy)
+			continue;
+		area = box_area(pixman_region32_extents(&cb->damage));
+		if (best == NULL || area < best_area) {
+			best = cb;
+			best_area = area;
+		}
+	}
+
+	if (best)
+		screencast_deliver(cast, best);
+}
+
+static void
+screencast_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct weston_screencast *cast =
+		container_of(listener, struct weston_screencast,
+			     output_destroy_listener);
+
+	screencast_stop(cast);
+}
+
+static void
+screencast_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+screencast_attach_buffer(struct wl_client *client,
+			 struct wl_resource *resource,
+			 struct wl_resource *buffer_resource)
+{
+	struct weston_screencast *cast = resource->data;
+	struct wl_buffer *buffer = buffer_resource->data;
+	struct screencast_buffer *cb;
+
+	if (cast->output == NULL)
+		return;
+
+	wl_list_for_each(cb, &cast->buffer_list, link) {
+		if (cb->buffer == buffer) {
+			/* Too small since a mode change, it just leaves
+			 * the pool; the client was sent the new size. */
+			if (buffer->width < cast->width ||
+			    buffer->height < cast->height) {
+				screencast_buffer_destroy(cb);
+				return;
+			}
+			cb->busy = 0;
+			if (cast->frame_requested)
+				weston_output_schedule_repaint(cast->output);
+			return;
+		}
+	}
+
+	if (!wl_buffer_is_shm(buffer) ||
+	    (wl_shm_buffer_get_format(buffer) != WL_SHM_FORMAT_ARGB8888 &&
+	     wl_shm_buffer_get_format(buffer) != WL_SHM_FORMAT_XRGB8888) ||
+	    wl_shm_buffer_get_stride(buffer) < buffer->width * 4 ||
+	    buffer->width < cast->width ||
+	    buffer->height < cast->height) {
+		wl_resource_post_error(resource,
+				       SCREENCAST_ERROR_INVALID_BUFFER,
+				       "invalid screencast buffer");
+		return;
+	}
+
+	cb = malloc(sizeof *cb);
+	if (cb == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	cb->buffer = buffer;
+	cb->busy = 0;
+	pixman_region32_init_rect(&cb->damage, 0, 0,
+				  cast->width, cast->height);
+	cb->buffer_destroy_listener.notify = screencast_buffer_destroyed;
+	wl_signal_add(&buffer->resource.destroy_signal,
+		      &cb->buffer_destroy_listener);
+	wl_list_insert(cast->buffer_list.prev, &cb->link);
+
+	if (cast->frame_requested)
+		weston_output_schedule_repaint(cast->output);
+}
+
+static void
+screencast_frame(struct wl_client *client, struct wl_resource *resource)
+{
+	struct weston_screencast *cast = resource->data;
+
+	if (cast->output == NULL)
+		return;
+
+	cast->frame_requested = 1;
+	if (pixman_region32_not_empty(&cast->damage))
+		weston_output_schedule_repaint(cast->output);
+}
+
+static const struct screencast_interface screencast_implementation = {
+	screencast_destroy,
+	screencast_attach_buffer,
+	screencast_frame
+};
+
+static void
+destroy_screencast(struct wl_resource *resource)
+{
+	struct weston_screencast *cast = resource->data;
+	struct screencast_buffer *cb, *next;
+
+	screencast_stop(cast);
+	wl_list_for_each_safe(cb, next, &cast->buffer_list, link)
+		screencast_buffer_destroy(cb);
+	pixman_region32_fini(&cast->damage);
+	free(cast->tmp);
+	free(cast);
+}
+
+static void
+screencaster_capture(struct wl_client *client,
+		     struct wl_resource *resource, uint32_t id,
+		     struct wl_resource *output_resource)
+{
+	struct weston_output *output = output_resource->data;
+	struct weston_screencast *cast;
+
+	cast = calloc(1, sizeof *cast);
+	if (cast == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	cast->tmp = malloc(output->current->width *
+			   output->current->height * 4);
+	if (cast->tmp == NULL) {
+		free(cast);
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	cast->resource = wl_client_add_object(client, &screencast_interface,
+					      &screencast_implementation,
+					      id, cast);
+	cast->resource->destroy = destroy_screencast;
+
+	cast->output = output;
+	cast->width = output->current->width;
+	cast->height = output->current->height;
+	wl_list_init(&cast->buffer_list);
+	pixman_region32_init(&cast->damage);
+
+	screencast_send_size(cast->resource, cast->width, cast->height);
+
+	cast->frame_listener.notify = screencast_frame_notify;
+	wl_signal_add(&output->frame_signal, &cast->frame_listener);
+	cast->output_destroy_listener.notify = screencast_output_destroyed;
+	wl_signal_add(&output->destroy_signal,
+		      &cast->output_destroy_listener);
+	output->disable_planes++;
+}
+
+static const struct screencaster_interface screencaster_implementation = {
+	screencaster_capture
+};
+
+static void
+bind_screencaster(struct wl_client *client,
+		  void *data, uint32_t version, uint32_t id)
+{
+	wl_client_add_object(client, &screencaster_interface,
+			     &screencaster_implementation, id, data);
+}
+
 static void
 screenshooter_destroy(struct wl_listener *listener, void *data)
 {
@@ -550,6 +1141,11 @@ screenshooter_destroy(struct wl_listener *listener, void *data)
 		container_of(listener, struct screenshooter, destroy_listener);
 
 	wl_display_remove_global(shooter->ec->wl_display, shooter->global);
+	if (shooter->screencaster_global)
+		wl_display_remove_global(shooter->ec->wl_display,
+					 shooter->screencaster_global);
+	free(shooter->staging[0].data);
+	free(shooter->staging[1].data);
 	free(shooter);
 }
 
@@ -557,6 +1153,8 @@ void
 screenshooter_create(struct weston_compositor *ec)
 {
 	struct screenshooter *shooter;
+	struct weston_config_section *section;
+	int enable_screencast;
 
 	shooter = malloc(sizeof *shooter);
 	if (shooter == NULL)
@@ -567,10 +1165,23 @@ screenshooter_create(struct weston_compositor *ec)
 		(void(**)(void)) &screenshooter_implementation;
 	shooter->ec = ec;
 	shooter->client = NULL;
+	memset(shooter->staging, 0, sizeof shooter->staging);
 
 	shooter->global = wl_display_add_global(ec->wl_display,
 						&screenshooter_interface,
 						shooter, bind_shooter);
+
+	/* Any client can bind the screencaster, so it's opt-in. */
+	section = weston_config_get_section(ec->config,
+					    "screencast", NULL, NULL);
+	weston_config_section_get_bool(section, "enable",
+				       &enable_screencast, 0);
+	shooter->screencaster_global = NULL;
+	if (enable_screencast)
+		shooter->screencaster_global =
+			wl_display_add_global(ec->wl_display,
+					      &screencaster_interface,
+					      shooter, bind_screencaster);
 	weston_compositor_add_key_binding(ec, KEY_S, MODIFIER_SUPER,
 					  screenshooter_binding, shooter);
 	weston_compositor_add_key_binding(ec, KEY_R, MODIFIER_SUPER,
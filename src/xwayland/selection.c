@@ -26,9 +26,45 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
 
 #include "xwayland.h"
 
+/* Upper bound for INCR chunks, below the maximum request length. */
+#define SELECTION_CHUNK_MAX (256 * 1024)
+
+static void
+weston_wm_selection_stats_start(struct weston_wm *wm)
+{
+	wm->selection_stats.bytes = 0;
+	wm->selection_stats.chunks = 0;
+	wm->selection_stats.start = weston_compositor_get_time();
+}
+
+static void
+weston_wm_selection_stats_log(struct weston_wm *wm, const char *direction)
+{
+	uint32_t msecs;
+
+	msecs = weston_compositor_get_time() - wm->selection_stats.start;
+	weston_log("%s transfer complete: %" PRIu64 " bytes, "
+		   "%u chunks in %u ms (%.1f MB/s)\n",
+		   direction, wm->selection_stats.bytes,
+		   wm->selection_stats.chunks, msecs,
+		   msecs ? wm->selection_stats.bytes / (msecs * 1000.0) : 0.0);
+}
+
+/* Let a whole chunk sit in the pipe, so it moves in a few syscalls
+ * rather than one per page. */
+static void
+weston_wm_grow_pipe(struct weston_wm *wm, int fd)
+{
+#ifdef F_SETPIPE_SZ
+	fcntl(fd, F_SETPIPE_SZ, wm->selection_chunk_size);
+#endif
+}
+
 static int
 weston_wm_write_property(int fd, uint32_t mask, void *data)
 {
@@ -41,6 +77,8 @@ weston_wm_write_property(int fd, uint32_t mask, void *data)
 		wm->property_start;
 
 	len = write(fd, property + wm->property_start, remainder);
+	if (len == -1 && errno == EAGAIN)
+		return 1;
 	if (len == -1) {
 		free(wm->property_reply);
 		wl_event_source_remove(wm->property_source);
@@ -49,10 +87,7 @@ weston_wm_write_property(int fd, uint32_t mask, void *data)
 		return 1;
 	}
 
-	weston_log("wrote %d (chunk size %d) of %d bytes\n",
-		wm->property_start + len,
-		len, xcb_get_property_value_length(wm->property_reply));
-
+	wm->selection_stats.bytes += len;
 	wm->property_start += len;
 	if (len == remainder) {
 		free(wm->property_reply);
@@ -62,8 +97,9 @@ weston_wm_write_property(int fd, uint32_t mask, void *data)
 			xcb_delete_property(wm->conn,
 					    wm->selection_window,
 					    wm->atom.wl_selection);
+			xcb_flush(wm->conn);
 		} else {
-			weston_log("transfer complete\n");
+			weston_wm_selection_stats_log(wm, "X to wayland");
 			close(fd);
 		}
 	}
@@ -86,10 +122,11 @@ weston_wm_get_incr_chunk(struct weston_wm *wm)
 				  0x1fffffff /* length */);
 
 	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
-
-	dump_property(wm, wm->atom.wl_selection, reply);
+	if (reply == NULL)
+		return;
 
 	if (xcb_get_property_value_length(reply) > 0) {
+		wm->selection_stats.chunks++;
 		wm->property_start = 0;
 		wm->property_source =
 			wl_event_loop_add_fd(wm->server->loop,
@@ -99,7 +136,7 @@ weston_wm_get_incr_chunk(struct weston_wm *wm)
 					     wm);
 		wm->property_reply = reply;
 	} else {
-		weston_log("transfer complete\n");
+		weston_wm_selection_stats_log(wm, "X to wayland");
 		close(wm->data_source_fd);
 		free(reply);
 	}
@@ -136,6 +173,8 @@ data_source_send(struct wl_data_source *base,
 
 		fcntl(fd, F_SETFL, O_WRONLY | O_NONBLOCK);
 		wm->data_source_fd = fcntl(fd, F_DUPFD_CLOEXEC, fd);
+		weston_wm_grow_pipe(wm, wm->data_source_fd);
+		weston_wm_selection_stats_start(wm);
 	}
 }
 
@@ -224,6 +263,7 @@ weston_wm_get_selection_data(struct weston_wm *wm)
 	} else {
 		dump_property(wm, wm->atom.wl_selection, reply);
 		wm->incr = 0;
+		wm->selection_stats.chunks = 1;
 		wm->property_start = 0;
 		wm->property_source =
 			wl_event_loop_add_fd(wm->server->loop,
@@ -251,8 +291,6 @@ weston_wm_handle_selection_notify(struct weston_wm *wm,
 	}
 }
 
-static const size_t incr_chunk_size = 64 * 1024;
-
 static void
 weston_wm_send_selection_notify(struct weston_wm *wm, xcb_atom_t property)
 {
@@ -309,10 +347,53 @@ weston_wm_send_timestamp(struct weston_wm *wm)
 	weston_wm_send_selection_notify(wm, wm->selection_request.property);
 }
 
+static void
+weston_wm_close_data_source(struct weston_wm *wm)
+{
+	if (wm->property_source)
+		wl_event_source_remove(wm->property_source);
+	wm->property_source = NULL;
+	close(wm->data_source_fd);
+	wm->data_source_fd = -1;
+}
+
+static void
+weston_wm_release_source_ring(struct weston_wm *wm)
+{
+	free(wm->source_ring.data);
+	wm->source_ring.data = NULL;
+	wm->source_ring.count = 0;
+}
+
+/* The oldest chunk can go out once it is full, or when the source is
+ * done; an empty ring at that point gives the zero sized end marker. */
+static int
+weston_wm_source_chunk_ready(struct weston_wm *wm)
+{
+	struct weston_wm_chunk_ring *ring = &wm->source_ring;
+
+	if (wm->data_source_fd < 0)
+		return 1;
+
+	return ring->count > 1 ||
+		(ring->count == 1 &&
+		 ring->size[ring->head] == wm->selection_chunk_size);
+}
+
+static int
+weston_wm_read_data_source(int fd, uint32_t mask, void *data);
+
 static int
 weston_wm_flush_source_data(struct weston_wm *wm)
 {
-	int length;
+	struct weston_wm_chunk_ring *ring = &wm->source_ring;
+	uint32_t length = 0;
+	char *p = NULL;
+
+	if (ring->count > 0) {
+		length = ring->size[ring->head];
+		p = ring->data + ring->head * wm->selection_chunk_size;
+	}
 
 	xcb_change_property(wm->conn,
 			    XCB_PROP_MODE_REPLACE,
@@ -320,11 +401,27 @@ weston_wm_flush_source_data(struct weston_wm *wm)
 			    wm->selection_request.property,
 			    wm->selection_target,
 			    8, /* format */
-			    wm->source_data.size,
-			    wm->source_data.data);
+			    length, p);
 	wm->selection_property_set = 1;
-	length = wm->source_data.size;
-	wm->source_data.size = 0;
+	wm->selection_stats.chunks++;
+
+	if (ring->count > 0) {
+		ring->head = (ring->head + 1) % SELECTION_RING_CHUNKS;
+		ring->count--;
+	}
+
+	/* Nothing more to send after a zero sized chunk */
+	if (length == 0)
+		weston_wm_release_source_ring(wm);
+
+	/* Room in the ring again, pick up reading where it stopped */
+	if (wm->data_source_fd >= 0 && wm->property_source == NULL)
+		wm->property_source =
+			wl_event_loop_add_fd(wm->server->loop,
+					     wm->data_source_fd,
+					     WL_EVENT_READABLE,
+					     weston_wm_read_data_source,
+					     wm);
 
 	return length;
 }
@@ -333,33 +430,50 @@ static int
 weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 {
 	struct weston_wm *wm = data;
-	int len, current, available;
-	void *p;
-
-	current = wm->source_data.size;
-	if (wm->source_data.size < incr_chunk_size)
-		p = wl_array_add(&wm->source_data, incr_chunk_size);
-	else
-		p = (char *) wm->source_data.data + wm->source_data.size;
-	available = wm->source_data.alloc - current;
+	struct weston_wm_chunk_ring *ring = &wm->source_ring;
+	uint32_t chunk_size = wm->selection_chunk_size;
+	int len, tail;
+	char *p;
+
+	tail = (ring->head + ring->count - 1) % SELECTION_RING_CHUNKS;
+	if (ring->count == 0 || ring->size[tail] == chunk_size) {
+		tail = (ring->head + ring->count) % SELECTION_RING_CHUNKS;
+		ring->size[tail] = 0;
+		ring->count++;
+	}
 
-	len = read(fd, p, available);
+	p = ring->data + tail * chunk_size + ring->size[tail];
+	len = read(fd, p, chunk_size - ring->size[tail]);
+	if (len == -1 && errno == EAGAIN)
+		return 1;
 	if (len == -1) {
 		weston_log("read error from data source: %m\n");
 		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
-		wl_event_source_remove(wm->property_source);
-		close(fd);
-		wl_array_release(&wm->source_data);
+		weston_wm_close_data_source(wm);
+		weston_wm_release_source_ring(wm);
+		wm->selection_request.requestor = XCB_NONE;
+		return 1;
 	}
 
-	weston_log("read %d (available %d, mask 0x%x) bytes: \"%.*s\"\n",
-		len, available, mask, len, (char *) p);
+	ring->size[tail] += len;
+	wm->selection_stats.bytes += len;
 
-	wm->source_data.size = current + len;
-	if (wm->source_data.size >= incr_chunk_size) {
+	if (len == 0) {
+		weston_wm_close_data_source(wm);
+		if (!wm->incr) {
+			/* Non-incr transfer all done. */
+			weston_wm_flush_source_data(wm);
+			weston_wm_send_selection_notify(wm, wm->selection_request.property);
+			weston_wm_release_source_ring(wm);
+			wm->selection_request.requestor = XCB_NONE;
+			weston_wm_selection_stats_log(wm, "wayland to X");
+		} else if (!wm->selection_property_set) {
+			weston_wm_flush_source_data(wm);
+		}
+		xcb_flush(wm->conn);
+	} else if (ring->size[tail] == chunk_size) {
 		if (!wm->incr) {
-			weston_log("got %zu bytes, starting incr\n",
-				wm->source_data.size);
+			weston_log("got %u bytes, starting incr\n", chunk_size);
 			wm->incr = 1;
 			xcb_change_property(wm->conn,
 					    XCB_PROP_MODE_REPLACE,
@@ -367,53 +481,20 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 					    wm->selection_request.property,
 					    wm->atom.incr,
 					    32, /* format */
-					    1, &incr_chunk_size);
+					    1, &chunk_size);
 			wm->selection_property_set = 1;
-			wm->flush_property_on_delete = 1;
-			wl_event_source_remove(wm->property_source);
 			weston_wm_send_selection_notify(wm, wm->selection_request.property);
-		} else if (wm->selection_property_set) {
-			weston_log("got %zu bytes, waiting for "
-				"property delete\n", wm->source_data.size);
-
-			wm->flush_property_on_delete = 1;
-			wl_event_source_remove(wm->property_source);
-		} else {
-			weston_log("got %zu bytes, "
-				"property deleted, seting new property\n",
-				wm->source_data.size);
+		} else if (!wm->selection_property_set) {
 			weston_wm_flush_source_data(wm);
 		}
-	} else if (len == 0 && !wm->incr) {
-		weston_log("non-incr transfer complete\n");
-		/* Non-incr transfer all done. */
-		weston_wm_flush_source_data(wm);
-		weston_wm_send_selection_notify(wm, wm->selection_request.property);
-		xcb_flush(wm->conn);
-		wl_event_source_remove(wm->property_source);
-		close(fd);
-		wl_array_release(&wm->source_data);
-		wm->selection_request.requestor = XCB_NONE;
-	} else if (len == 0 && wm->incr) {
-		weston_log("incr transfer complete\n");
 
-		wm->flush_property_on_delete = 1;
-		if (wm->selection_property_set) {
-			weston_log("got %zu bytes, waiting for "
-				"property delete\n", wm->source_data.size);
-		} else {
-			weston_log("got %zu bytes, "
-				"property deleted, seting new property\n",
-				wm->source_data.size);
-			weston_wm_flush_source_data(wm);
+		/* The ring is full, wait for the X client to catch up */
+		if (ring->count == SELECTION_RING_CHUNKS &&
+		    ring->size[tail] == chunk_size) {
+			wl_event_source_remove(wm->property_source);
+			wm->property_source = NULL;
 		}
 		xcb_flush(wm->conn);
-		wl_event_source_remove(wm->property_source);
-		close(wm->data_source_fd);
-		wm->data_source_fd = -1;
-		close(fd);
-	} else {
-		weston_log("nothing happened, buffered the bytes\n");
 	}
 
 	return 1;
@@ -432,7 +513,22 @@ weston_wm_send_data(struct weston_wm *wm, xcb_atom_t target, const char *mime_ty
 		return;
 	}
 
-	wl_array_init(&wm->source_data);
+	free(wm->source_ring.data);
+	wm->source_ring.data = malloc(SELECTION_RING_CHUNKS *
+				      wm->selection_chunk_size);
+	if (wm->source_ring.data == NULL) {
+		weston_log("failed to allocate selection buffer\n");
+		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
+		close(p[0]);
+		close(p[1]);
+		return;
+	}
+	wm->source_ring.head = 0;
+	wm->source_ring.count = 0;
+
+	weston_wm_selection_stats_start(wm);
+	weston_wm_grow_pipe(wm, p[0]);
+
 	wm->selection_target = target;
 	wm->data_source_fd = p[0];
 	wm->property_source = wl_event_loop_add_fd(wm->server->loop,
@@ -448,35 +544,20 @@ weston_wm_send_data(struct weston_wm *wm, xcb_atom_t target, const char *mime_ty
 static void
 weston_wm_send_incr_chunk(struct weston_wm *wm)
 {
-	int length;
-
-	weston_log("property deleted\n");
-
 	wm->selection_property_set = 0;
-	if (wm->flush_property_on_delete) {
-		weston_log("setting new property, %zu bytes\n",
-			wm->source_data.size);
-		wm->flush_property_on_delete = 0;
-		length = weston_wm_flush_source_data(wm);
-
-		if (wm->data_source_fd >= 0) {
-			wm->property_source =
-				wl_event_loop_add_fd(wm->server->loop,
-						     wm->data_source_fd,
-						     WL_EVENT_READABLE,
-						     weston_wm_read_data_source,
-						     wm);
-		} else if (length > 0) {
-			/* Transfer is all done, but queue a flush for
-			 * the delete of the last chunk so we can set
-			 * the 0 sized propert to signal the end of
-			 * the transfer. */
-			wm->flush_property_on_delete = 1;
-			wl_array_release(&wm->source_data);
-		} else {
-			wm->selection_request.requestor = XCB_NONE;
-		}
+
+	if (wm->source_ring.data == NULL) {
+		/* The end marker was picked up */
+		wm->selection_request.requestor = XCB_NONE;
+		weston_wm_selection_stats_log(wm, "wayland to X");
+		return;
 	}
+
+	if (!weston_wm_source_chunk_ready(wm))
+		return;
+
+	weston_wm_flush_source_data(wm);
+	xcb_flush(wm->conn);
 }
 
 static int
@@ -519,7 +600,6 @@ weston_wm_handle_selection_request(struct weston_wm *wm,
 
 	wm->selection_request = *selection_request;
 	wm->incr = 0;
-	wm->flush_property_on_delete = 0;
 
 	if (selection_request->selection == wm->atom.clipboard_manager) {
 		/* The weston clipboard should already have grabbed
@@ -666,10 +746,18 @@ void
 weston_wm_selection_init(struct weston_wm *wm)
 {
 	struct weston_seat *seat;
-	uint32_t values[1], mask;
+	uint32_t values[1], mask, max_request;
 
 	wm->selection_request.requestor = XCB_NONE;
 
+	/* Make INCR chunks as large as a ChangeProperty request can carry,
+	 * leaving room for the request header. */
+	max_request = xcb_get_maximum_request_length(wm->conn) * 4;
+	if (max_request > SELECTION_CHUNK_MAX + 4096)
+		wm->selection_chunk_size = SELECTION_CHUNK_MAX;
+	else
+		wm->selection_chunk_size = (max_request - 4096) & ~4095;
+
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE;
 	wm->selection_window = xcb_generate_id(wm->conn);
 	xcb_create_window(wm->conn,
@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <xcb/xcbext.h>
 #include <X11/Xcursor/Xcursor.h>
 
 #include "xwayland.h"
@@ -99,11 +100,11 @@ struct weston_wm_window {
 	struct wl_listener surface_destroy_listener;
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
-	int properties_dirty;
 	int pid;
 	char *machine;
 	char *class;
 	char *name;
+	int has_net_wm_name;
 	struct weston_wm_window *transient_for;
 	uint32_t protocols;
 	xcb_atom_t type;
@@ -113,6 +114,11 @@ struct weston_wm_window {
 	int decorate;
 	int override_redirect;
 	int fullscreen;
+	/* what the frame window shows, so a new name only redraws the
+	 * title, and the same name nothing at all */
+	int decoration_width, decoration_height;
+	uint32_t decoration_flags;
+	char *decoration_title;
 };
 
 static struct weston_wm_window *
@@ -268,38 +274,26 @@ dump_property(struct weston_wm *wm,
 	}
 }
 
-static void
-read_and_dump_property(struct weston_wm *wm,
-		       xcb_window_t window, xcb_atom_t property)
-{
-	xcb_get_property_reply_t *reply;
-	xcb_get_property_cookie_t cookie;
-
-	cookie = xcb_get_property(wm->conn, 0, window,
-				  property, XCB_ATOM_ANY, 0, 2048);
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
-
-	dump_property(wm, property, reply);
-
-	free(reply);
-}
-
 /* We reuse some predefined, but otherwise useles atoms */
 #define TYPE_WM_PROTOCOLS	XCB_ATOM_CUT_BUFFER0
 #define TYPE_MOTIF_WM_HINTS	XCB_ATOM_CUT_BUFFER1
 #define TYPE_NET_WM_STATE	XCB_ATOM_CUT_BUFFER2
 
+struct weston_wm_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	int offset;
+};
+
+#define WM_PROPERTY_COUNT 10
+
+/* The properties cached in struct weston_wm_window. */
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_get_properties(struct weston_wm *wm,
+			 struct weston_wm_property props[WM_PROPERTY_COUNT])
 {
-	struct weston_wm *wm = window->wm;
-
 #define F(field) offsetof(struct weston_wm_window, field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		int offset;
-	} props[] = {
+	const struct weston_wm_property table[WM_PROPERTY_COUNT] = {
 		{ XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, F(class) },
 		{ XCB_ATOM_WM_NAME, XCB_ATOM_STRING, F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, F(transient_for) },
@@ -313,79 +307,225 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
-	xcb_get_property_reply_t *reply;
+	memcpy(props, table, sizeof table);
+}
+
+static const struct weston_wm_property *
+weston_wm_find_property(struct weston_wm *wm, xcb_atom_t atom,
+			struct weston_wm_property props[WM_PROPERTY_COUNT])
+{
+	int i;
+
+	weston_wm_get_properties(wm, props);
+	for (i = 0; i < WM_PROPERTY_COUNT; i++)
+		if (props[i].atom == atom)
+			return &props[i];
+
+	return NULL;
+}
+
+/* Property reads are queued in request order and their replies handled
+ * as they come in, so the compositor never waits on an X client
+ * unless it needs a window's properties right away. */
+struct weston_wm_property_request {
+	xcb_window_t window;
+	xcb_atom_t atom;
+	int dump;
+	xcb_get_property_cookie_t cookie;
+	struct wl_list link;
+};
+
+static void
+weston_wm_fetch_property(struct weston_wm *wm, xcb_window_t window,
+			 xcb_atom_t atom, int dump)
+{
+	struct weston_wm_property_request *req;
+
+	req = malloc(sizeof *req);
+	if (req == NULL)
+		return;
+
+	req->window = window;
+	req->atom = atom;
+	req->dump = dump;
+	req->cookie = xcb_get_property(wm->conn,
+				       0, /* delete */
+				       window, atom,
+				       XCB_ATOM_ANY, 0, 2048);
+	wl_list_insert(wm->property_request_list.prev, &req->link);
+}
+
+static void
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	struct weston_wm_property props[WM_PROPERTY_COUNT];
+	int i;
+
+	weston_wm_get_properties(window->wm, props);
+	for (i = 0; i < WM_PROPERTY_COUNT; i++)
+		weston_wm_fetch_property(window->wm, window->id,
+					 props[i].atom, 0);
+}
+
+static void
+weston_wm_window_set_property(struct weston_wm_window *window,
+			      const struct weston_wm_property *prop,
+			      xcb_get_property_reply_t *reply)
+{
+	struct weston_wm *wm = window->wm;
 	void *p;
 	uint32_t *xid;
 	xcb_atom_t *atom;
 	uint32_t i;
 	struct motif_wm_hints *hints;
 
-	if (!window->properties_dirty)
+	if (prop->type == TYPE_MOTIF_WM_HINTS)
+		window->decorate = !window->override_redirect;
+
+	if (!reply)
+		/* Bad window, typically */
 		return;
-	window->properties_dirty = 0;
-
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
-
-	window->decorate = !window->override_redirect;
-	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
-		if (!reply)
-			/* Bad window, typically */
-			continue;
-		if (reply->type == XCB_ATOM_NONE) {
-			/* No such property */
-			free(reply);
-			continue;
-		}
 
-		p = ((char *) window + props[i].offset);
+	if (prop->atom == wm->atom.net_wm_name)
+		window->has_net_wm_name = reply->type != XCB_ATOM_NONE;
 
-		switch (props[i].type) {
-		case XCB_ATOM_WM_CLIENT_MACHINE:
-		case XCB_ATOM_STRING:
-			/* FIXME: We're using this for both string and
-			   utf8_string */
-			if (*(char **) p)
-				free(*(char **) p);
+	if (reply->type == XCB_ATOM_NONE)
+		/* No such property */
+		return;
 
-			*(char **) p =
-				strndup(xcb_get_property_value(reply),
-					xcb_get_property_value_length(reply));
-			break;
-		case XCB_ATOM_WINDOW:
-			xid = xcb_get_property_value(reply);
-			*(struct weston_wm_window **) p =
-				hash_table_lookup(wm->window_hash, *xid);
-			break;
-		case XCB_ATOM_CARDINAL:
-		case XCB_ATOM_ATOM:
-			atom = xcb_get_property_value(reply);
-			*(xcb_atom_t *) p = *atom;
-			break;
-		case TYPE_WM_PROTOCOLS:
-			break;
-		case TYPE_NET_WM_STATE:
-			window->fullscreen = 0;
-			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
-					window->fullscreen = 1;
-			break;
-		case TYPE_MOTIF_WM_HINTS:
-			hints = xcb_get_property_value(reply);
-			if (hints->flags & MWM_HINTS_DECORATIONS)
-				window->decorate = hints->decorations > 0;
-			break;
-		default:
+	/* _NET_WM_NAME takes precedence over WM_NAME */
+	if (prop->atom == XCB_ATOM_WM_NAME && window->has_net_wm_name)
+		return;
+
+	p = ((char *) window + prop->offset);
+
+	switch (prop->type) {
+	case XCB_ATOM_WM_CLIENT_MACHINE:
+	case XCB_ATOM_STRING:
+		/* FIXME: We're using this for both string and
+		   utf8_string */
+		if (*(char **) p)
+			free(*(char **) p);
+
+		*(char **) p =
+			strndup(xcb_get_property_value(reply),
+				xcb_get_property_value_length(reply));
+		break;
+	case XCB_ATOM_WINDOW:
+		xid = xcb_get_property_value(reply);
+		*(struct weston_wm_window **) p =
+			hash_table_lookup(wm->window_hash, *xid);
+		break;
+	case XCB_ATOM_CARDINAL:
+	case XCB_ATOM_ATOM:
+		atom = xcb_get_property_value(reply);
+		*(xcb_atom_t *) p = *atom;
+		break;
+	case TYPE_WM_PROTOCOLS:
+		break;
+	case TYPE_NET_WM_STATE:
+		window->fullscreen = 0;
+		atom = xcb_get_property_value(reply);
+		for (i = 0; i < reply->value_len; i++)
+			if (atom[i] == wm->atom.net_wm_state_fullscreen)
+				window->fullscreen = 1;
+		break;
+	case TYPE_MOTIF_WM_HINTS:
+		hints = xcb_get_property_value(reply);
+		if (hints->flags & MWM_HINTS_DECORATIONS)
+			window->decorate = hints->decorations > 0;
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+weston_wm_handle_property_reply(struct weston_wm *wm,
+				struct weston_wm_property_request *req,
+				xcb_get_property_reply_t *reply)
+{
+	struct weston_wm_property props[WM_PROPERTY_COUNT];
+	const struct weston_wm_property *prop;
+	struct weston_wm_window *window;
+
+	window = hash_table_lookup(wm->window_hash, req->window);
+	if (window && req->dump && reply) {
+		weston_log("XCB_PROPERTY_NOTIFY: window %d, ", req->window);
+		dump_property(wm, req->atom, reply);
+	}
+
+	prop = weston_wm_find_property(wm, req->atom, props);
+	if (window && prop) {
+		weston_wm_window_set_property(window, prop, reply);
+
+		if (req->atom == wm->atom.net_wm_name ||
+		    req->atom == XCB_ATOM_WM_NAME)
+			weston_wm_window_schedule_repaint(window);
+	}
+
+	wl_list_remove(&req->link);
+	free(req);
+	free(reply);
+}
+
+/* Handle the property replies that have arrived, in request order. */
+static void
+weston_wm_poll_property_replies(struct weston_wm *wm)
+{
+	struct weston_wm_property_request *req, *next;
+	void *reply;
+
+	wl_list_for_each_safe(req, next, &wm->property_request_list, link) {
+		if (!xcb_poll_for_reply(wm->conn, req->cookie.sequence,
+					&reply, NULL))
 			break;
+
+		weston_wm_handle_property_reply(wm, req, reply);
+	}
+}
+
+/* Wait for the property reads still in flight for the window, for
+ * when its properties are needed right away.  Waiting reads everything
+ * the X server sent so far off the socket, which leaves the fd idle, so
+ * the replies for other windows that came along are handled here too
+ * rather than waiting for the next X event. */
+static void
+weston_wm_window_read_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_wm_property_request *req, *next, *last = NULL;
+	xcb_get_property_reply_t *reply;
+	int done;
+
+	wl_list_for_each(req, &wm->property_request_list, link)
+		if (req->window == window->id)
+			last = req;
+
+	if (last != NULL) {
+		wl_list_for_each_safe(req, next,
+				      &wm->property_request_list, link) {
+			reply = xcb_get_property_reply(wm->conn,
+						       req->cookie, NULL);
+			done = req == last;
+			weston_wm_handle_property_reply(wm, req, reply);
+			if (done)
+				break;
 		}
-		free(reply);
+	}
+
+	weston_wm_poll_property_replies(wm);
+}
+
+static void
+weston_wm_destroy_property_requests(struct weston_wm *wm)
+{
+	struct weston_wm_property_request *req, *next;
+
+	wl_list_for_each_safe(req, next, &wm->property_request_list, link) {
+		xcb_discard_reply(wm->conn, req->cookie.sequence);
+		wl_list_remove(&req->link);
+		free(req);
 	}
 }
 
@@ -715,6 +855,8 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 							     window->frame_id,
 							     &wm->format_rgba,
 							     width, height);
+	window->decoration_width = 0;
+	window->decoration_height = 0;
 
 	hash_table_insert(wm->window_hash, window->frame_id, window);
 }
@@ -774,6 +916,140 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 	window->surface = NULL;
 }
 
+/* The corners of the frame template are as large as the corners of
+ * the shadow, which is offset by 2 and has 64 pixel corners; the
+ * edges of a frame are uniform between them. */
+#define FRAME_TEMPLATE_CORNER (2 + 64)
+#define FRAME_TEMPLATE_SIZE (2 * FRAME_TEMPLATE_CORNER + 1)
+
+static cairo_surface_t *
+weston_wm_get_frame_template(struct weston_wm *wm, uint32_t flags)
+{
+	int i = (flags & THEME_FRAME_ACTIVE) ? 1 : 0;
+	cairo_t *cr;
+
+	if (wm->frame_template[i])
+		return wm->frame_template[i];
+
+	wm->frame_pixmap[i] = xcb_generate_id(wm->conn);
+	xcb_create_pixmap(wm->conn, 32, wm->frame_pixmap[i], wm->screen->root,
+			  FRAME_TEMPLATE_SIZE, FRAME_TEMPLATE_SIZE);
+
+	wm->frame_template[i] =
+		cairo_xcb_surface_create_with_xrender_format(wm->conn,
+							     wm->screen,
+							     wm->frame_pixmap[i],
+							     &wm->format_rgba,
+							     FRAME_TEMPLATE_SIZE,
+							     FRAME_TEMPLATE_SIZE);
+
+	cr = cairo_create(wm->frame_template[i]);
+	theme_render_frame(wm->theme, cr,
+			   FRAME_TEMPLATE_SIZE, FRAME_TEMPLATE_SIZE, "", flags);
+	cairo_destroy(cr);
+
+	return wm->frame_template[i];
+}
+
+static void
+weston_wm_destroy_frame_templates(struct weston_wm *wm)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (!wm->frame_template[i])
+			continue;
+		cairo_surface_destroy(wm->frame_template[i]);
+		xcb_free_pixmap(wm->conn, wm->frame_pixmap[i]);
+		wm->frame_template[i] = NULL;
+	}
+}
+
+/* Compose a frame of the given size from the template, copying its
+ * corners and stretching the row and column between them, all in the
+ * X server. */
+static void
+weston_wm_compose_frame(struct weston_wm *wm, cairo_t *cr,
+			int width, int height, uint32_t flags)
+{
+	const int c = FRAME_TEMPLATE_CORNER;
+	const int src[3] = { 0, c, c + 1 }, src_size[3] = { c, 1, c };
+	int x[3], y[3], w[3], h[3];
+	cairo_pattern_t *pattern;
+	cairo_matrix_t matrix;
+	int i, j;
+
+	x[0] = 0; x[1] = c; x[2] = width - c;
+	w[0] = c; w[1] = width - 2 * c; w[2] = c;
+	y[0] = 0; y[1] = c; y[2] = height - c;
+	h[0] = c; h[1] = height - 2 * c; h[2] = c;
+
+	pattern = cairo_pattern_create_for_surface(
+		weston_wm_get_frame_template(wm, flags));
+	cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+	for (j = 0; j < 3; j++) {
+		for (i = 0; i < 3; i++) {
+			cairo_matrix_init_translate(&matrix, src[i], src[j]);
+			cairo_matrix_scale(&matrix,
+					   (double) src_size[i] / w[i],
+					   (double) src_size[j] / h[j]);
+			cairo_matrix_translate(&matrix, -x[i], -y[j]);
+			cairo_pattern_set_matrix(pattern, &matrix);
+			cairo_set_source(cr, pattern);
+			cairo_rectangle(cr, x[i], y[j], w[i], h[j]);
+			cairo_fill(cr);
+		}
+	}
+
+	cairo_pattern_destroy(pattern);
+}
+
+static void
+weston_wm_window_draw_frame(struct weston_wm_window *window, cairo_t *cr,
+			    int width, int height, uint32_t flags)
+{
+	struct weston_wm *wm = window->wm;
+	struct theme *t = wm->theme;
+	const char *title;
+	int title_only;
+
+	if (window->name)
+		title = window->name;
+	else
+		title = "untitled";
+
+	/* too small to be composed, render it the slow way */
+	if (width <= 2 * FRAME_TEMPLATE_CORNER ||
+	    height <= 2 * FRAME_TEMPLATE_CORNER) {
+		theme_render_frame(t, cr, width, height, title, flags);
+		window->decoration_width = 0;
+		return;
+	}
+
+	title_only = width == window->decoration_width &&
+		height == window->decoration_height &&
+		flags == window->decoration_flags;
+	if (title_only && window->decoration_title &&
+	    strcmp(title, window->decoration_title) == 0)
+		return;
+
+	cairo_save(cr);
+	if (title_only)
+		theme_clip_title(t, cr, width, height, flags);
+	weston_wm_compose_frame(wm, cr, width, height, flags);
+	cairo_restore(cr);
+
+	theme_render_title(t, cr, width, height, title, flags);
+
+	window->decoration_width = width;
+	window->decoration_height = height;
+	window->decoration_flags = flags;
+	free(window->decoration_title);
+	window->decoration_title = strdup(title);
+}
+
 static void
 weston_wm_window_draw_decoration(void *data)
 {
@@ -782,11 +1058,8 @@ weston_wm_window_draw_decoration(void *data)
 	struct theme *t = wm->theme;
 	cairo_t *cr;
 	int x, y, width, height;
-	const char *title;
 	uint32_t flags = 0;
 
-	weston_wm_window_read_properties(window);
-
 	window->repaint_source = NULL;
 
 	weston_wm_window_get_frame_size(window, &width, &height);
@@ -796,18 +1069,14 @@ weston_wm_window_draw_decoration(void *data)
 	cr = cairo_create(window->cairo_surface);
 
 	if (window->fullscreen) {
-		/* nothing */
+		window->decoration_width = 0;
 	} else if (window->decorate) {
 		if (wm->focus_window == window)
 			flags |= THEME_FRAME_ACTIVE;
 
-		if (window->name)
-			title = window->name;
-		else
-			title = "untitled";
-
-		theme_render_frame(t, cr, width, height, title, flags);
+		weston_wm_window_draw_frame(window, cr, width, height, flags);
 	} else {
+		window->decoration_width = 0;
 		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 		cairo_set_source_rgba(cr, 0, 0, 0, 0);
 		cairo_paint(cr);
@@ -877,19 +1146,14 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	if (!window)
 		return;
 
-	window->properties_dirty = 1;
-
-	weston_log("XCB_PROPERTY_NOTIFY: window %d, ",
-		property_notify->window);
+	/* The new value is logged and applied when the reply comes in */
 	if (property_notify->state == XCB_PROPERTY_DELETE)
-		weston_log("deleted\n");
-	else
-		read_and_dump_property(wm, property_notify->window,
-				       property_notify->atom);
+		weston_log("XCB_PROPERTY_NOTIFY: window %d, deleted\n",
+			   property_notify->window);
 
-	if (property_notify->atom == wm->atom.net_wm_name ||
-	    property_notify->atom == XCB_ATOM_WM_NAME)
-		weston_wm_window_schedule_repaint(window);
+	weston_wm_fetch_property(wm, property_notify->window,
+				 property_notify->atom,
+				 property_notify->state != XCB_PROPERTY_DELETE);
 }
 
 static void
@@ -911,18 +1175,27 @@ weston_wm_window_create(struct weston_wm *wm,
 	memset(window, 0, sizeof *window);
 	window->wm = wm;
 	window->id = id;
-	window->properties_dirty = 1;
 	window->override_redirect = override;
+	window->decorate = !override;
 	window->width = width;
 	window->height = height;
 
 	hash_table_insert(wm->window_hash, id, window);
+	weston_wm_window_fetch_properties(window);
 }
 
 static void
 weston_wm_window_destroy(struct weston_wm_window *window)
 {
+	struct weston_wm_property_request *req;
+
+	/* replies still to come are for a window that is gone */
+	wl_list_for_each(req, &window->wm->property_request_list, link)
+		if (req->window == window->id)
+			req->window = XCB_WINDOW_NONE;
+
 	hash_table_remove(window->wm->window_hash, window->id);
+	free(window->decoration_title);
 	free(window);
 }
 
@@ -1386,6 +1659,8 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 		count++;
 	}
 
+	weston_wm_poll_property_replies(wm);
+
 	xcb_flush(wm->conn);
 
 	return count;
@@ -1608,6 +1883,7 @@ weston_wm_create(struct weston_xserver *wxs)
 	memset(wm, 0, sizeof *wm);
 	wm->server = wxs;
 	wm->window_hash = hash_table_create();
+	wl_list_init(&wm->property_request_list);
 	if (wm->window_hash == NULL) {
 		free(wm);
 		return NULL;
@@ -1693,12 +1969,15 @@ weston_wm_destroy(struct weston_wm *wm)
 	/* FIXME: Free windows in hash. */
 	hash_table_destroy(wm->window_hash);
 	weston_wm_destroy_cursors(wm);
+	weston_wm_destroy_frame_templates(wm);
+	weston_wm_destroy_property_requests(wm);
 	xcb_disconnect(wm->conn);
 	wl_event_source_remove(wm->source);
 	wl_list_remove(&wm->selection_listener.link);
 	wl_list_remove(&wm->activate_listener.link);
 	wl_list_remove(&wm->kill_listener.link);
 
+	free(wm->source_ring.data);
 	free(wm);
 }
 
@@ -44,6 +44,16 @@ struct weston_xserver {
 	struct wl_listener destroy_listener;
 };
 
+#define SELECTION_RING_CHUNKS 4
+
+/* Wayland source data waiting to be sent to an X client, one INCR
+ * chunk per slot; size[] is indexed by slot, head is the oldest. */
+struct weston_wm_chunk_ring {
+	char *data;
+	int head, count;
+	uint32_t size[SELECTION_RING_CHUNKS];
+};
+
 struct weston_wm {
 	xcb_connection_t *conn;
 	const xcb_query_extension_reply_t *xfixes;
@@ -52,9 +62,15 @@ struct weston_wm {
 	struct hash_table *window_hash;
 	struct weston_xserver *server;
 	xcb_window_t wm_window;
+	/* property reads waiting for their reply, in request order */
+	struct wl_list property_request_list;
 	struct weston_wm_window *focus_window;
 	struct weston_wm_window *focus_latest;
 	struct theme *theme;
+	/* frames rendered once, inactive and active, that window
+	 * decorations are composed from */
+	xcb_pixmap_t frame_pixmap[2];
+	cairo_surface_t *frame_template[2];
 	xcb_cursor_t *cursors;
 	int last_cursor;
 	xcb_render_pictforminfo_t format_rgb, format_rgba;
@@ -70,12 +86,17 @@ struct weston_wm {
 	struct wl_event_source *property_source;
 	xcb_get_property_reply_t *property_reply;
 	int property_start;
-	struct wl_array source_data;
+	struct weston_wm_chunk_ring source_ring;
+	uint32_t selection_chunk_size;
+	struct {
+		uint64_t bytes;
+		uint32_t chunks;
+		uint32_t start;
+	} selection_stats;
 	xcb_selection_request_event_t selection_request;
 	xcb_atom_t selection_target;
 	xcb_timestamp_t selection_timestamp;
 	int selection_property_set;
-	int flush_property_on_delete;
 	struct wl_listener selection_listener;
 
 	struct {
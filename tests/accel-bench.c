@@ -0,0 +1,223 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Replays a pointer motion trace through the acceleration filters and
+ * reports the time spent per event, comparing each table driven curve
+ * with the same curve evaluated for every event.
+ *
+ * The trace is read from the file given on the command line, one event
+ * per line as "time dx dy" with the time in milliseconds.  Without a
+ * file a ten second trace of a 1000 Hz mouse is synthesized.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "filter.h"
+
+#define REPEAT 20
+
+struct trace_event {
+	uint32_t time;
+	double dx, dy;
+};
+
+struct trace {
+	struct trace_event *events;
+	int count;
+};
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static int
+trace_load(struct trace *trace, const char *path)
+{
+	struct trace_event *events = NULL, *e;
+	int count = 0, alloc = 0;
+	unsigned int time;
+	double dx, dy;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "failed to open %s: %m\n", path);
+		return -1;
+	}
+
+	while (fscanf(fp, "%u %lf %lf", &time, &dx, &dy) == 3) {
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			e = realloc(events, alloc * sizeof *e);
+			if (e == NULL)
+				break;
+			events = e;
+		}
+		events[count].time = time;
+		events[count].dx = dx;
+		events[count].dy = dy;
+		count++;
+	}
+	fclose(fp);
+
+	trace->events = events;
+	trace->count = count;
+
+	return count > 0 ? 0 : -1;
+}
+
+/* A sweep from slow to fast and back, changing direction now and then. */
+static void
+trace_synthesize(struct trace *trace)
+{
+	double speed, angle;
+	int i;
+
+	trace->count = 10000;
+	trace->events = malloc(trace->count * sizeof *trace->events);
+	for (i = 0; i < trace->count; i++) {
+		speed = 12.0 * fabs(sin(i * M_PI / 2000.0));
+		angle = (i / 700) * 0.9;
+		trace->events[i].time = i;
+		trace->events[i].dx = rint(speed * cos(angle));
+		trace->events[i].dy = rint(speed * sin(angle));
+	}
+}
+
+static double
+curve_profile(struct weston_motion_filter *filter, void *data,
+	      double velocity, uint32_t time)
+{
+	const struct weston_accel_config *config = data;
+
+	return config->curve(config, velocity);
+}
+
+/* Returns the average time per event in ns, and the resulting motion in
+ * out, one entry per event. */
+static double
+run(struct weston_motion_filter *filter, const struct trace *trace,
+    struct weston_accel_config *config, struct weston_motion_params *out)
+{
+	struct weston_motion_params motion;
+	double start, end;
+	int i, r;
+
+	start = read_timer();
+	for (r = 0; r < REPEAT; r++) {
+		for (i = 0; i < trace->count; i++) {
+			motion.dx = trace->events[i].dx;
+			motion.dy = trace->events[i].dy;
+			weston_filter_dispatch(filter, &motion, config,
+					       trace->events[i].time +
+					       r * (trace->events[trace->count - 1].time + 1000));
+			if (r == 0)
+				out[i] = motion;
+		}
+	}
+	end = read_timer();
+
+	return 1e9 * (end - start) / ((double) REPEAT * trace->count);
+}
+
+static void
+bench(const char *name, struct weston_accel_config *config,
+      const struct trace *trace)
+{
+	struct weston_motion_filter *exact, *table;
+	struct weston_motion_params *a, *b;
+	double t_exact, t_table, err, max_err = 0.0;
+	int i;
+
+	a = malloc(trace->count * sizeof *a);
+	b = malloc(trace->count * sizeof *b);
+	exact = create_pointer_accelator_filter(curve_profile);
+	table = create_pointer_accelerator_filter_from_config(config);
+	if (!a || !b || !exact || !table) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	t_exact = run(exact, trace, config, a);
+	t_table = run(table, trace, config, b);
+
+	for (i = 0; i < trace->count; i++) {
+		err = fabs(a[i].dx - b[i].dx) + fabs(a[i].dy - b[i].dy);
+		if (err > max_err)
+			max_err = err;
+	}
+
+	printf("%-10s exact %7.1f ns/event, table %7.1f ns/event, "
+	       "max deviation %.4f\n", name, t_exact, t_table, max_err);
+
+	exact->interface->destroy(exact);
+	table->interface->destroy(table);
+	free(a);
+	free(b);
+}
+
+int main(int argc, char *argv[])
+{
+	struct weston_accel_config config;
+	struct trace trace;
+
+	if (argc > 1) {
+		if (trace_load(&trace, argv[1]) < 0)
+			return EXIT_FAILURE;
+	} else {
+		trace_synthesize(&trace);
+	}
+
+	printf("%d events, replayed %d times\n", trace.count, REPEAT);
+
+	memset(&config, 0, sizeof config);
+	config.curve = weston_accel_curve_from_name("flat");
+	config.factor = 1.5;
+	bench("flat", &config, &trace);
+
+	config.curve = weston_accel_curve_from_name("linear");
+	config.factor = 0.5;
+	config.min_factor = 0.5;
+	config.max_factor = 2.0;
+	bench("linear", &config, &trace);
+
+	config.curve = weston_accel_curve_from_name("adaptive");
+	config.factor = 0.4;
+	config.min_factor = 1.0;
+	config.max_factor = 3.0;
+	config.threshold = 2.0;
+	bench("adaptive", &config, &trace);
+
+	free(trace.events);
+
+	return EXIT_SUCCESS;
+}
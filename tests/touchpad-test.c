@@ -0,0 +1,557 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Replays multitouch evdev traces through the touchpad dispatch on a
+ * virtual clock and checks the pointer events that come out.
+ *
+ * Without arguments a set of built in gestures is run.  With a file
+ * argument the trace in it is replayed instead and the resulting
+ * events are printed, one input event per line as
+ * "time type code value" with the time in milliseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "compositor.h"
+#include "evdev.h"
+#include "filter.h"
+
+#define PAD_WIDTH 3000
+#define PAD_HEIGHT 2000
+
+struct wl_event_source {
+	wl_event_loop_timer_func_t func;
+	void *data;
+	uint32_t expire;
+	int armed;
+	struct wl_list link;
+};
+
+static struct {
+	uint32_t now;
+	struct wl_list timers;
+	int verbose;
+
+	double motion_x, motion_y;
+	int motion_events;
+	double axis[2];
+	int axis_events;
+	int buttons[3];
+	int pressed;
+} sim;
+
+static struct weston_compositor compositor;
+static struct weston_seat seat;
+static struct evdev_device device;
+static struct evdev_dispatch *dispatch;
+
+/* Stand ins for the compositor and event loop. */
+
+uint32_t
+weston_compositor_get_time(void)
+{
+	return sim.now;
+}
+
+int
+weston_log(const char *fmt, ...)
+{
+	va_list ap;
+	int l = 0;
+
+	if (sim.verbose) {
+		va_start(ap, fmt);
+		l = vprintf(fmt, ap);
+		va_end(ap);
+	}
+
+	return l;
+}
+
+void
+notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
+	      enum wl_pointer_button_state state)
+{
+	if (sim.verbose)
+		printf("%u button %d %s\n", time, button,
+		       state ? "pressed" : "released");
+
+	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
+		sim.pressed++;
+		return;
+	}
+
+	sim.pressed--;
+	switch (button) {
+	case BTN_LEFT:
+		sim.buttons[0]++;
+		break;
+	case BTN_RIGHT:
+		sim.buttons[1]++;
+		break;
+	case BTN_MIDDLE:
+		sim.buttons[2]++;
+		break;
+	}
+}
+
+void
+notify_axis(struct weston_seat *seat, uint32_t time, uint32_t axis,
+	    wl_fixed_t value)
+{
+	if (sim.verbose)
+		printf("%u axis %u %.2f\n", time, axis,
+		       wl_fixed_to_double(value));
+
+	sim.axis[axis] += wl_fixed_to_double(value);
+	sim.axis_events++;
+}
+
+void
+evdev_device_get_accel_config(struct evdev_device *device,
+			      const char *section_name,
+			      struct weston_accel_config *config)
+{
+}
+
+struct wl_event_loop *
+wl_display_get_event_loop(struct wl_display *display)
+{
+	return (struct wl_event_loop *) display;
+}
+
+struct wl_event_source *
+wl_event_loop_add_timer(struct wl_event_loop *loop,
+			wl_event_loop_timer_func_t func, void *data)
+{
+	struct wl_event_source *source;
+
+	source = malloc(sizeof *source);
+	if (source == NULL)
+		return NULL;
+
+	source->func = func;
+	source->data = data;
+	source->armed = 0;
+	wl_list_insert(&sim.timers, &source->link);
+
+	return source;
+}
+
+int
+wl_event_source_timer_update(struct wl_event_source *source, int ms_delay)
+{
+	source->armed = ms_delay > 0;
+	source->expire = sim.now + ms_delay;
+
+	return 0;
+}
+
+int
+wl_event_source_remove(struct wl_event_source *source)
+{
+	wl_list_remove(&source->link);
+	free(source);
+
+	return 0;
+}
+
+/* Runs the timers that expire up to the given time, in order. */
+static void
+advance_to(uint32_t time)
+{
+	struct wl_event_source *source, *next;
+
+	for (;;) {
+		next = NULL;
+		wl_list_for_each(source, &sim.timers, link) {
+			if (!source->armed ||
+			    (int32_t) (source->expire - time) > 0)
+				continue;
+			if (next == NULL ||
+			    (int32_t) (source->expire - next->expire) < 0)
+				next = source;
+		}
+		if (next == NULL)
+			break;
+
+		sim.now = next->expire;
+		next->armed = 0;
+		next->func(next->data);
+	}
+
+	sim.now = time;
+}
+
+static void
+advance(uint32_t ms)
+{
+	advance_to(sim.now + ms);
+}
+
+static void
+event(int type, int code, int value)
+{
+	struct input_event e;
+
+	memset(&e, 0, sizeof e);
+	e.type = type;
+	e.code = code;
+	e.value = value;
+	dispatch->interface->process(dispatch, &device, &e, sim.now);
+
+	/* What evdev_flush_motion() does with the touchpad's motion. */
+	if (device.pending_events & EVDEV_RELATIVE_MOTION) {
+		sim.motion_x += wl_fixed_to_double(device.rel.dx);
+		sim.motion_y += wl_fixed_to_double(device.rel.dy);
+		sim.motion_events++;
+		device.rel.dx = 0;
+		device.rel.dy = 0;
+	}
+	device.pending_events = 0;
+}
+
+static void
+sync_report(void)
+{
+	event(EV_SYN, SYN_REPORT, 0);
+}
+
+static void
+touch(int slot, int x, int y)
+{
+	event(EV_ABS, ABS_MT_SLOT, slot);
+	event(EV_ABS, ABS_MT_TRACKING_ID, 100 + slot);
+	event(EV_ABS, ABS_MT_POSITION_X, x);
+	event(EV_ABS, ABS_MT_POSITION_Y, y);
+}
+
+static void
+move(int slot, int x, int y)
+{
+	event(EV_ABS, ABS_MT_SLOT, slot);
+	event(EV_ABS, ABS_MT_POSITION_X, x);
+	event(EV_ABS, ABS_MT_POSITION_Y, y);
+}
+
+static void
+release(int slot)
+{
+	event(EV_ABS, ABS_MT_SLOT, slot);
+	event(EV_ABS, ABS_MT_TRACKING_ID, -1);
+}
+
+static void
+setup(void)
+{
+	memset(&sim, 0, sizeof sim);
+	wl_list_init(&sim.timers);
+	sim.now = 1000;
+	sim.verbose = getenv("TOUCHPAD_TEST_VERBOSE") != NULL;
+
+	memset(&compositor, 0, sizeof compositor);
+	compositor.wl_display = (struct wl_display *) &compositor;
+	memset(&seat, 0, sizeof seat);
+	seat.compositor = &compositor;
+
+	memset(&device, 0, sizeof device);
+	device.seat = &seat;
+	device.fd = -1;
+	device.devname = "virtual touchpad";
+	device.is_mt = 1;
+	device.abs.min_x = 0;
+	device.abs.max_x = PAD_WIDTH;
+	device.abs.min_y = 0;
+	device.abs.max_y = PAD_HEIGHT;
+
+	dispatch = evdev_touchpad_create(&device);
+	if (dispatch == NULL) {
+		fprintf(stderr, "failed to create touchpad dispatch\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+teardown(void)
+{
+	dispatch->interface->destroy(dispatch);
+}
+
+#define check(name, cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s: %s failed\n", name, #cond);	\
+		failed++;						\
+	}								\
+} while (0)
+
+static int failed;
+
+static void
+test_tap(void)
+{
+	setup();
+	touch(0, 1500, 1000);
+	sync_report();
+	advance(60);
+	release(0);
+	sync_report();
+	advance(500);
+
+	check("tap", sim.buttons[0] == 1);
+	check("tap", sim.buttons[1] == 0 && sim.pressed == 0);
+	check("tap", sim.motion_events == 0);
+	teardown();
+}
+
+static void
+test_two_finger_tap(void)
+{
+	setup();
+	touch(0, 1400, 1000);
+	sync_report();
+	advance(10);
+	touch(1, 1700, 1000);
+	sync_report();
+	advance(60);
+	release(0);
+	release(1);
+	sync_report();
+	advance(500);
+
+	check("two finger tap", sim.buttons[1] == 1);
+	check("two finger tap", sim.buttons[0] == 0 && sim.pressed == 0);
+	teardown();
+}
+
+static void
+test_long_press(void)
+{
+	setup();
+	touch(0, 1500, 1000);
+	sync_report();
+	advance(400);
+	release(0);
+	sync_report();
+	advance(500);
+
+	check("long press", sim.buttons[0] == 0);
+	teardown();
+}
+
+static void
+test_motion(void)
+{
+	int i;
+
+	setup();
+	touch(0, 1000, 1000);
+	sync_report();
+	for (i = 1; i <= 40; i++) {
+		advance(10);
+		move(0, 1000 + i * 20, 1000);
+		sync_report();
+	}
+	release(0);
+	sync_report();
+	advance(500);
+
+	check("motion", sim.motion_events > 0);
+	check("motion", sim.motion_x > 0.0);
+	check("motion", sim.buttons[0] == 0);
+	check("motion", sim.axis_events == 0);
+	teardown();
+}
+
+static void
+test_edge_palm(void)
+{
+	int i;
+
+	setup();
+	touch(0, 50, 1000);
+	sync_report();
+	for (i = 1; i <= 40; i++) {
+		advance(10);
+		move(0, 50, 1000 + i * 10);
+		sync_report();
+	}
+	release(0);
+	sync_report();
+	advance(500);
+
+	check("edge palm", sim.motion_events == 0);
+	check("edge palm", sim.buttons[0] == 0);
+	teardown();
+}
+
+static void
+test_palm_beside_finger(void)
+{
+	int i;
+
+	setup();
+	touch(0, 50, 1500);
+	sync_report();
+	advance(300);
+	touch(1, 1500, 1000);
+	sync_report();
+	for (i = 1; i <= 40; i++) {
+		advance(10);
+		move(1, 1500 + i * 20, 1000);
+		sync_report();
+	}
+
+	/* the palm does not turn the motion into scrolling */
+	check("palm beside finger", sim.axis_events == 0);
+	check("palm beside finger", sim.motion_x > 0.0);
+	release(0);
+	release(1);
+	sync_report();
+	teardown();
+}
+
+static void
+test_scroll(void)
+{
+	double scrolled;
+	int i, during;
+
+	setup();
+	touch(0, 1400, 600);
+	touch(1, 1700, 600);
+	sync_report();
+	for (i = 1; i <= 30; i++) {
+		advance(10);
+		move(0, 1400, 600 + i * 25);
+		move(1, 1700, 600 + i * 25);
+		sync_report();
+	}
+	scrolled = sim.axis[WL_POINTER_AXIS_VERTICAL_SCROLL];
+	during = sim.axis_events;
+	release(0);
+	release(1);
+	sync_report();
+	advance(2000);
+
+	check("scroll", scrolled > 0.0);
+	check("scroll", sim.motion_events == 0);
+	/* the scroll carries on after the fingers lift, and stops */
+	check("scroll", sim.axis_events > during);
+	check("scroll", sim.axis[WL_POINTER_AXIS_VERTICAL_SCROLL] > scrolled);
+	during = sim.axis_events;
+	advance(2000);
+	check("scroll", sim.axis_events == during);
+	teardown();
+}
+
+static void
+test_scroll_stopped_by_touch(void)
+{
+	int i, during;
+
+	setup();
+	touch(0, 1400, 600);
+	touch(1, 1700, 600);
+	sync_report();
+	for (i = 1; i <= 30; i++) {
+		advance(10);
+		move(0, 1400, 600 + i * 25);
+		move(1, 1700, 600 + i * 25);
+		sync_report();
+	}
+	release(0);
+	release(1);
+	sync_report();
+	advance(50);
+	touch(0, 1500, 1000);
+	sync_report();
+	during = sim.axis_events;
+	advance(1000);
+
+	check("scroll stopped by touch", sim.axis_events == during);
+	release(0);
+	sync_report();
+	teardown();
+}
+
+static int
+replay(const char *path)
+{
+	unsigned int time;
+	int type, code, value;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "failed to open %s: %m\n", path);
+		return -1;
+	}
+
+	setup();
+	sim.verbose = 1;
+	if (fscanf(fp, "%u %i %i %i", &time, &type, &code, &value) == 4) {
+		sim.now = time;
+		do {
+			advance_to(time);
+			event(type, code, value);
+		} while (fscanf(fp, "%u %i %i %i",
+				&time, &type, &code, &value) == 4);
+	}
+	advance(2000);
+	fclose(fp);
+
+	printf("motion %.2f %.2f in %d events, scroll %.2f %.2f "
+	       "in %d events\n", sim.motion_x, sim.motion_y,
+	       sim.motion_events, sim.axis[WL_POINTER_AXIS_HORIZONTAL_SCROLL],
+	       sim.axis[WL_POINTER_AXIS_VERTICAL_SCROLL], sim.axis_events);
+	teardown();
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		return replay(argv[1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	test_tap();
+	test_two_finger_tap();
+	test_long_press();
+	test_motion();
+	test_edge_palm();
+	test_palm_beside_finger();
+	test_scroll();
+	test_scroll_stopped_by_touch();
+
+	if (failed) {
+		fprintf(stderr, "%d checks failed\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	printf("all touchpad checks passed\n");
+
+	return EXIT_SUCCESS;
+}
@@ -126,6 +126,8 @@ move_pointer(struct wl_client *client, struct wl_resource *resource,
 	notify_motion(seat, 100,
 		      wl_fixed_from_int(x) - pointer->x,
 		      wl_fixed_from_int(y) - pointer->y);
+	/* deliver the motion before the client's next roundtrip returns */
+	weston_pointer_flush_motion(pointer);
 
 	notify_pointer_position(test, resource);
 }
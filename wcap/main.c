@@ -31,6 +31,12 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <cairo.h>
 
@@ -93,8 +99,88 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+#ifdef __SSE2__
+/* Convert 8 pixels from each of two rows.  The coefficients are the
+ * same as in rgb_to_yuv(), split so that they fit the signed 16 bit
+ * multiplicands of pmaddwd, which keeps the result bit exact with the
+ * scalar path. */
+static inline void
+convert_8x2_sse2(uint32_t format, const uint32_t *p1, const uint32_t *p2,
+		 unsigned char *y1, unsigned char *y2,
+		 unsigned char *u, unsigned char *v)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i rg_coef = _mm_set1_epi32((19235 << 16) | 19595);
+	const __m128i gb_coef = _mm_set1_epi32((7472 << 16) | 19234);
+	const __m128i u_coef = _mm_set1_epi32((23363 << 16) | 23364);
+	const __m128i v_coef = _mm_set1_epi32((18481 << 16) | 18481);
+	const __m128i bias = _mm_set1_epi32(128);
+	const uint32_t *rows[2] = { p1, p2 };
+	unsigned char *y_out[2] = { y1, y2 };
+	__m128i a, b, r, g, bl, y, ylo, yhi, su, sv, tmp;
+	int i, rshift, bshift;
+
+	if (format == WCAP_FORMAT_XRGB8888) {
+		rshift = 16;
+		bshift = 0;
+	} else {
+		rshift = 0;
+		bshift = 16;
+	}
+
+	su = zero;
+	sv = zero;
+	for (i = 0; i < 2; i++) {
+		a = _mm_loadu_si128((const __m128i *) rows[i]);
+		b = _mm_loadu_si128((const __m128i *) (rows[i] + 4));
+
+		r = _mm_packs_epi32(
+			_mm_and_si128(_mm_srl_epi32(a, _mm_cvtsi32_si128(rshift)), mask),
+			_mm_and_si128(_mm_srl_epi32(b, _mm_cvtsi32_si128(rshift)), mask));
+		g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), mask),
+				    _mm_and_si128(_mm_srli_epi32(b, 8), mask));
+		bl = _mm_packs_epi32(
+			_mm_and_si128(_mm_srl_epi32(a, _mm_cvtsi32_si128(bshift)), mask),
+			_mm_and_si128(_mm_srl_epi32(b, _mm_cvtsi32_si128(bshift)), mask));
+
+		ylo = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpacklo_epi16(r, g), rg_coef),
+			_mm_madd_epi16(_mm_unpacklo_epi16(g, bl), gb_coef));
+		yhi = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpackhi_epi16(r, g), rg_coef),
+			_mm_madd_epi16(_mm_unpackhi_epi16(g, bl), gb_coef));
+		y = _mm_packs_epi32(_mm_srli_epi32(ylo, 16),
+				    _mm_srli_epi32(yhi, 16));
+
+		_mm_storel_epi64((__m128i *) y_out[i], _mm_packus_epi16(y, y));
+
+		/* Sum r - y and b - y over horizontal pixel pairs. */
+		su = _mm_add_epi32(su, _mm_madd_epi16(_mm_sub_epi16(r, y), one));
+		sv = _mm_add_epi32(sv, _mm_madd_epi16(_mm_sub_epi16(bl, y), one));
+	}
+
+	/* su and sv now hold the 2x2 block sums, which fit in 16 bits. */
+	su = _mm_packs_epi32(su, su);
+	sv = _mm_packs_epi32(sv, sv);
+	su = _mm_madd_epi16(_mm_unpacklo_epi16(su, su), u_coef);
+	sv = _mm_madd_epi16(_mm_unpacklo_epi16(sv, sv), v_coef);
+	su = _mm_add_epi32(_mm_srai_epi32(su, 18), bias);
+	sv = _mm_add_epi32(_mm_srai_epi32(sv, 18), bias);
+
+	tmp = _mm_packs_epi32(su, sv);
+	tmp = _mm_packus_epi16(tmp, tmp);
+	i = _mm_cvtsi128_si32(tmp);
+	memcpy(u, &i, 4);
+	i = _mm_cvtsi128_si32(_mm_srli_si128(tmp, 4));
+	memcpy(v, &i, 4);
+}
+#endif
+
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yv12(struct wcap_decoder *decoder,
+		uint32_t *frame, unsigned char *out)
 {
 	unsigned char *y1, *y2, *u, *v;
 	uint32_t *p1, *p2, *end;
@@ -108,10 +194,23 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 		y2 = y1 + stride0;
 		v = out + stride0 * decoder->height + stride1 * i / 2;
 		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
+		p1 = frame + decoder->width * i;
 		p2 = p1 + decoder->width;
 		end = p1 + decoder->width;
 
+#ifdef __SSE2__
+		while (p1 + 8 <= end) {
+			convert_8x2_sse2(format, p1, p2, y1, y2, u, v);
+
+			y1 += 8;
+			p1 += 8;
+			y2 += 8;
+			p2 += 8;
+			u += 4;
+			v += 4;
+		}
+#endif
+
 		while (p1 < end) {
 			u_accum = 0;
 			v_accum = 0;
@@ -132,19 +231,172 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 	}
 }
 
+/* The yuv4mpeg2 output is pipelined: the main thread decodes and hands
+ * copies of the frames to a ring of slots, a pool of workers converts
+ * them to YV12 and the main thread writes them out in frame order. */
+
+enum slot_state {
+	SLOT_IDLE,
+	SLOT_PENDING,
+	SLOT_CONVERTING,
+	SLOT_DONE
+};
+
+struct yuv_slot {
+	enum slot_state state;
+	uint32_t *frame;
+	unsigned char *out;
+};
+
+struct yuv_pipeline {
+	struct wcap_decoder *decoder;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+	struct yuv_slot *slots;
+	int nslots;
+	int size;
+	int submitted, converted, written;
+	int done;
+};
+
+static void *
+yuv_worker(void *data)
+{
+	struct yuv_pipeline *pipeline = data;
+	struct yuv_slot *slot;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	while (1) {
+		while (pipeline->converted == pipeline->submitted &&
+		       !pipeline->done)
+			pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+		if (pipeline->converted == pipeline->submitted)
+			break;
+
+		slot = &pipeline->slots[pipeline->converted % pipeline->nslots];
+		pipeline->converted++;
+		slot->state = SLOT_CONVERTING;
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		convert_to_yv12(pipeline->decoder, slot->frame, slot->out);
+
+		pthread_mutex_lock(&pipeline->mutex);
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	return NULL;
+}
+
+static int
+yuv_pipeline_init(struct yuv_pipeline *pipeline,
+		  struct wcap_decoder *decoder, int nthreads)
+{
+	int i, frame_size;
+
+	memset(pipeline, 0, sizeof *pipeline);
+	pipeline->decoder = decoder;
+	pipeline->size = decoder->width * decoder->height * 3 / 2;
+	pipeline->nthreads = nthreads;
+	pipeline->nslots = nthreads * 2;
+	pthread_mutex_init(&pipeline->mutex, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+
+	frame_size = decoder->width * decoder->height * 4;
+	pipeline->slots = calloc(pipeline->nslots, sizeof *pipeline->slots);
+	if (pipeline->slots == NULL)
+		return -1;
+	for (i = 0; i < pipeline->nslots; i++) {
+		pipeline->slots[i].frame = malloc(frame_size);
+		pipeline->slots[i].out = malloc(pipeline->size);
+		if (!pipeline->slots[i].frame || !pipeline->slots[i].out)
+			return -1;
+	}
+
+	pipeline->threads = calloc(nthreads, sizeof *pipeline->threads);
+	if (pipeline->threads == NULL)
+		return -1;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&pipeline->threads[i], NULL,
+				   yuv_worker, pipeline) != 0)
+			return -1;
+
+	return 0;
+}
+
+/* Called with the mutex held.  Waits for the oldest outstanding frame
+ * to be converted and writes it to stdout. */
 static void
-output_yuv_frame(struct wcap_decoder *decoder)
+yuv_pipeline_write_next(struct yuv_pipeline *pipeline)
 {
-	static unsigned char *out;
-	int size;
+	struct yuv_slot *slot;
 
-	size = decoder->width * decoder->height * 3 / 2;
-	if (out == NULL)
-		out = malloc(size);
+	slot = &pipeline->slots[pipeline->written % pipeline->nslots];
+	while (slot->state != SLOT_DONE)
+		pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+	pthread_mutex_unlock(&pipeline->mutex);
 
-	convert_to_yv12(decoder, out);
 	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	fwrite(slot->out, 1, pipeline->size, stdout);
+
+	pthread_mutex_lock(&pipeline->mutex);
+	slot->state = SLOT_IDLE;
+	pipeline->written++;
+}
+
+static void
+yuv_pipeline_submit(struct yuv_pipeline *pipeline, uint32_t *frame)
+{
+	struct yuv_slot *slot;
+	int frame_size;
+
+	frame_size = pipeline->decoder->width * pipeline->decoder->height * 4;
+	slot = &pipeline->slots[pipeline->submitted % pipeline->nslots];
+
+	pthread_mutex_lock(&pipeline->mutex);
+	if (pipeline->submitted - pipeline->written == pipeline->nslots)
+		yuv_pipeline_write_next(pipeline);
+	while (pipeline->written < pipeline->submitted &&
+	       pipeline->slots[pipeline->written % pipeline->nslots].state ==
+	       SLOT_DONE)
+		yuv_pipeline_write_next(pipeline);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	memcpy(slot->frame, frame, frame_size);
+
+	pthread_mutex_lock(&pipeline->mutex);
+	slot->state = SLOT_PENDING;
+	pipeline->submitted++;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->mutex);
+}
+
+static void
+yuv_pipeline_finish(struct yuv_pipeline *pipeline)
+{
+	int i;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	while (pipeline->written < pipeline->submitted)
+		yuv_pipeline_write_next(pipeline);
+	pipeline->done = 1;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	for (i = 0; i < pipeline->nthreads; i++)
+		pthread_join(pipeline->threads[i], NULL);
+
+	for (i = 0; i < pipeline->nslots; i++) {
+		free(pipeline->slots[i].frame);
+		free(pipeline->slots[i].out);
+	}
+	free(pipeline->slots);
+	free(pipeline->threads);
+	pthread_cond_destroy(&pipeline->cond);
+	pthread_mutex_destroy(&pipeline->mutex);
 }
 
 static void
@@ -152,13 +404,15 @@ usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"\t[--rate=<num:denom>] [--threads=<n>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--threads=<n>\t\tnumber of yuv conversion threads,\n"
+		"\t\t\t\tdefaults to the number of cpus\n\n");
 
 	exit(exit_code);
 }
@@ -166,10 +420,13 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
+	struct yuv_pipeline pipeline;
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
+	int num = 30, denom = 1, nthreads = 0;
 	char filename[200];
 	uint32_t msecs, frame_time, *frame, frame_size;
+	struct timespec start, end;
+	double elapsed;
 
 	for (i = 1, j = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--yuv4mpeg2") == 0) {
@@ -184,6 +441,8 @@ int main(int argc, char *argv[])
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
 			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			;
 		} else if (strcmp(argv[i], "--") == 0) {
 			break;
 		} else if (argv[i][0] == '-') {
@@ -218,8 +477,18 @@ int main(int argc, char *argv[])
 		printf("YUV4MPEG2 C420jpeg W%d H%d F%d:%d Ip A0:0\n",
 		       decoder->width, decoder->height, num, denom);
 		fflush(stdout);
+
+		if (nthreads <= 0)
+			nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads <= 0)
+			nthreads = 1;
+		if (yuv_pipeline_init(&pipeline, decoder, nthreads) < 0) {
+			fprintf(stderr, "failed to set up conversion threads\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	i = 0;
 	has_frame = wcap_decoder_get_frame(decoder);
 	msecs = decoder->msecs;
@@ -236,16 +505,28 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "wrote %s\n", filename);
 		}
 		if (yuv4mpeg2)
-			output_yuv_frame(decoder);
+			yuv_pipeline_submit(&pipeline, frame);
 		i++;
 		msecs += frame_time;
 		while (decoder->msecs < msecs && has_frame)
 			has_frame = wcap_decoder_get_frame(decoder);
 	}
 
+	if (yuv4mpeg2)
+		yuv_pipeline_finish(&pipeline);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(frame);
+
 	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
 		decoder->width, decoder->height, i);
 
+	elapsed = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	if (yuv4mpeg2 && elapsed > 0)
+		fprintf(stderr, "converted %d frames in %.2fs "
+			"(%.1f frames/sec, %d threads)\n",
+			i, elapsed, i / elapsed, nthreads);
+
 	wcap_decoder_destroy(decoder);
 
 	return EXIT_SUCCESS;